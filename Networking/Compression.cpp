@@ -0,0 +1,170 @@
+#include "Compression.h"
+#include <vector>
+#include <cstring>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+
+//Shared by every peer, changing it requires bumping COMPRESSION_VERSION.
+//Laid out like real serialized messages (keys come out of std::map in alphabetical order) so whole fields match.
+static const char s_dictionary[] =
+	"{key:ACCEPT,netID:0,myNetID:1}{key:COMPRESSION,netID:1}"
+	"{ID:1,key:ENDGAME,netID:1}{ID:1,key:DESTROY,netID:1}"
+	"{key:SWAPPEDITEM,netID:1}{key:TRYSWAPITEM,netID:1}{key:TRIGGER,netID:1}"
+	"{key:GHOSTTRIGGER,netID:1}{key:GHOSTPOSSESS,netID:1}{key:GHOSTUNPOSSESS,netID:1}"
+	"{key:GHOSTMOVEPOSSESSION,netID:1,xVel:0.000000,yVel:0.000000}"
+	"{key:HURT,netID:1,newHealth:100}{animID:1,animReturn:-1,key:ANIMATE,netID:1}"
+	"{key:CREATE,netID:1,rotation:0.000000,scale:1.000000,x:0.000000,y:0.000000,z:0.000000}"
+	"{key:UPDATE,netID:1,rotation:0.000000,scale:1.000000,vecX:0.000000,vecY:0.000000,x:0.000000,y:0.000000,z:0.000000}";
+static const int s_dictionaryLength = sizeof(s_dictionary) - 1;
+
+static Uint32 hashSequence(const unsigned char* p)
+{
+	Uint32 value;
+	memcpy(&value, p, sizeof(value));
+	return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void writeLength(std::string& out, int length)
+{
+	while (length >= 255)
+	{
+		out += (char)255;
+		length -= 255;
+	}
+	out += (char)length;
+}
+
+static void writeSequence(std::string& out, const unsigned char* literals, int literalLength, int offset, int matchLength)
+{
+	int matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+	out += (char)(((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+	if (literalLength >= 15)
+		writeLength(out, literalLength - 15);
+	out.append((const char*)literals, literalLength);
+
+	//Last sequence carries literals only
+	if (matchLength == 0)
+		return;
+	out += (char)(offset & 0xFF);
+	out += (char)(offset >> 8);
+	if (matchCode >= 15)
+		writeLength(out, matchCode - 15);
+}
+
+static bool readLength(const unsigned char*& ip, const unsigned char* end, int& length)
+{
+	unsigned char byte;
+	do
+	{
+		if (ip >= end)
+			return false;
+		byte = *ip++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+std::string Compression::compress(const std::string& packet)
+{
+	std::string window = std::string(s_dictionary, s_dictionaryLength) + packet;
+	const unsigned char* base = (const unsigned char*)window.data();
+	int end = (int)window.size();
+	std::vector<int> table(1 << HASH_BITS, -1);
+
+	for (int i = 0; i + MIN_MATCH <= s_dictionaryLength; i++)
+		table[hashSequence(base + i)] = i;
+
+	std::string out(COMPRESSION_HEADER_SIZE, '\0');
+	out.reserve(COMPRESSION_HEADER_SIZE + packet.size());
+	int anchor = s_dictionaryLength;
+	int pos = s_dictionaryLength;
+	while (pos + MIN_MATCH <= end)
+	{
+		Uint32 hash = hashSequence(base + pos);
+		int candidate = table[hash];
+		table[hash] = pos;
+		if (candidate < 0 || pos - candidate > MAX_OFFSET || memcmp(base + candidate, base + pos, MIN_MATCH) != 0)
+		{
+			pos++;
+			continue;
+		}
+
+		int matchLength = MIN_MATCH;
+		while (pos + matchLength < end && base[candidate + matchLength] == base[pos + matchLength])
+			matchLength++;
+		writeSequence(out, base + anchor, pos - anchor, pos - candidate, matchLength);
+
+		//Index the matched bytes too, batches repeat whole messages so this pays off
+		for (int i = pos + 1; i < pos + matchLength && i + MIN_MATCH <= end; i++)
+			table[hashSequence(base + i)] = i;
+		pos += matchLength;
+		anchor = pos;
+	}
+	writeSequence(out, base + anchor, end - anchor, 0, 0);
+
+	out[0] = (char)COMPRESSION_MARKER;
+	SDLNet_Write32((Uint32)packet.size(), &out[1]);
+	SDLNet_Write32((Uint32)(out.size() - COMPRESSION_HEADER_SIZE), &out[5]);
+	return out;
+}
+
+int Compression::frameLength(const char* frame, int len)
+{
+	if (len < COMPRESSION_HEADER_SIZE || (unsigned char)frame[0] != COMPRESSION_MARKER)
+		return -1;
+	return COMPRESSION_HEADER_SIZE + (int)SDLNet_Read32(frame + 5);
+}
+
+bool Compression::decompress(const char* frame, int len, std::string& packet)
+{
+	if (frameLength(frame, len) != len)
+		return false;
+	Uint32 rawLength = SDLNet_Read32(frame + 1);
+	if (rawLength > COMPRESSION_MAX_RAW_SIZE)
+		return false;
+
+	size_t expected = s_dictionaryLength + rawLength;
+	std::string window(s_dictionary, s_dictionaryLength);
+	window.reserve(expected);
+
+	const unsigned char* ip = (const unsigned char*)frame + COMPRESSION_HEADER_SIZE;
+	const unsigned char* end = (const unsigned char*)frame + len;
+	while (ip < end)
+	{
+		unsigned char token = *ip++;
+
+		int literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(ip, end, literalLength))
+			return false;
+		if (end - ip < literalLength || window.size() + literalLength > expected)
+			return false;
+		window.append((const char*)ip, literalLength);
+		ip += literalLength;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return false;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		int matchLength = token & 0x0F;
+		if (matchLength == 15 && !readLength(ip, end, matchLength))
+			return false;
+		matchLength += MIN_MATCH;
+		if (offset == 0 || offset > window.size() || window.size() + matchLength > expected)
+			return false;
+
+		//Byte by byte, matches may overlap the bytes they produce
+		size_t from = window.size() - offset;
+		for (int i = 0; i < matchLength; i++)
+			window += window[from + i];
+	}
+
+	if (window.size() != expected)
+		return false;
+	packet = window.substr(s_dictionaryLength);
+	return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include "GLHeaders.h"
+
+//First byte of a compressed TCP frame. Plain packets always start with '['
+#define COMPRESSION_MARKER 0x01
+//Bump when the codec or the static dictionary changes, peers only compress if versions match
+#define COMPRESSION_VERSION 1
+//Packets smaller than this are sent as plain text, the header would eat most of the gain
+#define COMPRESSION_THRESHOLD 256
+//Marker + raw length + compressed length
+#define COMPRESSION_HEADER_SIZE 9
+#define COMPRESSION_MAX_RAW_SIZE (1 << 20)
+
+/*
+	Compression
+
+	LZ77 block codec (LZ4-style tokens) primed with a static dictionary of our message vocabulary
+	("netID:", "key:UPDATE", "rotation:", ".000000,", ...), so even the first message in a batch
+	gets back-references.
+
+	Frame layout: [COMPRESSION_MARKER][raw length, 4 bytes][compressed length, 4 bytes][block]
+*/
+class Compression
+{
+public:
+	/*
+	Compresses a serialized packet into a complete frame, header included.
+	*/
+	static std::string compress(const std::string& packet);
+
+	/*
+	Returns the full frame length (header + block) once the header has been received, or -1 if len is too short.
+	*/
+	static int frameLength(const char* frame, int len);
+
+	/*
+	Decompresses a complete frame produced by compress. Returns false on a malformed frame.
+	*/
+	static bool decompress(const char* frame, int len, std::string& packet);
+};
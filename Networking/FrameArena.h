@@ -0,0 +1,86 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstring>
+#include <new>
+
+//Allocations bigger than this get a block of their own
+#define FRAME_ARENA_BLOCK 65536
+
+/*
+	Bump allocator for data that lives for one frame of networking.
+
+	Allocating moves a pointer forward, reset drops everything at once. Blocks are kept across resets,
+	so once the arena has grown to a frame's worth of messages it stops touching the heap.
+	Not thread safe, each arena belongs to the thread that sends or dispatches.
+*/
+class FrameArena
+{
+private:
+	std::vector<char*> m_blocks;
+	std::vector<size_t> m_sizes;
+	size_t m_block = 0;
+	size_t m_offset = 0;
+	//Strings handed out as message values, destroyed on reset in case one outgrew its inline buffer
+	std::vector<std::string*> m_strings;
+
+public:
+	FrameArena() {}
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	~FrameArena()
+	{
+		reset();
+		for (size_t i = 0; i < m_blocks.size(); ++i)
+			delete[] m_blocks[i];
+	}
+
+	char* allocate(size_t size)
+	{
+		size = (size + 7) & ~(size_t)7;
+		while (m_block < m_blocks.size() && m_offset + size > m_sizes[m_block])
+		{
+			m_block++;
+			m_offset = 0;
+		}
+		if (m_block == m_blocks.size())
+		{
+			size_t blockSize = size > FRAME_ARENA_BLOCK ? size : FRAME_ARENA_BLOCK;
+			m_blocks.push_back(new char[blockSize]);
+			m_sizes.push_back(blockSize);
+			m_offset = 0;
+		}
+		char* memory = m_blocks[m_block] + m_offset;
+		m_offset += size;
+		return memory;
+	}
+
+	const char* copy(const char* data, size_t length)
+	{
+		char* memory = allocate(length);
+		memcpy(memory, data, length);
+		return memory;
+	}
+
+	std::string* makeString(const char* data, size_t length)
+	{
+		std::string* string = new (allocate(sizeof(std::string))) std::string(data, length);
+		m_strings.push_back(string);
+		return string;
+	}
+
+	void reset()
+	{
+		for (size_t i = 0; i < m_strings.size(); ++i)
+			m_strings[i]->~basic_string();
+		m_strings.clear();
+		m_block = 0;
+		m_offset = 0;
+	}
+
+	bool isEmpty()
+	{
+		return m_block == 0 && m_offset == 0;
+	}
+};
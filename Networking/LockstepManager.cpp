@@ -0,0 +1,347 @@
+#include "LockstepManager.h"
+#include "NetworkingManager.h"
+#include "MessageManager.h"
+
+LockstepManager* LockstepManager::s_instance;
+thread_local LockstepManager* LockstepManager::t_instance = NULL;
+
+LockstepManager* LockstepManager::getInstance()
+{
+	if (t_instance != NULL)
+		return t_instance;
+	if (s_instance == NULL)
+		s_instance = new LockstepManager();
+	return s_instance;
+}
+
+void LockstepManager::setThreadInstance(LockstepManager* instance)
+{
+	t_instance = instance;
+}
+
+LockstepManager::LockstepManager()
+{
+	m_running = false;
+	m_tick = 0;
+	m_inputTick = 0;
+	m_accumulated = 0;
+	m_sample = nullptr;
+	m_step = nullptr;
+	m_checksum = nullptr;
+	m_desync = nullptr;
+	m_desynced = false;
+	m_startListenerID = -1;
+}
+
+void LockstepManager::setCallbacks(LockstepSampleCallback sample, LockstepStepCallback step, LockstepChecksumCallback checksum)
+{
+	m_sample = sample;
+	m_step = step;
+	m_checksum = checksum;
+}
+
+void LockstepManager::setDesyncCallback(LockstepDesyncCallback desync)
+{
+	m_desync = desync;
+}
+
+void LockstepManager::listen(const std::string& key, void(*callback)(std::map<std::string, void*>))
+{
+	m_listenerKeys.push_back(key);
+	m_listenerIDs.push_back(MessageManager::subscribe(key, callback, this));
+}
+
+void LockstepManager::listenForStart()
+{
+	if (m_startListenerID == -1)
+		m_startListenerID = MessageManager::subscribe("0|LSSTART", &LockstepManager::onStart, this);
+}
+
+bool LockstepManager::start()
+{
+	NetworkingManager* network = NetworkingManager::getInstance();
+	if (!network->isHost() || !network->inGame() || m_running)
+		return false;
+	std::vector<int> players = network->getClientIDs();
+	std::string list;
+	for (size_t i = 0; i < players.size(); ++i)
+		list += (i > 0 ? ";" : "") + std::to_string(players[i]);
+	std::map<std::string, std::string> payload;
+	payload["players"] = list;
+	network->prepareMessageForSendingTCP(network->m_assignedID, "LSSTART", payload);
+	begin(players);
+	return true;
+}
+
+void LockstepManager::begin(const std::vector<int>& players)
+{
+	stop();
+	m_running = true;
+	m_desynced = false;
+	m_players = players;
+	m_tick = 0;
+	m_inputTick = LOCKSTEP_INPUT_DELAY;
+	m_accumulated = 0;
+	//Nobody could send input for the first ticks, they run with everyone idle
+	LockstepInput idle = { 0, 0, 0 };
+	for (Uint32 tick = 0; tick < LOCKSTEP_INPUT_DELAY; ++tick)
+	{
+		for (size_t i = 0; i < players.size(); ++i)
+			m_inputs[tick][players[i]] = idle;
+	}
+
+	NetworkingManager* network = NetworkingManager::getInstance();
+	for (size_t i = 0; i < players.size(); ++i)
+	{
+		if (network->isSelf(players[i]))
+			continue;
+		std::string id = std::to_string(players[i]);
+		listen(id + "|LSINPUT", &LockstepManager::onInput);
+		listen(id + "|LSCHECKSUM", &LockstepManager::onChecksum);
+	}
+	if (!network->isHost())
+		listen("0|LSDROP", &LockstepManager::onDrop);
+	std::cout << "Lockstep started with " << players.size() << " players" << std::endl;
+}
+
+void LockstepManager::stop()
+{
+	for (size_t i = 0; i < m_listenerIDs.size(); ++i)
+		MessageManager::unSubscribe(m_listenerKeys[i], m_listenerIDs[i]);
+	m_listenerIDs.clear();
+	m_listenerKeys.clear();
+	m_running = false;
+	m_players.clear();
+	m_dropped.clear();
+	m_lastInput.clear();
+	m_inputs.clear();
+	m_checksums.clear();
+	m_remoteChecksums.clear();
+}
+
+bool LockstepManager::isRunning()
+{
+	return m_running;
+}
+
+bool LockstepManager::isDesynced()
+{
+	return m_desynced;
+}
+
+Uint32 LockstepManager::getTick()
+{
+	return m_tick;
+}
+
+void LockstepManager::update(int ticks)
+{
+	if (!m_running || m_step == nullptr || m_sample == nullptr)
+		return;
+	if (NetworkingManager::getInstance()->isHost())
+		checkDisconnects();
+
+	m_accumulated += ticks;
+	while (m_accumulated >= LOCKSTEP_TICK_MS)
+	{
+		//Local input always runs LOCKSTEP_INPUT_DELAY ticks ahead of the simulation
+		while (m_inputTick <= m_tick + LOCKSTEP_INPUT_DELAY)
+		{
+			LockstepInput input = m_sample();
+			receiveInput(NetworkingManager::getInstance()->m_assignedID, m_inputTick, input);
+			sendInput(m_inputTick, input);
+			m_inputTick++;
+		}
+		if (!hasInputs(m_tick))
+		{
+			//Waiting on a peer. Don't bank more than the input delay, or we'd race once it catches up
+			if (m_accumulated > LOCKSTEP_TICK_MS * LOCKSTEP_INPUT_DELAY)
+				m_accumulated = LOCKSTEP_TICK_MS * LOCKSTEP_INPUT_DELAY;
+			break;
+		}
+
+		std::map<int, LockstepInput>& inputs = m_inputs[m_tick];
+		for (std::map<int, LockstepInput>::iterator it = inputs.begin(); it != inputs.end();)
+		{
+			if (isPlaying(it->first, m_tick))
+				++it;
+			else
+				it = inputs.erase(it);
+		}
+		m_step(m_tick, inputs);
+		m_inputs.erase(m_tick);
+
+		if (m_checksum != nullptr && m_tick % LOCKSTEP_CHECKSUM_INTERVAL == 0)
+		{
+			Uint32 checksum = m_checksum(m_tick);
+			m_checksums[m_tick] = checksum;
+			while (m_checksums.size() > LOCKSTEP_CHECKSUM_HISTORY)
+				m_checksums.erase(m_checksums.begin());
+			std::map<std::string, std::string> payload;
+			payload["tick"] = std::to_string(m_tick);
+			payload["sum"] = std::to_string(checksum);
+			NetworkingManager::getInstance()->prepareMessageForSendingTCP(NetworkingManager::getInstance()->m_assignedID, "LSCHECKSUM", payload);
+			compareChecksums(m_tick);
+		}
+		m_tick++;
+		m_accumulated -= LOCKSTEP_TICK_MS;
+	}
+}
+
+void LockstepManager::sendInput(Uint32 tick, const LockstepInput& input)
+{
+	std::map<std::string, std::string> payload;
+	payload["tick"] = std::to_string(tick);
+	payload["mx"] = std::to_string(input.moveX);
+	payload["my"] = std::to_string(input.moveY);
+	payload["b"] = std::to_string(input.buttons);
+	NetworkingManager::getInstance()->prepareMessageForSendingTCP(NetworkingManager::getInstance()->m_assignedID, "LSINPUT", payload);
+}
+
+void LockstepManager::receiveInput(int player, Uint32 tick, const LockstepInput& input)
+{
+	//Already simulated, or from a player that left
+	if (tick < m_tick || !isPlaying(player, tick))
+		return;
+	m_inputs[tick][player] = input;
+	if (m_lastInput.find(player) == m_lastInput.end() || tick > m_lastInput[player])
+		m_lastInput[player] = tick;
+}
+
+bool LockstepManager::hasInputs(Uint32 tick)
+{
+	std::map<Uint32, std::map<int, LockstepInput> >::iterator inputs = m_inputs.find(tick);
+	for (size_t i = 0; i < m_players.size(); ++i)
+	{
+		if (!isPlaying(m_players[i], tick))
+			continue;
+		if (inputs == m_inputs.end() || inputs->second.find(m_players[i]) == inputs->second.end())
+			return false;
+	}
+	return true;
+}
+
+bool LockstepManager::isPlaying(int player, Uint32 tick)
+{
+	std::map<int, Uint32>::iterator dropped = m_dropped.find(player);
+	return dropped == m_dropped.end() || tick < dropped->second;
+}
+
+void LockstepManager::receiveChecksum(int player, Uint32 tick, Uint32 checksum)
+{
+	//Older than anything we still have, nothing to compare it with
+	if (!m_checksums.empty() && tick < m_checksums.begin()->first)
+		return;
+	m_remoteChecksums[tick][player] = checksum;
+	compareChecksums(tick);
+}
+
+void LockstepManager::compareChecksums(Uint32 tick)
+{
+	std::map<Uint32, Uint32>::iterator own = m_checksums.find(tick);
+	std::map<Uint32, std::map<int, Uint32> >::iterator remote = m_remoteChecksums.find(tick);
+	if (own == m_checksums.end() || remote == m_remoteChecksums.end())
+		return;
+	for (std::map<int, Uint32>::iterator it = remote->second.begin(); it != remote->second.end(); ++it)
+	{
+		if (it->second == own->second)
+			continue;
+		std::cout << "Lockstep desync with player " << it->first << " at tick " << tick << std::endl;
+		m_desynced = true;
+		if (m_desync != nullptr)
+			m_desync(tick, it->first);
+	}
+	m_remoteChecksums.erase(remote);
+}
+
+//Host only
+void LockstepManager::dropPlayer(int player)
+{
+	if (!m_running || m_dropped.find(player) != m_dropped.end())
+		return;
+	//Everything up to its last input has already been relayed, so clients drop it at the same tick we do
+	Uint32 from = m_lastInput.find(player) != m_lastInput.end() ? m_lastInput[player] + 1 : LOCKSTEP_INPUT_DELAY;
+	m_dropped[player] = from;
+	std::map<std::string, std::string> payload;
+	payload["player"] = std::to_string(player);
+	payload["tick"] = std::to_string(from);
+	NetworkingManager::getInstance()->prepareMessageForSendingTCP(NetworkingManager::getInstance()->m_assignedID, "LSDROP", payload);
+	std::cout << "Lockstep dropped player " << player << " from tick " << from << std::endl;
+}
+
+void LockstepManager::checkDisconnects()
+{
+	NetworkingManager* network = NetworkingManager::getInstance();
+	for (size_t i = 0; i < m_players.size(); ++i)
+	{
+		if (!network->isSelf(m_players[i]) && m_dropped.find(m_players[i]) == m_dropped.end() && !network->hasClient(m_players[i]))
+			dropPlayer(m_players[i]);
+	}
+}
+
+Uint32 LockstepManager::hash(Uint32 seed, const void* data, size_t length)
+{
+	const Uint8* bytes = (const Uint8*)data;
+	Uint32 hash = seed != 0 ? seed : 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void LockstepManager::onStart(std::map<std::string, void*> data)
+{
+	std::string list = *(std::string*)data["players"];
+	std::vector<int> players;
+	size_t start = 0;
+	while (start < list.length())
+	{
+		size_t end = list.find(';', start);
+		if (end == std::string::npos)
+			end = list.length();
+		players.push_back(std::stoi(list.substr(start, end - start)));
+		start = end + 1;
+	}
+	LockstepManager::getInstance()->begin(players);
+}
+
+void LockstepManager::onInput(std::map<std::string, void*> data)
+{
+	LockstepManager* self = LockstepManager::getInstance();
+	int player = std::stoi(*(std::string*)data["netID"]);
+	Uint32 tick = (Uint32)std::stoul(*(std::string*)data["tick"]);
+	LockstepInput input;
+	input.moveX = std::stoi(*(std::string*)data["mx"]);
+	input.moveY = std::stoi(*(std::string*)data["my"]);
+	input.buttons = (Uint32)std::stoul(*(std::string*)data["b"]);
+	self->receiveInput(player, tick, input);
+
+	//Clients only reach the host, pass it on under the original player's id
+	NetworkingManager* network = NetworkingManager::getInstance();
+	if (network->isHost())
+	{
+		std::map<std::string, std::string> payload;
+		payload["tick"] = *(std::string*)data["tick"];
+		payload["mx"] = *(std::string*)data["mx"];
+		payload["my"] = *(std::string*)data["my"];
+		payload["b"] = *(std::string*)data["b"];
+		network->prepareMessageForSendingTCP(player, "LSINPUT", payload);
+	}
+}
+
+void LockstepManager::onChecksum(std::map<std::string, void*> data)
+{
+	int player = std::stoi(*(std::string*)data["netID"]);
+	Uint32 tick = (Uint32)std::stoul(*(std::string*)data["tick"]);
+	Uint32 checksum = (Uint32)std::stoul(*(std::string*)data["sum"]);
+	LockstepManager::getInstance()->receiveChecksum(player, tick, checksum);
+}
+
+void LockstepManager::onDrop(std::map<std::string, void*> data)
+{
+	LockstepManager* self = LockstepManager::getInstance();
+	int player = std::stoi(*(std::string*)data["player"]);
+	self->m_dropped[player] = (Uint32)std::stoul(*(std::string*)data["tick"]);
+}
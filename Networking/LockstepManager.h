@@ -0,0 +1,127 @@
+#pragma once
+#include "GLHeaders.h"
+#include <map>
+#include <vector>
+#include <string>
+#include <iostream>
+
+//Length of one simulation tick
+#define LOCKSTEP_TICK_MS 33
+//Inputs are scheduled this many ticks ahead, enough to cover the round trip through the host
+#define LOCKSTEP_INPUT_DELAY 4
+//Every this many ticks each peer sends a checksum of its simulation
+#define LOCKSTEP_CHECKSUM_INTERVAL 30
+//Own checksums kept to compare with late ones from other peers
+#define LOCKSTEP_CHECKSUM_HISTORY 16
+
+//One player's commands for one tick. Integers only, so every peer applies exactly the same thing
+struct LockstepInput
+{
+	int moveX;
+	int moveY;
+	Uint32 buttons;
+};
+
+typedef LockstepInput(*LockstepSampleCallback)();
+typedef void(*LockstepStepCallback)(Uint32 tick, const std::map<int, LockstepInput>& inputs);
+typedef Uint32(*LockstepChecksumCallback)(Uint32 tick);
+typedef void(*LockstepDesyncCallback)(Uint32 tick, int player);
+
+/*
+	Lockstep Manager
+
+	Optional alternative to transform replication. Peers only exchange each player's input per tick
+	(LSINPUT) over the NetworkingManager TCP channel and every peer steps the same deterministic simulation
+	with the same inputs, so bandwidth doesn't depend on how many objects move. Clients only talk to the
+	host, so the host relays every client's inputs to the others.
+
+	A tick only runs once the inputs of every player for it have arrived, otherwise the simulation waits.
+	Local inputs are scheduled LOCKSTEP_INPUT_DELAY ticks ahead to hide that wait. Every
+	LOCKSTEP_CHECKSUM_INTERVAL ticks each peer sends a checksum of its state (LSCHECKSUM), a peer
+	that computed something else for the same tick has desynced.
+
+	The host calls start once everyone is in the game, which sends LSSTART with the player list.
+	While running, Sender and Receiver stop replicating transforms.
+*/
+class LockstepManager
+{
+private:
+	static LockstepManager* s_instance;
+	static thread_local LockstepManager* t_instance;
+	bool m_running;
+	Uint32 m_tick; //next tick to simulate
+	Uint32 m_inputTick; //next tick to sample local input for
+	int m_accumulated;
+	std::vector<int> m_players;
+	//Players that left, keyed by the first tick that runs without them
+	std::map<int, Uint32> m_dropped;
+	//Highest input tick received per player, the host drops a leaving player after it
+	std::map<int, Uint32> m_lastInput;
+	std::map<Uint32, std::map<int, LockstepInput> > m_inputs;
+	std::map<Uint32, Uint32> m_checksums;
+	std::map<Uint32, std::map<int, Uint32> > m_remoteChecksums;
+	int m_startListenerID;
+	std::vector<int> m_listenerIDs;
+	std::vector<std::string> m_listenerKeys;
+	LockstepSampleCallback m_sample;
+	LockstepStepCallback m_step;
+	LockstepChecksumCallback m_checksum;
+	LockstepDesyncCallback m_desync;
+	bool m_desynced;
+
+	LockstepManager();
+	friend class Session;
+	void begin(const std::vector<int>& players);
+	void listen(const std::string& key, void(*callback)(std::map<std::string, void*>));
+	void sendInput(Uint32 tick, const LockstepInput& input);
+	void receiveInput(int player, Uint32 tick, const LockstepInput& input);
+	void receiveChecksum(int player, Uint32 tick, Uint32 checksum);
+	void compareChecksums(Uint32 tick);
+	bool hasInputs(Uint32 tick);
+	bool isPlaying(int player, Uint32 tick);
+	void checkDisconnects();
+	static void onStart(std::map<std::string, void*> data);
+	static void onInput(std::map<std::string, void*> data);
+	static void onChecksum(std::map<std::string, void*> data);
+	static void onDrop(std::map<std::string, void*> data);
+
+public:
+	static LockstepManager* getInstance();
+	/*
+	Makes getInstance return instance on the calling thread, nullptr goes back to the process wide one.
+	*/
+	static void setThreadInstance(LockstepManager* instance);
+
+	/*
+	The game's side of lockstep: sample reads the local player's input, step advances the simulation one
+	tick with every player's input, checksum hashes the simulation state after a tick (see hash).
+	*/
+	void setCallbacks(LockstepSampleCallback sample, LockstepStepCallback step, LockstepChecksumCallback checksum);
+	void setDesyncCallback(LockstepDesyncCallback desync);
+
+	/*
+	Clients: waits for the host's LSSTART. Host: starts with every connected player and tells the clients.
+	*/
+	void listenForStart();
+	bool start();
+	void stop();
+	bool isRunning();
+	bool isDesynced();
+	Uint32 getTick();
+
+	/*
+	Once per frame, samples input and runs every tick that is due and has all its inputs.
+	*/
+	void update(int ticks);
+
+	/*
+	Host: removes a player from the tick after its last relayed input. Done automatically when its
+	connection closes.
+	*/
+	void dropPlayer(int player);
+
+	/*
+	FNV-1a, for building checksums out of the simulation state.
+	*/
+	static Uint32 hash(Uint32 seed, const void* data, size_t length);
+};
@@ -1,15 +1,24 @@
 #include "MessageManager.h"
 #include "Randomize.h"
+#include "Tracer.h"
 
 MessageManager* MessageManager::s_instance;
+thread_local MessageManager* MessageManager::t_instance = NULL;
 
 MessageManager* MessageManager::getInstance()
 {
+	if (t_instance != NULL)
+		return t_instance;
 	if (s_instance == NULL)
 		s_instance = new MessageManager();
 	return s_instance;
 }
 
+void MessageManager::setThreadInstance(MessageManager* instance)
+{
+	t_instance = instance;
+}
+
 int MessageManager::subscribe(std::string event, Callback callback, void* owner)
 {
 	std::cout << "Event subbed: " << event << std::endl;
@@ -43,8 +52,23 @@ void MessageManager::unSubscribe(std::string event, int id)
 	}
 }
 
+//Points the values of a network message at the subscriber's own copies of them
+static std::map<std::string, void*> copyValues(const std::map<std::string, void*> &data, std::map<std::string, std::string> &values)
+{
+	std::map<std::string, void*> copied;
+	for (std::map<std::string, void*>::const_iterator it = data.begin(); it != data.end(); ++it)
+	{
+		//Assigning into the string kept from the last message reuses its buffer
+		std::string &value = values[it->first];
+		value = *(const std::string*)it->second;
+		copied[it->first] = &value;
+	}
+	return copied;
+}
+
 void MessageManager::sendEvent(std::string event, std::map<std::string, void*> data)
 {
+	TRACE_ZONE_DYNAMIC("dispatch", event);
 	MessageManager* self = MessageManager::getInstance();
 
 	std::map<std::string, std::map<int, CallbackReceiver> >::iterator it = self->m_subs.find(event);
@@ -61,4 +85,97 @@ void MessageManager::sendEvent(std::string event, std::map<std::string, void*> d
 		}
 	data.clear ();
 	//TODO: Clear all void* data that isn't "this"
+}
+
+void MessageManager::sendNetworkEvent(std::string event, std::map<std::string, void*> data)
+{
+	TRACE_ZONE_DYNAMIC("dispatch", event);
+	MessageManager* self = MessageManager::getInstance();
+
+	std::map<std::string, std::map<int, CallbackReceiver> >::iterator it = self->m_subs.find(event);
+	if (it == self->m_subs.end())
+		return;
+	for (std::map<int, CallbackReceiver>::iterator it2 = it->second.begin(); it2 != it->second.end();)
+	{
+		if (it2->second.callback == nullptr) {
+			it2 = it->second.erase (it2);
+			continue;
+		}
+		std::map<std::string, void*> copied = copyValues (data, it2->second.values);
+		copied["this"] = (void*)it2->second.owner;
+		it2->second.callback (copied);
+		++it2;
+	}
+}
+
+int MessageManager::subscribeRoute(int netID, RouteCallback callback, void* owner)
+{
+	MessageManager* self = MessageManager::getInstance();
+	RouteReceiver routeReceiver;
+	routeReceiver.callback = callback;
+	routeReceiver.owner = owner;
+
+	int id = Randomize::Random();
+	self->m_routes[netID][id] = routeReceiver;
+	return id;
+}
+
+void MessageManager::unSubscribeRoute(int netID, int id)
+{
+	MessageManager* self = MessageManager::getInstance();
+
+	std::map<int, std::map<int, RouteReceiver> >::iterator it = self->m_routes.find(netID);
+	if (it == self->m_routes.end())
+		return;
+	std::map<int, RouteReceiver>::iterator it2 = it->second.find(id);
+	if (it2 == it->second.end())
+		return;
+
+	//A handler may destroy entities while we are dispatching, so only mark the route and let sendRouteEvent erase it
+	if (self->m_routeDispatchDepth > 0)
+	{
+		it2->second.callback = nullptr;
+		return;
+	}
+	it->second.erase(it2);
+	if (it->second.empty())
+		self->m_routes.erase(it);
+}
+
+bool MessageManager::sendRouteEvent(int netID, std::map<std::string, void*> data)
+{
+	MessageManager* self = MessageManager::getInstance();
+
+	std::map<int, std::map<int, RouteReceiver> >::iterator it = self->m_routes.find(netID);
+	if (it == self->m_routes.end())
+		return false;
+
+	bool handled = false;
+	self->m_routeDispatchDepth++;
+	for (std::map<int, RouteReceiver>::iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2)
+	{
+		if (it2->second.callback != nullptr)
+		{
+			std::map<std::string, void*> copied = copyValues(data, it2->second.values);
+			copied["this"] = it2->second.owner;
+			if (it2->second.callback(copied))
+				handled = true;
+		}
+	}
+	self->m_routeDispatchDepth--;
+
+	if (self->m_routeDispatchDepth == 0)
+	{
+		//Map iterators survive insertions and erasures are deferred while dispatching, so it is still valid here
+		for (std::map<int, RouteReceiver>::iterator it2 = it->second.begin(); it2 != it->second.end();)
+		{
+			if (it2->second.callback == nullptr)
+				it2 = it->second.erase(it2);
+			else
+				++it2;
+		}
+		if (it->second.empty())
+			self->m_routes.erase(it);
+	}
+	return handled;
 }
\ No newline at end of file
@@ -6,21 +6,40 @@
 #include <memory>
 
 typedef void(*Callback)(std::map<std::string, void*>);
+typedef bool(*RouteCallback)(std::map<std::string, void*>);
 
 struct CallbackReceiver
 {
 	void* owner;
 	Callback callback;
+	//The subscriber's copy of the last network message's values, what its data pointers point at
+	std::map<std::string, std::string> values;
+};
+
+struct RouteReceiver
+{
+	void* owner;
+	RouteCallback callback;
+	std::map<std::string, std::string> values;
 };
 
 class MessageManager
 {
 private:
 	static MessageManager* s_instance;
+	static thread_local MessageManager* t_instance;
 	static MessageManager* getInstance();
 	std::map<std::string, std::map<int, CallbackReceiver> > m_subs;
+	std::map<int, std::map<int, RouteReceiver> > m_routes;
+	int m_routeDispatchDepth = 0;
 
 public:
+	/*
+	Makes every call on the calling thread use instance's subscriptions, nullptr goes back to the
+	process wide ones. Sessions each bind their own so matches never see each other's events.
+	*/
+	static void setThreadInstance(MessageManager* instance);
+
 	/*
 	Subscribe to an event.
 
@@ -41,4 +60,30 @@ public:
 	for data value, and void* as the actual data. This data must be cast to what the expected data type is.
 	*/
 	static void sendEvent(std::string event, std::map<std::string, void*> data);
+
+	/*
+	sendEvent for a received network message, whose values are all std::string*. Each subscriber is
+	handed its own copies, which stay valid until its next network message or until it unsubscribes,
+	so the sender's buffers can be reused as soon as this returns.
+	*/
+	static void sendNetworkEvent(std::string event, std::map<std::string, void*> data);
+
+	/*
+	Register a single routing entry for a networked entity.
+
+	Every network message addressed to netID is handed to the callback, which decides by message key
+	how to handle it. Returns the unique id of this route, required to unsubscribe later.
+	*/
+	static int subscribeRoute(int netID, RouteCallback callback, void* owner);
+
+	/*
+	Remove a routing entry based on the netID and the id returned by subscribeRoute.
+	*/
+	static void unSubscribeRoute(int netID, int id);
+
+	/*
+	Sends a network message to every route registered for netID, values are copied like sendNetworkEvent.
+	Returns true if at least one route handled the message.
+	*/
+	static bool sendRouteEvent(int netID, std::map<std::string, void*> data);
 };
\ No newline at end of file
@@ -1,11 +1,63 @@
 #include "NetworkingManager.h"
 #include "MessageManager.h"
 #include "SpawnManager.h"
+#include "Compression.h"
+#include "Tracer.h"
+#include "TransformHistory.h"
+#include "LockstepManager.h"
+#include <signal.h>
+#include <limits>
+#include <algorithm>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
 
 NetworkingManager* NetworkingManager::s_instance;
+thread_local NetworkingManager* NetworkingManager::t_instance = NULL;
+
+//SDL_net doesn't expose the OS socket, but every TCPsocket starts with its ready flag followed by it
+struct TCPsocketHeader
+{
+	int ready;
+#ifdef _WIN32
+	SOCKET channel;
+#else
+	int channel;
+#endif
+};
+
+SharedSocket::SharedSocket(TCPsocket socket) : socket(socket)
+{
+	set = SDLNet_AllocSocketSet(1);
+	SDLNet_TCP_AddSocket(set, socket);
+
+	//Bounds how long the sender can sit in SDLNet_TCP_Send writing out a closing connection's queue
+#ifdef _WIN32
+	DWORD timeout = SEND_TIMEOUT_MS;
+#else
+	timeval timeout;
+	timeout.tv_sec = SEND_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (SEND_TIMEOUT_MS % 1000) * 1000;
+#endif
+	setsockopt(((TCPsocketHeader*)socket)->channel, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+}
+
+void SharedSocket::shutdown()
+{
+#ifdef _WIN32
+	::shutdown(((TCPsocketHeader*)socket)->channel, SD_BOTH);
+#else
+	::shutdown(((TCPsocketHeader*)socket)->channel, SHUT_RDWR);
+#endif
+}
 
 NetworkingManager* NetworkingManager::getInstance()
 {
+	if (t_instance != NULL)
+		return t_instance;
 	if (s_instance == NULL)
 		s_instance = new NetworkingManager();
 	return s_instance;
@@ -13,14 +65,31 @@ NetworkingManager* NetworkingManager::getInstance()
 
 void NetworkingManager::hardReset()
 {
+	//Whatever the game queued last, like ENDGAME, still goes out before the connections wind down
+	setSendBudget (std::numeric_limits<int>::max (), std::numeric_limits<int>::max ());
+	sendQueuedEvents ();
 	closeClient();
 	closeUDP();
-	s_instance = new NetworkingManager();
+	TransformHistory::getInstance()->clear();
+	LockstepManager::getInstance()->stop();
+	if (t_instance == this)
+		t_instance = new NetworkingManager();
+	else
+		s_instance = new NetworkingManager();
+}
+
+void NetworkingManager::setThreadInstance(NetworkingManager* instance)
+{
+	t_instance = instance;
 }
 
 NetworkingManager::NetworkingManager()
 {
 	SDLNet_Init();
+#ifndef _WIN32
+	//A peer leaving mid-send raises SIGPIPE on the writing thread, we want the failed send result instead
+	signal(SIGPIPE, SIG_IGN);
+#endif
 	m_messageQueue = new ThreadQueue<std::string>();
 }
 
@@ -96,9 +165,13 @@ bool NetworkingManager::host()
 	if (!m_udpSocket)
 	{
 		std::string udpError = SDLNet_GetError();
+		//Free the port again so hosting can be retried
+		SDLNet_TCP_Close(m_socket);
+		m_socket = NULL;
 		return false;
 	}
 
+	m_listenSocket = std::make_shared<SharedSocket> (m_socket);
 	m_inLobby = true;
 	m_gameStarted = false;
 	m_isHost = true;
@@ -108,30 +181,44 @@ bool NetworkingManager::host()
 	m_assignedID = 0;
 	pollSocketAccept ();
 	pollMessagesUDP ();
+	return true;
 }
 
 void NetworkingManager::pollSocketAccept ()
 {
-	m_socketAcceptThread = std::thread (&NetworkingManager::socketAcceptThread, this);
+	m_socketAcceptThread = std::thread (&NetworkingManager::socketAcceptThread, this, m_listenSocket);
 	m_socketAcceptThread.detach ();
 }
 
-void NetworkingManager::socketAcceptThread ()
+void NetworkingManager::socketAcceptThread (std::shared_ptr<SharedSocket> listener)
 {
-	while (m_inLobby) {
-		if (accept ())
+	TRACE_THREAD ("Net accept");
+
+	while (m_inLobby && !listener->closing) {
+		//Sleeps until a client connects or the timeout passes, so an idle lobby costs nothing
+		int ready = SDLNet_CheckSockets (listener->set, ACCEPT_TIMEOUT_MS);
+		if (ready == -1)
+		{
+			printf ("SDLNet_CheckSockets: %s\n", SDLNet_GetError ());
+			break;
+		}
+		if (ready == 0 || !SDLNet_SocketReady (listener->socket))
+			continue;
+
+		//The listening socket is non-blocking, drain every client that joined since the last wakeup
+		while (m_inLobby && !listener->closing && accept (listener->socket))
 		{
 			std::cout << "Connection established." << std::endl;
 		}
 	}
 }
 
-bool NetworkingManager::accept()
+bool NetworkingManager::accept(TCPsocket listener)
 {
 	if (m_gameStarted)
 		return false;
 
-	TCPsocket m_client = SDLNet_TCP_Accept(m_socket);
+	TCPsocket m_client = SDLNet_TCP_Accept(listener);
 	if (!m_client)
 	{
 		return false;
@@ -143,19 +230,27 @@ bool NetworkingManager::accept()
 		std::cout << "Too many players." << std::endl;
 		return false;
 	}
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		m_connections[newID].socket = std::make_shared<SharedSocket> (m_client);
+	}
 	pollMessagesTCP(newID);
+	startSendingTCP(newID);
 
+	//Clients listen for UDP on our port at the address we just saw, no reverse lookup needed
 	IPaddress udpIP;
-	if (SDLNet_ResolveHost (&udpIP, SDLNet_ResolveIP (ip), m_port) == -1) {
-		std::cout << "Couldn't find resolved client IP " << SDLNet_ResolveIP (ip) << std::endl;
-	}
+	udpIP.host = ip->host;
+	SDLNet_Write16 (m_port, &udpIP.port);
 	int channel = -1;
 	if ((channel = SDLNet_UDP_Bind (m_udpSocket, -1, &udpIP)) == -1)
 	{
 		printf ("SDLNet_UDP_Bind to channel: %s\n", SDLNet_GetError ());
 	}
-	if (channel >= 0 && channel <= 3) //16 max connections
+	if (channel >= 0 && channel < MAX_UDP_CHANNELS) {
 		channels[channel] = true;
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		m_connections[newID].udpChannel = channel;
+	}
 	
 	sendAcceptPacket (newID);
 	// communicate over new_tcpsock
@@ -178,14 +273,20 @@ bool NetworkingManager::join ()
 	listenforAcceptPacket ();
 
 	m_socket = SDLNet_TCP_Open (&m_hostAddress);
-	pollMessagesTCP (addPlayer (m_hostAddress.host, m_socket));
 	if (!m_socket)
 	{
 		printf ("SDLNet_TCP_Open: %s\n", SDLNet_GetError ());
 		stopListeningForAcceptPacket ();
-		SDLNet_TCP_Close (m_socket);
 		return false;
 	}
+	//As a client our only connection is the host, which addPlayer registers as 0
+	addPlayer (m_hostAddress.host, m_socket);
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		m_connections[0].socket = std::make_shared<SharedSocket> (m_socket);
+	}
+	pollMessagesTCP (0);
+	startSendingTCP (0);
 		
 	m_udpSocket = SDLNet_UDP_Open(m_port);
 	if (!m_udpSocket)
@@ -209,24 +310,55 @@ bool NetworkingManager::join ()
 }
 
 bool NetworkingManager::closeClientAsHost (int id) {
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
 	if (m_clients.find (id) != m_clients.end ())
 	{
-		SDLNet_TCP_Close (m_clients[id].second);
+		//The connection's own threads close the socket once the queue is written out
+		closeOutbound (id);
 		m_clients.erase (id);
+		m_connections.erase (id);
 	}
 	return true;
 }
 
 bool NetworkingManager::closeClient()
 {
-	if (m_socket != NULL)
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	if (isHost ())
 	{
-		SDLNet_TCP_Close(m_socket);
-		m_socket = NULL;
+		std::vector<int> ids;
+		for (auto it = m_clients.begin (); it != m_clients.end (); it++)
+			if (it->first != m_assignedID)
+				ids.push_back (it->first);
+		for (size_t i = 0; i < ids.size (); i++)
+			closeClientAsHost (ids[i]);
+		//Our m_socket is the listening socket, closed once the accept thread lets go of it
+		if (m_listenSocket != nullptr)
+		{
+			m_listenSocket->closing = true;
+			m_listenSocket = nullptr;
+		}
 	}
+	else
+		closeOutbound (0);
+	m_socket = NULL;
+	m_pendingTransport = nullptr;
 	return true;
 }
 
+//Called by a connection's thread when it fails, unless the connection already closed and the id was reused
+void NetworkingManager::closeLostConnection (int id, const std::shared_ptr<SharedSocket> &socket)
+{
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	std::map<int, Connection>::iterator connection = m_connections.find (id);
+	if (connection == m_connections.end () || connection->second.socket != socket)
+		return;
+	if (isHost ())
+		closeClientAsHost (id);
+	else
+		closeClient ();
+}
+
 bool NetworkingManager::closeUDP()
 {
 	if (m_udpSocket != NULL)
@@ -234,33 +366,199 @@ bool NetworkingManager::closeUDP()
 		SDLNet_UDP_Close(m_udpSocket);
 		m_udpSocket = NULL;
 	}
+	if (m_udpPacket != NULL)
+	{
+		SDLNet_FreePacket(m_udpPacket);
+		m_udpPacket = NULL;
+	}
 	return true;
 }
 
-//Host->Sending Messages->Client Exits->Host Crashes on line SDLNet_TCP_Send
-void NetworkingManager::send(int id, std::string *msg)
+//Queues the packet for the connection's sender thread, never blocks the caller
+void NetworkingManager::send(int id, const std::string &msg)
+{
+	OutboundPacket packet;
+	std::shared_ptr<OutboundQueue> queue;
+	std::shared_ptr<Transport> transport;
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		std::map<int, Connection>::iterator connection = m_connections.find (id);
+		if (connection != m_connections.end ()) {
+			queue = connection->second.outbound;
+			transport = connection->second.transport;
+			packet.compress = connection->second.compression && msg.length () >= COMPRESSION_THRESHOLD;
+		}
+	}
+
+	//std::cout << "Sending: ID: " << id << " Packet: " << m_clients[id].first << " Message: " << msg << std::endl;
+
+	//Copying into shared memory is cheaper than compressing, and a full ring is the same backpressure as a full queue
+	if (transport != nullptr) {
+		if (transport->send (msg))
+			return;
+	}
+	else if (queue == nullptr) {
+		return;
+	}
+	else {
+		packet.data = msg;
+		if (queue->push (packet))
+			return;
+	}
+
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	if (m_backpressurePolicy == BACKPRESSURE_DISCONNECT) {
+		std::cout << "Outbound queue full, disconnecting " << id << std::endl;
+		//The peer stopped reading, so there is no flushing the queue. Fail the send it is blocked in instead
+		std::map<int, Connection>::iterator connection = m_connections.find (id);
+		if (connection != m_connections.end () && connection->second.socket != nullptr)
+			connection->second.socket->shutdown ();
+		if (isHost ())
+			closeClientAsHost (id);
+		else
+			closeClient ();
+	}
+	else if (m_connections.find (id) != m_connections.end ()) {
+		int dropped = ++m_connections[id].dropped;
+		//Logged at 1, 2, 4, 8... drops so a stalled peer doesn't flood the console every frame
+		if ((dropped & (dropped - 1)) == 0)
+			std::cout << "Outbound queue full, dropped packet for " << id << " (" << dropped << " total)" << std::endl;
+	}
+}
+
+void NetworkingManager::startSendingTCP(int id)
 {
-	int result, len;
-	len = msg->length() + 1;
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	if (m_clients.find (id) == m_clients.end () || m_connections[id].socket == nullptr)
+		return;
+	std::shared_ptr<OutboundQueue> queue = std::make_shared<OutboundQueue> (OUTBOUND_QUEUE_SIZE);
+	m_connections[id].outbound = queue;
+	std::thread sender (&NetworkingManager::sendThreadTCP, this, id, m_connections[id].socket, queue);
+	sender.detach ();
+}
 
-	//std::cout << "Sending: ID: " << id << " Packet: " << m_clients[id].first << " Message: " << *msg << std::endl;
+//One per connection so a slow peer only ever blocks its own writes
+void NetworkingManager::sendThreadTCP(int id, std::shared_ptr<SharedSocket> socket, std::shared_ptr<OutboundQueue> queue)
+{
+	TRACE_THREAD ("Net send TCP");
+	OutboundPacket packet;
+	while (queue->pop (packet)) {
+		TRACE_ZONE ("net", "writeTCP");
+		if (!writeTCP (socket->socket, packet)) {
+			std::cout << "Lost connection to " << id << " while sending." << std::endl;
+			break;
+		}
+	}
 
-	if (m_clients.find (id) != m_clients.end ()) {
-		result = SDLNet_TCP_Send (m_clients[id].second, msg->c_str (), len);
+	if (!queue->isClosed ()) {
+		//The write failed rather than us closing the connection
+		queue->close ();
+		closeLostConnection (id, socket);
 	}
-	else if (m_socket != NULL) {
-		result = SDLNet_TCP_Send (m_socket, msg->c_str (), len);
+	//The socket closes once the receive thread lets go of it too
+	socket->closing = true;
+}
+
+bool NetworkingManager::writeTCP(TCPsocket socket, const OutboundPacket &packet)
+{
+	const char *data = packet.data.c_str ();
+	int len = packet.data.length () + 1;
+
+	//Compressed frames carry their own length, so no null terminator is sent with them
+	std::string compressed;
+	if (packet.compress) {
+		compressed = Compression::compress (packet.data);
+		if (compressed.length () < packet.data.length ()) {
+			data = compressed.data ();
+			len = compressed.length ();
+		}
 	}
 
+	int result = SDLNet_TCP_Send (socket, data, len);
 	if (result < len)
 	{
 		//printf("SDLNet_TCP_Send: %s\n", SDLNet_GetError());
+		return false;
 	}
+	return true;
+}
+
+void NetworkingManager::closeOutbound(int id)
+{
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	std::map<int, Connection>::iterator connection = m_connections.find (id);
+	if (connection == m_connections.end ())
+		return;
+	//The sender writes out what is already queued, then the last of the two threads closes the socket
+	if (connection->second.outbound != nullptr)
+	{
+		connection->second.outbound->finish ();
+		connection->second.outbound = nullptr;
+	}
+	if (connection->second.socket != nullptr)
+	{
+		connection->second.socket->closing = true;
+		connection->second.socket = nullptr;
+	}
+	//Also ends the peer's receive thread, the same as closing the socket would
+	if (connection->second.transport != nullptr)
+	{
+		connection->second.transport->close ();
+		connection->second.transport = nullptr;
+	}
+}
+
+/*
+Prediction mode: clients send sequence-numbered INPUT commands instead of UPDATE transforms,
+the host simulates them and replies with STATE, and clients replay unacknowledged inputs on top.
+Set on the host before hosting, clients pick it up from the ACCEPT packet.
+*/
+void NetworkingManager::setPrediction (bool enabled)
+{
+	m_predictionEnabled = enabled;
+}
+
+Uint32 NetworkingManager::getPlayoutTime (int netID, Uint32 remoteTime)
+{
+	Uint32 now = SDL_GetTicks ();
+	Sint32 sample = (Sint32)(now - remoteTime);
+	std::map<int, ClockEstimate>::iterator it = m_clocks.find (netID);
+	if (it == m_clocks.end ())
+	{
+		ClockEstimate clock;
+		clock.current = sample;
+		clock.previous = sample;
+		clock.windowStart = now;
+		it = m_clocks.insert (std::make_pair (netID, clock)).first;
+	}
+	ClockEstimate& clock = it->second;
+	if (now - clock.windowStart >= CLOCK_WINDOW_MS)
+	{
+		clock.previous = clock.current;
+		clock.current = sample;
+		clock.windowStart = now;
+	}
+	else if (sample < clock.current)
+		clock.current = sample;
+	Sint32 offset = clock.current < clock.previous ? clock.current : clock.previous;
+	return remoteTime + offset + PLAYOUT_DELAY;
 }
 
+void NetworkingManager::setBackpressurePolicy (BackpressurePolicy policy)
+{
+	m_backpressurePolicy = policy;
+}
+
+//Every datagram goes out through the same packet, only reallocated for one bigger than MAXLEN_UDP
 bool NetworkingManager::createUDPPacket(int packetSize)
 {
-	m_udpPacket = SDLNet_AllocPacket(packetSize);
+	if (m_udpPacket != NULL && m_udpPacket->maxlen < packetSize)
+	{
+		SDLNet_FreePacket(m_udpPacket);
+		m_udpPacket = NULL;
+	}
+	if (m_udpPacket == NULL)
+		m_udpPacket = SDLNet_AllocPacket(packetSize > MAXLEN_UDP ? packetSize : MAXLEN_UDP);
 
 	if (m_udpPacket == NULL)
 	{
@@ -271,19 +569,39 @@ bool NetworkingManager::createUDPPacket(int packetSize)
 	if (!isHost ()) {
 		m_udpPacket->address = m_hostAddress;
 	}
-	m_udpPacket->len = packetSize + 1;
+	m_udpPacket->len = packetSize;
 
 	return true;
 }
 
-void NetworkingManager::sendUDP(std::string *msg)
+void NetworkingManager::sendUDP(const std::string &msg)
 {
-	createUDPPacket(msg->length());
-	memcpy(m_udpPacket->data, msg->c_str(), msg->length());
+	//Peers on shared memory get datagrams through it instead of their UDP channel
+	std::vector<std::shared_ptr<Transport>> transports;
+	bool local[MAX_UDP_CHANNELS] = {};
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		for (auto it = m_connections.begin (); it != m_connections.end (); it++) {
+			if ((it->second).transport == nullptr)
+				continue;
+			transports.push_back ((it->second).transport);
+			if ((it->second).udpChannel >= 0 && (it->second).udpChannel < MAX_UDP_CHANNELS)
+				local[(it->second).udpChannel] = true;
+		}
+	}
+	//Unreliable traffic, a full ring drops it like the network would
+	for (size_t i = 0; i < transports.size (); i++)
+		transports[i]->sendDatagram (msg);
+	if (!isHost () && !transports.empty ())
+		return;
+
+	if (!createUDPPacket(msg.length()))
+		return;
+	memcpy(m_udpPacket->data, msg.c_str(), msg.length());
 
 	if (isHost ()) {
-		for (size_t i = 0; i < 4; i++) {
-			if (channels[i]) {
+		for (size_t i = 0; i < MAX_UDP_CHANNELS; i++) {
+			if (channels[i] && !local[i]) {
 				m_udpPacket->channel = i;
 				if (!SDLNet_UDP_Send (m_udpSocket, i, m_udpPacket))
 					std::cout << "SDLNET_UDP_SEND failed: " << SDLNet_GetError () << "\n";
@@ -298,47 +616,241 @@ void NetworkingManager::sendUDP(std::string *msg)
 
 void NetworkingManager::pollMessagesTCP(int id)
 {
-	m_messagesToSendTCP.clear();
-	m_receiverThread = std::thread(&NetworkingManager::pollMessagesThreadTCP, this, id);
+	std::shared_ptr<SharedSocket> socket;
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_clientsMutex);
+		socket = m_connections[id].socket;
+	}
+	if (socket == nullptr)
+		return;
+	m_receiverThread = std::thread(&NetworkingManager::pollMessagesThreadTCP, this, id, socket);
 	m_receiverThread.detach();
 }
 
-void NetworkingManager::pollMessagesThreadTCP(int id)
+void NetworkingManager::pollMessagesThreadTCP(int id, std::shared_ptr<SharedSocket> socket)
 {
 
+	TRACE_THREAD ("Net receive TCP");
 	int result;
 	char msg[MAXLEN_TCP];
+	//A recv can end mid packet or hold several, whatever isn't a whole packet yet waits here for the next one
+	std::string stream;
+	std::string packet;
 
-	while (m_socket != NULL) { 
-		if (m_clients.find(id) != m_clients.end())
-			result = SDLNet_TCP_Recv(m_clients[id].second, msg, MAXLEN_TCP);
-		else if (m_socket != NULL)
-			result = SDLNet_TCP_Recv(m_socket, msg, MAXLEN_TCP);
+	while (!socket->closing) { 
+		result = receiveTCP(*socket, msg, MAXLEN_TCP);
 		if (result <= 0)
 		{
-			if (isHost ()) {
-				closeClientAsHost (id);
-			} else {
-				closeClient ();
-			}
-			continue;
+			break;
+		}
+		//From the first bytes arriving, waiting for them isn't work
+		TRACE_ZONE ("net", "Receive TCP packet");
+		stream.append(msg, result);
+		int taken;
+		while ((taken = takePacketTCP(stream, packet)) == 1)
+		{
+			//std::cout << "RECIEVING: " << packet << std::endl;
+			if (!packet.empty())
+				m_messageQueue->push(packet);
+			else
+				std::cout << "Dropped malformed compressed packet from " << id << std::endl;
+		}
+		if (taken == -1)
+		{
+			std::cout << "Unreadable stream from " << id << ", closing the connection." << std::endl;
+			break;
 		}
-		std::string newMsg = msg;
-		//std::cout << "RECIEVING: " << msg << std::endl;
-		m_messageQueue->push(newMsg);
 	};
-	if (isHost ()) {
-		closeClientAsHost (id);
-	}
-	else {
-		closeClient ();
+	//The peer left, rather than us closing the connection
+	if (!socket->closing)
+		closeLostConnection (id, socket);
+	socket->closing = true;
+}
+
+//Waits in RECEIVE_TIMEOUT_MS slices so a connection we close is noticed, returns 0 once it is
+int NetworkingManager::receiveTCP(SharedSocket &socket, char *buffer, int maxLen)
+{
+	while (!socket.closing)
+	{
+		int ready = SDLNet_CheckSockets(socket.set, RECEIVE_TIMEOUT_MS);
+		if (ready == -1)
+			return -1;
+		if (ready > 0 && SDLNet_SocketReady(socket.socket))
+			return SDLNet_TCP_Recv(socket.socket, buffer, maxLen);
 	}
+	return 0;
 }
 
+/*
+Cuts the next whole packet off the front of a connection's stream: a compressed frame, or plain text up to its
+null terminator. Returns 1 with the packet (empty if the frame didn't decompress), 0 until the rest of it has
+arrived, or -1 if the stream can't be read any further.
+*/
+int NetworkingManager::takePacketTCP(std::string &stream, std::string &packet)
+{
+	packet.clear();
+	if (stream.empty())
+		return 0;
+	if ((unsigned char)stream[0] == COMPRESSION_MARKER)
+	{
+		int frameLength = Compression::frameLength(stream.data(), (int)stream.length());
+		if (frameLength == -1)
+			return 0;
+		//A length no compressor produces means we lost track of where packets start
+		if (frameLength < COMPRESSION_HEADER_SIZE || frameLength > COMPRESSION_HEADER_SIZE + 2 * COMPRESSION_MAX_RAW_SIZE)
+			return -1;
+		if ((int)stream.length() < frameLength)
+			return 0;
+		if (!Compression::decompress(stream.data(), frameLength, packet))
+			packet.clear();
+		stream.erase(0, frameLength);
+		return 1;
+	}
+	size_t end = stream.find('\0');
+	if (end == std::string::npos)
+		return stream.length() > 2 * COMPRESSION_MAX_RAW_SIZE ? -1 : 0;
+	packet.assign(stream, 0, end);
+	stream.erase(0, end + 1);
+	return 1;
+}
 
 void NetworkingManager::sendAcceptPacket (int id) {
-	std::string packet = "[{key:ACCEPT,netID:0,myNetID:" + std::to_string (id) + "}]";
-	send (id, &packet);
+	std::string packet = "[{key:ACCEPT,netID:0,myNetID:" + std::to_string (id);
+	if (m_compressionEnabled)
+		packet += ",compression:" + std::to_string (COMPRESSION_VERSION);
+	if (m_predictionEnabled)
+		packet += ",prediction:1";
+	packet += "}]";
+	send (id, packet);
+}
+
+void NetworkingManager::setCompression (bool enabled)
+{
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	m_compressionEnabled = enabled;
+	if (!enabled)
+		for (auto it = m_connections.begin (); it != m_connections.end (); it++)
+			(it->second).compression = false;
+}
+
+//Client side: the host advertised compression in its ACCEPT packet
+void NetworkingManager::acceptCompression (int version)
+{
+	if (!m_compressionEnabled || version != COMPRESSION_VERSION)
+		return;
+	//As a client our only connection is the host, which addPlayer registers as 0
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		m_connections[0].compression = true;
+	}
+	std::string packet = "[{key:COMPRESSION,netID:" + std::to_string (m_assignedID) + ",version:" + std::to_string (version) + "}]";
+	send (0, packet);
+}
+
+//Host side: the client confirmed it can decompress our frames
+void NetworkingManager::handleCompressionPacket (std::map<std::string, void*> data)
+{
+	int id = std::stoi (*(std::string*)data["netID"]);
+	int version = std::stoi (*(std::string*)data["version"]);
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	if (m_compressionEnabled && version == COMPRESSION_VERSION && m_clients.find (id) != m_clients.end ())
+		m_connections[id].compression = true;
+}
+
+void NetworkingManager::setSharedMemory (bool enabled)
+{
+	m_sharedMemoryEnabled = enabled;
+}
+
+//Client side, after the ACCEPT: a host that can open the segment runs on this machine
+void NetworkingManager::offerSharedMemory ()
+{
+	if (!m_sharedMemoryEnabled)
+		return;
+	m_pendingTransport = SharedMemoryTransport::create (SharedMemoryTransport::uniqueName (m_port));
+	if (m_pendingTransport == nullptr)
+		return;
+	std::string packet = "[{key:SHM,netID:" + std::to_string (m_assignedID) + ",name:" + m_pendingTransport->getName () + "}]";
+	send (0, packet);
+}
+
+//Host side. The reply goes out on TCP before we switch, so the client reads everything in order
+void NetworkingManager::handleSharedMemoryPacket (std::map<std::string, void*> data)
+{
+	int id = std::stoi (*(std::string*)data["netID"]);
+	std::shared_ptr<SharedMemoryTransport> transport;
+	if (m_sharedMemoryEnabled)
+		transport = SharedMemoryTransport::open (*(std::string*)data["name"]);
+
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	bool accepted = transport != nullptr && m_clients.find (id) != m_clients.end ();
+	send (id, std::string ("[{key:SHMREPLY,netID:0,accepted:") + (accepted ? "1" : "0") + "}]");
+	//send disconnects the client if its queue is full
+	if (!accepted || m_clients.find (id) == m_clients.end ())
+		return;
+	//We send through it from now on, reading waits for the client's SHMSWITCH
+	m_connections[id].transport = transport;
+	std::cout << "Client " << id << " is on this machine, using shared memory." << std::endl;
+}
+
+//Host side: SHMSWITCH is the client's last TCP packet. Everything it sent before has been dispatched by now,
+//so reading the ring from here on keeps its messages in order
+void NetworkingManager::handleSharedMemorySwitch (std::map<std::string, void*> data)
+{
+	int id = std::stoi (*(std::string*)data["netID"]);
+	std::shared_ptr<Transport> transport;
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		std::map<int, Connection>::iterator connection = m_connections.find (id);
+		if (connection != m_connections.end ())
+			transport = connection->second.transport;
+	}
+	if (transport == nullptr)
+		return;
+	std::thread receiver (&NetworkingManager::pollMessagesThreadTransport, this, id, transport);
+	receiver.detach ();
+}
+
+//Client side. Until now the host kept sending on TCP, anything after its reply waits in the ring
+void NetworkingManager::handleSharedMemoryReply (std::map<std::string, void*> data)
+{
+	std::shared_ptr<SharedMemoryTransport> transport = m_pendingTransport;
+	m_pendingTransport = nullptr;
+	if (transport == nullptr)
+		return;
+	//Either the host has it mapped or never will
+	transport->unlink ();
+	if (*(std::string*)data["accepted"] != "1")
+		return;
+	//Goes out behind whatever is still in the TCP queue, the host only reads the ring after it
+	send (0, "[{key:SHMSWITCH,netID:" + std::to_string (m_assignedID) + "}]");
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		m_connections[0].transport = transport;
+	}
+	std::thread receiver (&NetworkingManager::pollMessagesThreadTransport, this, 0, transport);
+	receiver.detach ();
+	std::cout << "Host is on this machine, using shared memory." << std::endl;
+}
+
+//The socket stays open next to the transport, its receive thread still notices a peer that died without closing
+void NetworkingManager::pollMessagesThreadTransport (int id, std::shared_ptr<Transport> transport)
+{
+	TRACE_THREAD ("Net receive shared memory");
+	std::string packet;
+	while (transport->receive (packet)) {
+		TRACE_ZONE ("net", "Receive shared memory packet");
+		m_messageQueue->push (packet);
+	}
+	//Only the peer closing it ends the connection, when we closed it closeOutbound already cleared it
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	std::map<int, Connection>::iterator connection = m_connections.find (id);
+	if (connection == m_connections.end () || connection->second.transport != transport)
+		return;
+	if (isHost ())
+		closeClientAsHost (id);
+	else
+		closeClient ();
 }
 
 void NetworkingManager::listenforAcceptPacket ()
@@ -346,6 +858,11 @@ void NetworkingManager::listenforAcceptPacket ()
 	this->m_handshakeListenerID = MessageManager::subscribe ("0|ACCEPT", [](std::map<std::string, void*> data) -> void
 	{
 		NetworkingManager::getInstance()->m_assignedID = std::stoi (*(std::string*)data["myNetID"]);
+		if (data.find ("compression") != data.end ())
+			NetworkingManager::getInstance ()->acceptCompression (std::stoi (*(std::string*)data["compression"]));
+		NetworkingManager::getInstance ()->offerSharedMemory ();
+		//The host decides whether clients send input commands or transforms
+		NetworkingManager::getInstance ()->setPrediction (data.find ("prediction") != data.end ());
 		NetworkingManager::getInstance ()->stopListeningForAcceptPacket ();
 		SpawnManager::getInstance ()->listenForStartPacket ();
 
@@ -373,13 +890,15 @@ void NetworkingManager::stopListeningForAcceptPacket () {
 
 void NetworkingManager::pollMessagesUDP()
 {
-	m_messagesToSendUDP.clear();
+	for (int lane = 0; lane < LANE_COUNT; lane++)
+		m_lanesUDP[lane].clear();
 	m_udpReceiverThread = std::thread(&NetworkingManager::pollMessagesThreadUDP, this);
 	m_udpReceiverThread.detach();
 }
 
 void NetworkingManager::pollMessagesThreadUDP()
 {
+	TRACE_THREAD ("Net receive UDP");
 	int result;
 	char msg[MAXLEN_UDP];
 
@@ -400,6 +919,7 @@ void NetworkingManager::pollMessagesThreadUDP()
 		}
 		else if (result == 1)
 		{
+			TRACE_ZONE ("net", "Receive UDP packet");
 			std::string newMsg (recPacket->data, recPacket->data + recPacket->len);
 			m_messageQueue->push (newMsg);
 		}
@@ -421,189 +941,340 @@ bool NetworkingManager::getMessage(std::string &msg)
 	return false;
 }
 
-void NetworkingManager::prepareMessageForSendingUDP (int netID, std::string key, std::map<std::string, std::string> data)
+//Keys not listed here are gameplay. Lanes drain in priority order even within one flush, so CREATE and SPAWN
+//share the urgent lane with DESTROY: an entity exists before its own messages and before it is destroyed.
+//DESTROY and ENDGAME also bring what was queued before them along, see queueMessage
+MessageLane NetworkingManager::getLane (const std::string &key)
 {
-	Message message;
-	message.netID = netID;
-	message.key = key;
-	message.data = data;
-	m_messagesToSendUDP.push_back (message);
+	if (key == "ENDGAME" || key == "CREATE" || key == "SPAWN" || key == "DESTROY" || key == "LSSTART" || key == "LSDROP")
+		return LANE_URGENT;
+	if (key == "LSCHECKSUM")
+		return LANE_BULK;
+	return LANE_GAMEPLAY;
 }
 
-void NetworkingManager::prepareMessageForSendingTCP (int netID, std::string key, std::map<std::string, std::string> data)
+void NetworkingManager::setSendBudget (int tcpBytes, int udpBytes)
+{
+	m_sendBudgetTCP = tcpBytes;
+	m_sendBudgetUDP = udpBytes;
+}
+
+void NetworkingManager::queueMessage (std::deque<Message> *lanes, int netID, const std::string &key, const std::map<std::string, std::string> &data, MessageLane lane)
 {
 	Message message;
 	message.netID = netID;
-	message.key = key;
-	message.data = data;
-	m_messagesToSendTCP.push_back (message);
+	message.lane = lane;
+	message.queued = SDL_GetTicks ();
+	serializeMessage (message, key, data);
+	//Nothing the entity sent earlier may arrive after its DESTROY, nor anything from the match after ENDGAME
+	if (lane == LANE_URGENT && (key == "DESTROY" || key == "ENDGAME"))
+		promoteEarlier (lanes, netID, key == "ENDGAME");
+	lanes[lane].push_back (message);
+}
+
+//Moves queued messages from the lower lanes to the back of the urgent lane, oldest first
+void NetworkingManager::promoteEarlier (std::deque<Message> *lanes, int netID, bool everyEntity)
+{
+	std::vector<Message> earlier;
+	for (int lane = LANE_URGENT + 1; lane < LANE_COUNT; lane++) {
+		std::deque<Message> kept;
+		for (size_t i = 0; i < lanes[lane].size (); i++) {
+			if (everyEntity || lanes[lane][i].netID == netID)
+				earlier.push_back (lanes[lane][i]);
+			else
+				kept.push_back (lanes[lane][i]);
+		}
+		lanes[lane].swap (kept);
+	}
+	std::stable_sort (earlier.begin (), earlier.end (), [](const Message &a, const Message &b) {
+		return a.queued < b.queued;
+	});
+	for (size_t i = 0; i < earlier.size (); i++) {
+		earlier[i].lane = LANE_URGENT;
+		lanes[LANE_URGENT].push_back (earlier[i]);
+	}
+}
+
+void NetworkingManager::prepareMessageForSendingUDP (int netID, const std::string &key, const std::map<std::string, std::string> &data)
+{
+	queueMessage (m_lanesUDP, netID, key, data, getLane (key));
+}
+
+void NetworkingManager::prepareMessageForSendingUDP (int netID, const std::string &key, const std::map<std::string, std::string> &data, MessageLane lane)
+{
+	queueMessage (m_lanesUDP, netID, key, data, lane);
+}
+
+void NetworkingManager::prepareMessageForSendingTCP (int netID, const std::string &key, const std::map<std::string, std::string> &data)
+{
+	queueMessage (m_lanesTCP, netID, key, data, getLane (key));
+}
+
+void NetworkingManager::prepareMessageForSendingTCP (int netID, const std::string &key, const std::map<std::string, std::string> &data, MessageLane lane)
+{
+	queueMessage (m_lanesTCP, netID, key, data, lane);
+}
+
+/*
+Picks what goes out this flush: first every message past its lane deadline, then the lanes in priority
+order, FIFO within a lane, until the byte budget is spent. Returns the packets, each at most maxPacket
+bytes unless a single message is bigger.
+*/
+std::vector<std::string> NetworkingManager::drainLanes (std::deque<Message> *lanes, int budget, size_t maxPacket)
+{
+	static const Uint32 deadlines[LANE_COUNT] = { LANE_DEADLINE_URGENT, LANE_DEADLINE_GAMEPLAY, LANE_DEADLINE_BULK };
+	Uint32 now = SDL_GetTicks ();
+	std::vector<std::string> packets;
+	std::string packet = "[";
+	int spent = 0;
+	bool full = false;
+
+	for (int pass = 0; pass < 2 && !full; pass++) {
+		for (int lane = 0; lane < LANE_COUNT && !full; lane++) {
+			while (!lanes[lane].empty ()) {
+				Message &message = lanes[lane].front ();
+				bool overdue = now - message.queued >= deadlines[lane];
+				//Lanes are FIFO, so once one message isn't overdue the rest of the lane isn't either
+				if (pass == 0 && !overdue)
+					break;
+				if (pass == 1 && spent + (int)message.length > budget) {
+					full = true;
+					break;
+				}
+				//Room for the separator and the closing bracket
+				if (packet.length () > 1 && packet.length () + message.length + 2 > maxPacket) {
+					packets.push_back (packet + "]");
+					packet = "[";
+				}
+				packet += packet.length () > 1 ? "," : "";
+				packet.append (message.text, message.length);
+				spent += message.length;
+				lanes[lane].pop_front ();
+			}
+		}
+	}
+	if (packet.length () > 1)
+		packets.push_back (packet + "]");
+	return packets;
 }
 
 void NetworkingManager::sendQueuedEvents () {
+	TRACE_ZONE ("net", "sendQueuedEvents");
 	sendQueuedEventsTCP ();
 	sendQueuedEventsUDP ();
+	recycleOutboundArena ();
+}
+
+//Messages the budget held back outlive this flush, they are copied to the other arena before this one resets
+void NetworkingManager::recycleOutboundArena ()
+{
+	FrameArena &next = m_outboundArenas[1 - m_outboundArena];
+	for (int lane = 0; lane < LANE_COUNT; lane++) {
+		for (auto it = m_lanesTCP[lane].begin (); it != m_lanesTCP[lane].end (); it++)
+			it->text = next.copy (it->text, it->length);
+		for (auto it = m_lanesUDP[lane].begin (); it != m_lanesUDP[lane].end (); it++)
+			it->text = next.copy (it->text, it->length);
+	}
+	m_outboundArenas[m_outboundArena].reset ();
+	m_outboundArena = 1 - m_outboundArena;
 }
 
 void NetworkingManager::sendQueuedEventsTCP ()
 {
-	if (m_messagesToSendTCP.size () < 1)
+	//The receiver reads one null terminated packet per recv, so a flush stays a single packet
+	std::vector<std::string> packets = drainLanes (m_lanesTCP, m_sendBudgetTCP, std::string::npos);
+	if (packets.empty ())
 		return;
-	std::string packet = "[";
-	for (size_t i = 0; i < m_messagesToSendTCP.size (); i++)
-	{
-		packet += serializeMessage (m_messagesToSendTCP[i]);
-		packet += ",";
-	}
-	packet.pop_back ();
-	packet += "]";
-	//Submit it
-	m_messagesToSendTCP.clear ();
+	const std::string &packet = packets[0];
 
-	for (auto it = m_clients.begin (); it != m_clients.end (); it++) {
-		if ((it->second).first == -1) {
-			m_clients.erase (it);
-			--it;
-		}
-		else if (m_assignedID != it->first) {
-			send(it->first, new std::string(packet));
+	//send can disconnect a client, so pick the targets before touching m_clients
+	std::vector<int> targets;
+	std::vector<int> removed;
+	{
+		std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+		for (auto it = m_clients.begin (); it != m_clients.end (); it++) {
+			if ((it->second).first == -1) {
+				removed.push_back (it->first);
+			}
+			else if (m_assignedID != it->first) {
+				targets.push_back (it->first);
+			}
 		}
 	}
+	for (size_t i = 0; i < removed.size (); i++)
+		closeClientAsHost (removed[i]);
+	for (size_t i = 0; i < targets.size (); i++)
+		send (targets[i], packet);
 }
 
 void NetworkingManager::sendQueuedEventsUDP ()
 {
-	if (m_messagesToSendUDP.size () < 1)
-		return;
-	std::string packet = "[";
-	for (size_t i = 0; i < m_messagesToSendUDP.size (); i++)
-	{
-		packet += serializeMessage (m_messagesToSendUDP[i]);
-		packet += ",";
-	}
-	packet.pop_back ();
-	packet += "]";
-	//Submit it
-	m_messagesToSendUDP.clear ();
-	sendUDP(new std::string(packet));
+	//Datagrams are split to fit the receive buffer
+	std::vector<std::string> packets = drainLanes (m_lanesUDP, m_sendBudgetUDP, MAXLEN_UDP);
+	for (size_t i = 0; i < packets.size (); i++)
+		sendUDP (packets[i]);
 }
 
 void NetworkingManager::sendEventToReceiver(std::map<std::string, void*> data)
 {
 	std::string* key = (std::string*)data["key"];
 	std::string netID = *(std::string*)data["netID"];
+	if (*key == "COMPRESSION")
+	{
+		handleCompressionPacket(data);
+		return;
+	}
+	if (*key == "SHM")
+	{
+		handleSharedMemoryPacket(data);
+		return;
+	}
+	if (*key == "SHMREPLY")
+	{
+		handleSharedMemoryReply(data);
+		return;
+	}
+	if (*key == "SHMSWITCH")
+	{
+		handleSharedMemorySwitch(data);
+		return;
+	}
+	//Entities with a Receiver have a single route keyed by netID, anything else listening uses "netID|key"
+	//subscriptions, and both hear every message
+	MessageManager::sendRouteEvent(std::stoi(netID), data);
 	std::string value = netID + "|" + *key;
 	//std::cout << "Event: " << value << " NetID: " << netID << std::endl;
-	MessageManager::sendEvent(value, data);
+	MessageManager::sendNetworkEvent(value, data);
 }
 
-std::string NetworkingManager::serializeMessage(Message message)
+static char* writeField(char *out, const char *name, size_t nameLength, const char *value, size_t valueLength)
 {
-	std::string result = "{";
-	message.data["netID"] = std::to_string(message.netID).c_str();
-	message.data["key"] = message.key.c_str ();
+	memcpy(out, name, nameLength);
+	out += nameLength;
+	*out++ = ':';
+	memcpy(out, value, valueLength);
+	out += valueLength;
+	*out++ = ',';
+	return out;
+}
 
-	for (const auto tuple : message.data)
+//netID and key always come from the message, a "netID" or "key" entry in data is ignored
+void NetworkingManager::serializeMessage(Message &message, const std::string &key, const std::map<std::string, std::string> &data)
+{
+	char id[16];
+	int idLength = snprintf(id, sizeof(id), "%d", message.netID);
+	size_t length = key.length() + idLength + 13; //{key:KEY,netID:ID}
+	for (auto it = data.begin(); it != data.end(); it++)
 	{
-		result += tuple.first + ":" + message.data[tuple.first] + ",";
+		if (it->first != "netID" && it->first != "key")
+			length += it->first.length() + it->second.length() + 2;
 	}
-	result.pop_back();
-	result += "}";
-	return result;
+
+	//Fields go out in std::map's order with key and netID slotted in, the layout the compression dictionary expects
+	char *text = m_outboundArenas[m_outboundArena].allocate(length);
+	char *out = text;
+	*out++ = '{';
+	bool keyWritten = false;
+	bool idWritten = false;
+	for (auto it = data.begin(); ; it++)
+	{
+		bool last = it == data.end();
+		if (!keyWritten && (last || it->first > "key"))
+		{
+			out = writeField(out, "key", 3, key.data(), key.length());
+			keyWritten = true;
+		}
+		if (!idWritten && (last || it->first > "netID"))
+		{
+			out = writeField(out, "netID", 5, id, idLength);
+			idWritten = true;
+		}
+		if (last)
+			break;
+		if (it->first == "netID" || it->first == "key")
+			continue;
+		out = writeField(out, it->first.data(), it->first.length(), it->second.data(), it->second.length());
+	}
+	//Replaces the last field's separator
+	out--;
+	*out++ = '}';
+	message.text = text;
+	message.length = out - text;
 }
 
 
-void NetworkingManager::handleParsingEvents(std::string packet)
+void NetworkingManager::handleParsingEvents(const std::string &packet)
 {
-	std::vector<std::string> messages;
+	TRACE_ZONE("net", "handleParsingEvents");
+	//Packets are [{...},{...}], each message is dispatched as soon as its closing brace is found
 	if (packet.size() > 2)
 	{
-		packet.erase(0, 1);
-		packet.pop_back();
-		std::string currentMessage;
-		bool reading = false;
-		while (packet.size() > 0)
+		const char *text = packet.c_str();
+		size_t start = std::string::npos;
+		for (size_t i = 1; i < packet.size() - 1; i++)
 		{
-		if (!reading)
-		{
-			if (packet[0] == '{')
+			if (start == std::string::npos)
 			{
-				reading = true;
-				currentMessage += packet[0];
+				if (text[i] == '{')
+					start = i;
 			}
-		}
-		else
-		{
-			currentMessage += packet[0];
-			if (packet[0] == '}')
+			else if (text[i] == '}')
 			{
-				reading = false;
-				messages.push_back (currentMessage);
-				sendEventToReceiver (deserializeMessage (currentMessage));
-				currentMessage = "";
+				sendEventToReceiver(deserializeMessage(text + start, i + 1 - start));
+				start = std::string::npos;
 			}
 		}
-
-		packet.erase (0, 1);
-		}
 	}
+	//Every subscriber has run, the values go in one step
+	m_inboundArena.reset();
 }
 
 
 
-//TODO: Deserialize this:
 //Example: {key : Player|UPDATE,rotation : 37.000000,scale : 1.000000,x : 1.000000,y : 0.000000}
-std::map<std::string, void*> NetworkingManager::deserializeMessage (std::string message)
+//Whitespace is dropped. Values are std::strings in the inbound arena, valid until the packet is dispatched
+std::map<std::string, void*> NetworkingManager::deserializeMessage (const char *message, size_t length)
 {
 	std::map<std::string, void*> data;
-	std::string currentKey = "";
-	std::string currentValue = "";
-	bool readingKey;
-	bool readingValue;
-	while (message.size () > 0)
+	//Keys and values are compacted into this buffer as they are read
+	char *buffer = m_inboundArena.allocate (length);
+	size_t used = 0;
+	size_t keyStart = 0;
+	size_t keyEnd = 0;
+	size_t valueStart = 0;
+	bool readingKey = false;
+	bool readingValue = false;
+	for (size_t i = 0; i < length; i++)
 	{
-		char curChar = message[0];
-		message.erase (0, 1);
+		char curChar = message[i];
 
-		if (curChar == ',' || curChar == '{')
+		if (curChar == ',' || curChar == '{' || curChar == '}')
 		{
+			if (curChar != '{')
+			{
+				if (readingKey)
+					keyEnd = valueStart = used;
+				data[std::string (buffer + keyStart, keyEnd - keyStart)] = (void*)m_inboundArena.makeString (buffer + valueStart, used - valueStart);
+			}
+			if (curChar == '}')
+				break;
 			//Start reading key
 			readingKey = true;
 			readingValue = false;
-			if (curChar == ',')
-			{
-				data[currentKey] = (void*)new std::string (currentValue);
-			}
-			std::string newCurrentString = "";
-			std::string newCurrentValue = "";
-			currentKey = newCurrentString;
-			currentValue = newCurrentValue;
+			keyStart = used;
 			continue;
 		}
 		else if (curChar == ':')
 		{
-			//Start reading value
+			//Start reading value, a second ':' just continues it
+			if (readingKey)
+				keyEnd = valueStart = used;
 			readingValue = true;
 			readingKey = false;
 			continue;
 		}
-		else if (curChar == '}')
-		{
-			//End
-			data[currentKey] = (void*)new std::string (currentValue);
-			break;
-		}
-		if (!::isspace (curChar))
-		{
-			if (readingKey)
-			{
-				currentKey += curChar;
-			}
-			else if (readingValue)
-			{
-				currentValue += curChar;
-			}
-		}
-
+		if (!::isspace (curChar) && (readingKey || readingValue))
+			buffer[used++] = curChar;
 	}
 	return data;
 }
@@ -616,7 +1287,8 @@ void NetworkingManager::setIP (char *ip, int p)
 
 int NetworkingManager::addPlayer (Uint32 ip, TCPsocket sock)
 {
-	if (m_clients.size () > 16)
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	if (m_clients.size () > MAX_CLIENTS)
 	{
 		return -1;
 	}
@@ -633,6 +1305,7 @@ int NetworkingManager::addPlayer (Uint32 ip, TCPsocket sock)
 
 int NetworkingManager::removePlayer(int id)
 {
+	std::lock_guard<std::recursive_mutex> lock(m_clientsMutex);
 	for (auto it = m_clients.begin(); it != m_clients.end(); it++)
 	{
 		if (it->first == id) 
@@ -644,6 +1317,25 @@ int NetworkingManager::removePlayer(int id)
 	return 0;
 }
 
+bool NetworkingManager::hasClient (int id)
+{
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	std::map<int, std::pair<Uint32, TCPsocket>>::iterator it = m_clients.find (id);
+	return it != m_clients.end () && (it->second).first != (Uint32)-1;
+}
+
+//Host: our own id and every connected client, in id order
+std::vector<int> NetworkingManager::getClientIDs ()
+{
+	std::lock_guard<std::recursive_mutex> lock (m_clientsMutex);
+	std::vector<int> ids;
+	for (auto it = m_clients.begin (); it != m_clients.end (); it++) {
+		if ((it->second).first != (Uint32)-1)
+			ids.push_back (it->first);
+	}
+	return ids;
+}
+
 bool NetworkingManager::isSelf (int id) {
 	return m_assignedID == id;
 }
\ No newline at end of file
@@ -6,58 +6,179 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include "OutboundQueue.h"
+#include "SharedMemoryTransport.h"
+#include "FrameArena.h"
 #define DEFAULT_IP "127.0.0.1"
 #define DEFAULT_PORT 9999
 #define DEFAULT_CHANNEL 1
 #define MAXLEN_UDP 1024
 #define MAXLEN_TCP 16384
+//Packets buffered per connection before the backpressure policy kicks in
+#define OUTBOUND_QUEUE_SIZE 64
+//How long the lobby accept thread sleeps in SDLNet_CheckSockets before rechecking m_inLobby
+#define ACCEPT_TIMEOUT_MS 100
+//Same for connection receive threads, so they notice a connection closing from our side
+#define RECEIVE_TIMEOUT_MS 100
+//Longest a TCP send may block on a peer that stopped reading before the connection counts as lost
+#define SEND_TIMEOUT_MS 2000
+#define MAX_CLIENTS 16
+#define MAX_UDP_CHANNELS 16
+//Remote sound events play this long after they were sent, enough to absorb normal jitter
+#define PLAYOUT_DELAY 100
+//The clock offset estimate is the lowest transit seen over the last one or two windows, so it follows drift
+#define CLOCK_WINDOW_MS 10000
+//Bytes sendQueuedEvents puts on each transport per call, overdue messages go out regardless
+#define SEND_BUDGET_TCP 8192
+#define SEND_BUDGET_UDP 4096
+//Longest a message waits in its lane before it is sent over budget
+#define LANE_DEADLINE_URGENT 0
+#define LANE_DEADLINE_GAMEPLAY 100
+#define LANE_DEADLINE_BULK 1000
+
+//Outbound lanes, drained in this order
+enum MessageLane
+{
+	LANE_URGENT, //ENDGAME, entity lifetime and lockstep control, never wait
+	LANE_GAMEPLAY,
+	LANE_BULK, //only what can safely arrive late, like lockstep checksums
+	LANE_COUNT
+};
 
 struct Message
 {
 	int netID;
-	std::string key;
-	std::map<std::string, std::string> data;
+	//Serialized when prepared, {name:value,...,key:KEY,netID:ID} in the outbound arena
+	const char *text;
+	Uint32 length;
+	MessageLane lane;
+	Uint32 queued; //SDL_GetTicks when prepared, for the lane deadline
+};
+
+//A connection's TCP socket, shared by its sender and receive threads. The socket is only closed once
+//both have let go, so neither can be left inside a send or recv on a freed socket
+struct SharedSocket
+{
+	TCPsocket socket;
+	SDLNet_SocketSet set; //the receive thread's timed wait
+	std::atomic<bool> closing{ false };
+	SharedSocket(TCPsocket socket);
+	//Fails a send blocked on this socket and wakes the receive thread, without freeing the socket under them
+	void shutdown();
+	~SharedSocket()
+	{
+		SDLNet_FreeSocketSet(set);
+		SDLNet_TCP_Close(socket);
+	}
+};
+
+//Per-connection state negotiated during the handshake, keyed like m_clients
+struct Connection
+{
+	std::shared_ptr<SharedSocket> socket;
+	bool compression = false;
+	std::shared_ptr<OutboundQueue> outbound;
+	int dropped = 0;
+	//Set once a peer on the same machine agreed to shared memory, carries both TCP and UDP traffic from then on
+	std::shared_ptr<Transport> transport;
+	int udpChannel = -1;
+};
+
+//Lowest local receive time minus sender timestamp seen from one peer: the clock offset plus the fastest transit
+struct ClockEstimate
+{
+	Sint32 current;
+	Sint32 previous;
+	Uint32 windowStart;
+};
+
+//What to do when a slow peer lets its outbound queue fill up
+enum BackpressurePolicy
+{
+	BACKPRESSURE_DROP,
+	BACKPRESSURE_DISCONNECT
 };
 
 class NetworkingManager
 {
 private:
 	int m_handshakeListenerID;
-	bool m_inLobby = false; //closeall will set both of these to false
-	bool m_gameStarted = false;
+	std::atomic<bool> m_inLobby{ false }; //closeall will set both of these to false
+	std::atomic<bool> m_gameStarted{ false };
 	bool m_isHost = false;
+	bool m_compressionEnabled = true;
+	bool m_sharedMemoryEnabled = true;
+	//Client: the segment we offered the host, until it answers
+	std::shared_ptr<SharedMemoryTransport> m_pendingTransport;
+	bool m_predictionEnabled = false;
+	std::map<int, Connection> m_connections;
+	std::map<int, ClockEstimate> m_clocks;
+	BackpressurePolicy m_backpressurePolicy = BACKPRESSURE_DROP;
+	//Guards m_clients and m_connections, which the accept, receive and sender threads touch too
+	std::recursive_mutex m_clientsMutex;
 	IPaddress hostIP;
 	static NetworkingManager* s_instance;
+	//Set on session worker threads, where it takes the place of s_instance
+	static thread_local NetworkingManager* t_instance;
 	ThreadQueue<std::string> *m_messageQueue;
 	std::thread m_receiverThread;
 	std::thread m_udpReceiverThread;
-	std::vector<Message> m_messagesToSendTCP;
-	std::vector<Message> m_messagesToSendUDP;
+	std::deque<Message> m_lanesTCP[LANE_COUNT];
+	std::deque<Message> m_lanesUDP[LANE_COUNT];
+	int m_sendBudgetTCP = SEND_BUDGET_TCP;
+	int m_sendBudgetUDP = SEND_BUDGET_UDP;
+	//Outbound messages live in the current arena until flushed, the other one is empty between flushes
+	FrameArena m_outboundArenas[2];
+	int m_outboundArena = 0;
+	//Parsed values of the packet being dispatched
+	FrameArena m_inboundArena;
+	void queueMessage(std::deque<Message> *lanes, int netID, const std::string &key, const std::map<std::string, std::string> &data, MessageLane lane);
+	void promoteEarlier(std::deque<Message> *lanes, int netID, bool everyEntity);
+	std::vector<std::string> drainLanes(std::deque<Message> *lanes, int budget, size_t maxPacket);
+	void recycleOutboundArena();
 	char *IP = DEFAULT_IP;
 	int m_port = DEFAULT_PORT;
 	
 	IPaddress m_hostAddress;
-	bool channels[4] = { false, false, false, false };
+	bool channels[MAX_UDP_CHANNELS] = {};
 
-	UDPpacket *m_udpPacket;
+	UDPpacket *m_udpPacket = NULL;
 	UDPpacket m_udpReceivedPacket;
 	UDPsocket m_udpSocket = NULL;
 	TCPsocket m_socket = NULL;
-	bool accept();
+	//Host: the listening socket, shared with the accept thread so it is only closed once that thread is done
+	std::shared_ptr<SharedSocket> m_listenSocket;
+	bool accept(TCPsocket listener);
 	bool host();
 	bool join();
 	void pollMessagesTCP(int id);
-	void pollMessagesThreadTCP(int id);
+	void pollMessagesThreadTCP(int id, std::shared_ptr<SharedSocket> socket);
+	int receiveTCP(SharedSocket &socket, char *buffer, int maxLen);
+	void startSendingTCP(int id);
+	void sendThreadTCP(int id, std::shared_ptr<SharedSocket> socket, std::shared_ptr<OutboundQueue> queue);
+	bool writeTCP(TCPsocket socket, const OutboundPacket &packet);
+	void closeOutbound(int id);
+	void closeLostConnection(int id, const std::shared_ptr<SharedSocket> &socket);
+	int takePacketTCP(std::string &stream, std::string &packet);
 	void pollMessagesUDP();
 	void pollMessagesThreadUDP();
-	std::string serializeMessage(Message message);
-	std::map<std::string, void*> deserializeMessage(std::string message);
+	void serializeMessage(Message &message, const std::string &key, const std::map<std::string, std::string> &data);
+	std::map<std::string, void*> deserializeMessage(const char *message, size_t length);
 	void sendEventToReceiver(std::map<std::string, void*> data);
 	void sendAcceptPacket (int id);
+	void handleCompressionPacket (std::map<std::string, void*> data);
+	void offerSharedMemory ();
+	void handleSharedMemoryPacket (std::map<std::string, void*> data);
+	void handleSharedMemoryReply (std::map<std::string, void*> data);
+	void handleSharedMemorySwitch (std::map<std::string, void*> data);
+	void pollMessagesThreadTransport (int id, std::shared_ptr<Transport> transport);
 
 	std::thread m_socketAcceptThread;
 	void pollSocketAccept ();
-	void socketAcceptThread ();
+	void socketAcceptThread (std::shared_ptr<SharedSocket> listener);
 
 public:
 	int m_assignedID = -1;
@@ -67,28 +188,64 @@ public:
 	void sendStartPacket();
 	void listenforAcceptPacket ();
 	void stopListeningForAcceptPacket ();
+	void setCompression (bool enabled);
+	/*
+	Peers on the same machine move to a shared memory transport after the handshake. Set before
+	hosting or joining, either side turning it off keeps that connection on TCP and UDP.
+	*/
+	void setSharedMemory (bool enabled);
+	void setBackpressurePolicy (BackpressurePolicy policy);
+	void setPrediction (bool enabled);
+	/*
+	Local SDL_GetTicks time at which an event netID stamped with remoteTime should take effect:
+	its send time on our clock plus PLAYOUT_DELAY. Call once per received stamped message.
+	*/
+	Uint32 getPlayoutTime (int netID, Uint32 remoteTime);
+	bool usePrediction () {
+		return m_predictionEnabled;
+	}
+	void acceptCompression (int version);
 	bool closeClientAsHost (int id);
 	bool closeClient ();
 	bool closeUDP();
 	NetworkingManager();
 	static NetworkingManager* getInstance();
+	/*
+	Makes getInstance return instance on the calling thread, nullptr goes back to the process wide one.
+	Used by Session so each hosted match has its own sockets and queues.
+	*/
+	static void setThreadInstance(NetworkingManager* instance);
 	IPaddress getIP();
 	bool startGame();
 	bool startGameClient();
 	bool createHost();
 	bool createClient();
-	void send(int id, std::string *msg);
+	void send(int id, const std::string &msg);
 	bool createUDPPacket(int packetSize);
-	void sendUDP(std::string *msg);
+	void sendUDP(const std::string &msg);
 	bool getMessage(std::string &msg);
-	void prepareMessageForSendingUDP (int netID, std::string key, std::map<std::string, std::string> data);
-	void prepareMessageForSendingTCP (int netID, std::string key, std::map<std::string, std::string> data);
+	/*
+	Queues a message for the next sendQueuedEvents. Messages go in the lane getLane picks for their key
+	unless one is given.
+	*/
+	void prepareMessageForSendingUDP (int netID, const std::string &key, const std::map<std::string, std::string> &data);
+	void prepareMessageForSendingUDP (int netID, const std::string &key, const std::map<std::string, std::string> &data, MessageLane lane);
+	void prepareMessageForSendingTCP (int netID, const std::string &key, const std::map<std::string, std::string> &data);
+	void prepareMessageForSendingTCP (int netID, const std::string &key, const std::map<std::string, std::string> &data, MessageLane lane);
+	static MessageLane getLane (const std::string &key);
+	void setSendBudget (int tcpBytes, int udpBytes);
 	void sendQueuedEvents ();
 	void sendQueuedEventsTCP ();
 	void sendQueuedEventsUDP ();
-	void handleParsingEvents(std::string packet);
+	/*
+	Dispatches every message in a received packet. The values are parsed into the inbound arena and
+	reset once the packet is dispatched, MessageManager hands subscribers copies they own.
+	*/
+	void handleParsingEvents(const std::string &packet);
 	bool isConnected();
 	bool isSelf (int id);
+	bool hasClient (int id);
+	std::vector<int> getClientIDs ();
 	bool isHost();
 	bool inLobby () {
 		return m_inLobby;
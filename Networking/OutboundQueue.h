@@ -0,0 +1,80 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+struct OutboundPacket
+{
+	std::string data;
+	bool compress = false;
+};
+
+/*
+	Bounded ring of packets waiting to be written to one connection.
+
+	The game thread pushes and never waits, the connection's sender thread pops and does the blocking write.
+	A full ring is reported back to the caller, which applies the backpressure policy.
+*/
+class OutboundQueue
+{
+private:
+	std::vector<OutboundPacket> m_ring;
+	size_t m_head = 0;
+	size_t m_count = 0;
+	bool m_closed = false;
+	bool m_finishing = false;
+	std::mutex m_mutex;
+	std::condition_variable m_ready;
+
+public:
+	OutboundQueue(size_t capacity) : m_ring(capacity) {}
+
+	//Returns false without blocking if the ring is full or closed
+	bool push(OutboundPacket &packet)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_closed || m_finishing || m_count == m_ring.size())
+			return false;
+		m_ring[(m_head + m_count) % m_ring.size()] = std::move(packet);
+		m_count++;
+		m_ready.notify_one();
+		return true;
+	}
+
+	//Blocks until a packet is available. Returns false once the queue has been closed, or finished and emptied
+	bool pop(OutboundPacket &packet)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_ready.wait(lock, [this] { return m_closed || m_finishing || m_count > 0; });
+		if (m_closed || m_count == 0)
+			return false;
+		packet = std::move(m_ring[m_head]);
+		m_head = (m_head + 1) % m_ring.size();
+		m_count--;
+		return true;
+	}
+
+	//Wakes the sender thread and drops anything still queued
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_count = 0;
+		m_ready.notify_all();
+	}
+
+	//Takes no more packets, but lets the sender thread write what is already queued before it stops
+	void finish()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_finishing = true;
+		m_ready.notify_all();
+	}
+
+	bool isClosed()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_closed || m_finishing;
+	}
+};
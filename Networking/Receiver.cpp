@@ -12,14 +12,19 @@
 #include "Camera.h"
 #include "SceneManager.h"
 #include "MainMenuScene.h"
+#include "AudioManager.h"
+#include "Tracer.h"
+#include "TransformHistory.h"
+#include "LockstepManager.h"
 
 Receiver::Receiver(GameObject* gameObject, int netID) : Component(gameObject)
 {
 
 	this->netID = netID;
-	//Add to map of type "event", key "id"
+	//One route per entity, handlers below are looked up by message key in m_handlers
+	this->m_routeID = MessageManager::subscribeRoute(netID, &Receiver::route, this);
 
-	this->m_onUpdateID = Subscribe("CREATE", [](std::map<std::string, void*> data) -> void
+	Subscribe("CREATE", [](std::map<std::string, void*> data) -> void
 	{
 		float netID = std::stoi(*(std::string*)data["netID"]);
 		if (NetworkingManager::getInstance()->isSelf(netID))
@@ -53,7 +58,9 @@ Receiver::Receiver(GameObject* gameObject, int netID) : Component(gameObject)
 		float newHP = std::stoi(*(std::string*)data["newHealth"]);
 		auto character = self->getGameObject()->getComponent<CharacterController>();
 		if (character != nullptr) {
+			self->beginAudioSchedule(data);
 			character->setHealth(newHP);
+			self->endAudioSchedule();
 		}
 	}, this);
 
@@ -76,16 +83,18 @@ Receiver::Receiver(GameObject* gameObject, int netID) : Component(gameObject)
 		int animReturn = std::stoi(*(std::string*)data["animReturn"]);
 		HostCharacter* host = dynamic_cast<HostCharacter*>(self->getGameObject());
 		if (host != nullptr) {
+			self->beginAudioSchedule(data);
 			if (animReturn != -1) {
 				host->playAnimation(animID, animReturn);
 			}
 			else {
 				host->playAnimation(animID);
 			}
+			self->endAudioSchedule();
 		}
 	}, this);
 
-	this->m_onUpdateID = Subscribe("DESTROY", [](std::map<std::string, void*> data) -> void
+	Subscribe("DESTROY", [](std::map<std::string, void*> data) -> void
 	{
 		std::cout << "DESTROY CALLED" << std::endl;
 		int id = std::stoi(*(std::string*)data["ID"]);
@@ -101,49 +110,70 @@ Receiver::Receiver(GameObject* gameObject, int netID) : Component(gameObject)
 		}
 	}, this);
 
-	this->m_onUpdateID = Subscribe("UPDATE", [](std::map<std::string, void*> data) -> void
+	Subscribe("UPDATE", [](std::map<std::string, void*> data) -> void
 	{
 		float netID = std::stoi(*(std::string*)data["netID"]);
 		if (NetworkingManager::getInstance()->isSelf(netID))
 			return;
-		float x = std::stof(*(std::string*)data["x"]);
-		float y = std::stof(*(std::string*)data["y"]);
-		float z = std::stof(*(std::string*)data["z"]);
-		float vecX = std::stof(*(std::string*)data["vecX"]);
-		float vecY = std::stof(*(std::string*)data["vecY"]);
-		float angle = std::stof(*(std::string*)data["rotation"]);
-		float scale = std::stof(*(std::string*)data["scale"]);
 		Receiver* self = (Receiver*)data["this"];
-		Transform* transform = self->gameObject->getTransform();
-		transform->setPosition(x, y, z);
-		transform->setRotation(angle);
-		transform->setScale(scale);
-		Vector2 movement = Vector2(vecX, vecY);
+		self->applyUpdate(data);
+	}, this);
 
-		std::shared_ptr<CharacterController> cc = self->gameObject->getComponent<CharacterController>();
-		if (cc != nullptr)
+	//Prediction mode, host side: a client's input command, simulated here and acknowledged through STATE
+	Subscribe("INPUT", [](std::map<std::string, void*> data) -> void
+	{
+		if (!NetworkingManager::getInstance()->isHost())
+			return;
+		Receiver* self = (Receiver*)data["this"];
+		int sequence = std::stoi(*(std::string*)data["seq"]);
+		//UDP can reorder, anything older than what we already simulated is stale
+		if (sequence <= self->m_lastInputSequence)
+			return;
+		Transform* transform = self->getGameObject()->getTransform();
+		if (self->m_lastInputSequence < 0)
 		{
-			HostPilot* hostPilot = dynamic_cast<HostPilot*>(cc->getPilot());
-			if (hostPilot != nullptr)
-			{
-				hostPilot->setMovement(movement, 6);
-			}
+			self->m_inputX = transform->getX();
+			self->m_inputY = transform->getY();
 		}
-		else {
-			auto ghostController = self->gameObject->getComponent<GhostController>();
-			if (ghostController != nullptr)
-			{
-				GhostReceiverPilot* ghostPilot = dynamic_cast<GhostReceiverPilot*>(ghostController->getPilot());
-				if (ghostPilot != nullptr)
-				{
-					ghostPilot->setMovement(movement, 6);
-				}
-			}
-			//We are a ghost not a character. We may or may not need to do movement equivalency
+		//The packet repeats earlier inputs newest first, step the ones we missed in order. Anything
+		//older than that is gone for good and the client is corrected by STATE
+		int count = std::stoi(*(std::string*)data["count"]);
+		int missed = self->m_lastInputSequence < 0 ? 1 : sequence - self->m_lastInputSequence;
+		for (int i = (missed < count ? missed : count) - 1; i >= 0; --i)
+		{
+			std::string index = std::to_string(i);
+			float moveX = std::stof(*(std::string*)data["mx" + index]);
+			float moveY = std::stof(*(std::string*)data["my" + index]);
+			Sender::stepInput(self->m_inputX, self->m_inputY, moveX, moveY, std::stoi(*(std::string*)data["ms" + index]));
+			self->m_lastMovement = Vector2(moveX, moveY);
+		}
+		self->m_lastInputSequence = sequence;
+		//Set like an UPDATE, the pilot's movement in between only animates until the next input resets it
+		transform->setPosition(self->m_inputX, self->m_inputY, transform->getZ());
+		self->applyMovement(self->m_lastMovement);
+	}, this);
+
+	//Prediction mode, client side: the host's authoritative state for an entity
+	Subscribe("STATE", [](std::map<std::string, void*> data) -> void
+	{
+		float netID = std::stoi(*(std::string*)data["netID"]);
+		Receiver* self = (Receiver*)data["this"];
+		if (!NetworkingManager::getInstance()->isSelf(netID))
+		{
+			self->applyUpdate(data);
+			return;
+		}
+		std::shared_ptr<Sender> sender = self->getGameObject()->getComponent<Sender>();
+		if (sender != nullptr)
+		{
+			float x = std::stof(*(std::string*)data["x"]);
+			float y = std::stof(*(std::string*)data["y"]);
+			int ack = std::stoi(*(std::string*)data["ack"]);
+			sender->reconcile(x, y, ack);
 		}
 	}, this);
 
-	this->m_onUpdateID = Subscribe("ENDGAME", [](std::map<std::string, void*> data) -> void
+	Subscribe("ENDGAME", [](std::map<std::string, void*> data) -> void
 	{
 		float netID = std::stoi(*(std::string*)data["ID"]);
 		if (NetworkingManager::getInstance()->isSelf(netID))
@@ -156,12 +186,123 @@ Receiver::Receiver(GameObject* gameObject, int netID) : Component(gameObject)
 	}, this);
 }
 
+void Receiver::applyUpdate(std::map<std::string, void*> data)
+{
+	if (data.find("tick") != data.end() && !NetworkingManager::getInstance()->isHost())
+		TransformHistory::getInstance()->receiveTick((Uint32)std::stoul(*(std::string*)data["tick"]));
+	float x = std::stof(*(std::string*)data["x"]);
+	float y = std::stof(*(std::string*)data["y"]);
+	float z = std::stof(*(std::string*)data["z"]);
+	float vecX = std::stof(*(std::string*)data["vecX"]);
+	float vecY = std::stof(*(std::string*)data["vecY"]);
+	float angle = std::stof(*(std::string*)data["rotation"]);
+	float scale = std::stof(*(std::string*)data["scale"]);
+	Transform* transform = gameObject->getTransform();
+	transform->setPosition(x, y, z);
+	transform->setRotation(angle);
+	transform->setScale(scale);
+	applyMovement(Vector2(vecX, vecY));
+}
+
+void Receiver::applyMovement(Vector2 movement)
+{
+	std::shared_ptr<CharacterController> cc = gameObject->getComponent<CharacterController>();
+	if (cc != nullptr)
+	{
+		HostPilot* hostPilot = dynamic_cast<HostPilot*>(cc->getPilot());
+		if (hostPilot != nullptr)
+		{
+			hostPilot->setMovement(movement, 6);
+		}
+	}
+	else {
+		auto ghostController = gameObject->getComponent<GhostController>();
+		if (ghostController != nullptr)
+		{
+			GhostReceiverPilot* ghostPilot = dynamic_cast<GhostReceiverPilot*>(ghostController->getPilot());
+			if (ghostPilot != nullptr)
+			{
+				ghostPilot->setMovement(movement, 6);
+			}
+		}
+		//We are a ghost not a character. We may or may not need to do movement equivalency
+	}
+}
+
+//Sounds the handler triggers play at the sender's time plus the playout delay, or partway in if that has passed
+void Receiver::beginAudioSchedule(std::map<std::string, void*> data)
+{
+	if (data.find("time") == data.end())
+		return;
+	int sender = std::stoi(*(std::string*)data["netID"]);
+	Uint32 remoteTime = (Uint32)std::stoul(*(std::string*)data["time"]);
+	Sint32 wait = (Sint32)(NetworkingManager::getInstance()->getPlayoutTime(sender, remoteTime) - SDL_GetTicks());
+	AudioManager* audio = AudioManager::getInstance();
+	audio->beginSchedule(audio->getTime() + wait);
+}
+
+void Receiver::endAudioSchedule()
+{
+	AudioManager::getInstance()->endSchedule();
+}
+
+//Host only: records the entity for lag compensation, and broadcasts the authoritative state of a
+//predicted client entity, acknowledging its last input
+void Receiver::onUpdate(int ticks)
+{
+	if (!NetworkingManager::getInstance()->isHost() || !NetworkingManager::getInstance()->inGame() || LockstepManager::getInstance()->isRunning())
+		return;
+	Transform* transform = gameObject->getTransform();
+	TransformHistory::getInstance()->record(netID, transform->getX(), transform->getY(), transform->getRotation());
+	if (m_lastInputSequence < 0)
+		return;
+	m_lastStateUpdate += ticks;
+	if (m_lastStateUpdate < PREDICTION_STATE_INTERVAL)
+		return;
+	m_lastStateUpdate = 0;
+
+	//Where the acknowledged input left the entity, the client replays its later inputs from there
+	std::map<std::string, std::string> payload;
+	payload["x"] = std::to_string(m_inputX);
+	payload["y"] = std::to_string(m_inputY);
+	payload["z"] = std::to_string(transform->getZ());
+	payload["rotation"] = std::to_string(transform->getRotation());
+	payload["scale"] = std::to_string(transform->getScale());
+	payload["vecX"] = std::to_string(m_lastMovement.getX());
+	payload["vecY"] = std::to_string(m_lastMovement.getY());
+	payload["ack"] = std::to_string(m_lastInputSequence);
+	payload["tick"] = std::to_string(TransformHistory::getTick());
+	NetworkingManager::getInstance()->prepareMessageForSendingUDP(netID, "STATE", payload);
+}
+
 Receiver::~Receiver()
 {
-	MessageManager::unSubscribe(std::to_string(netID) + "|UPDATE", this->m_onUpdateID);
+	MessageManager::unSubscribeRoute(netID, this->m_routeID);
+	TransformHistory::getInstance()->remove(netID);
+	m_handlers.clear();
 }
 
-int Receiver::Subscribe(std::string event, Callback callback, void* owner)
+void Receiver::Subscribe(std::string event, Callback callback, void* owner)
 {
-	return MessageManager::subscribe(std::to_string(netID) + "|" + event, callback, owner);
+	CallbackReceiver handler;
+	handler.callback = callback;
+	handler.owner = owner;
+	m_handlers[event] = handler;
+}
+
+bool Receiver::route(std::map<std::string, void*> data)
+{
+	Receiver* self = (Receiver*)data["this"];
+	std::string* key = (std::string*)data["key"];
+	if (self == nullptr || key == nullptr)
+		return false;
+	TRACE_ZONE_DYNAMIC("receiver", *key);
+
+	std::map<std::string, CallbackReceiver>::iterator it = self->m_handlers.find(*key);
+	if (it == self->m_handlers.end())
+		return false;
+
+	data["this"] = it->second.owner;
+	it->second.callback(data);
+	return true;
 }
@@ -8,20 +8,35 @@
 #include "MessageManager.h"
 #include "Transform.h"
 #include <iostream>
+#include "Vector2.h"
+
+//How often the host sends STATE for an entity driven by client input commands
+#define PREDICTION_STATE_INTERVAL 80
 
 class Receiver : public Component
 {
 private:
-	int m_onUpdateID, m_destroySnowballID, m_destroyBattlerID;
-	std::vector<int> m_messengingIDs;
+	int m_routeID;
+	std::map<std::string, CallbackReceiver> m_handlers;
+	static bool route(std::map<std::string, void*> data);
+	int m_lastInputSequence = -1;
+	int m_lastStateUpdate = 0;
+	//Host side position after stepping the last input command, what STATE acknowledges
+	float m_inputX = 0;
+	float m_inputY = 0;
+	Vector2 m_lastMovement;
+	void applyUpdate(std::map<std::string, void*> data);
+	void applyMovement(Vector2 movement);
+	void beginAudioSchedule(std::map<std::string, void*> data);
+	void endAudioSchedule();
 
 public:
-	int Subscribe(std::string event, Callback callback, void* owner);
+	void Subscribe(std::string event, Callback callback, void* owner);
 	Receiver(GameObject* gameObject, int netID);
 	~Receiver(); //Could be death message later
 	//void ReceiveUpdate(TransformState* equivalentTransform);
 	void onStart() {};
-	void onUpdate(int ticks) {};
+	void onUpdate(int ticks);
 	void onEnd() {};
 	int netID;
 };
\ No newline at end of file
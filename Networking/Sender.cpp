@@ -1,9 +1,12 @@
 #include "Sender.h"
 #include "NetworkingManager.h"
+#include "TransformHistory.h"
+#include "LockstepManager.h"
 #include "CharacterController.h"
 #include "GhostController.h"
 #include "GhostPilot.h"
 #include "BasePossessableController.h"
+#include <cmath>
 
 Sender::Sender(GameObject* gameObject, int ID) : Component(gameObject)
 {
@@ -83,11 +86,108 @@ void Sender::sendUpdate()
 
 	payload["vecX"] = std::to_string (lastMovementVector.getX());
 	payload["vecY"] = std::to_string (lastMovementVector.getY());
+	//Lets clients report which host tick they were seeing when they attack
+	if (NetworkingManager::getInstance ()->isHost ())
+		payload["tick"] = std::to_string (TransformHistory::getTick ());
 
 	//Send Update Message
 	sendNetworkMessage("UPDATE", payload, false);
 }
 
+//The movement the local pilot is currently applying, what the host needs to simulate us
+Vector2 Sender::getMovement()
+{
+	std::shared_ptr<CharacterController> cc = gameObject->getComponent<CharacterController>();
+	if (cc != nullptr)
+	{
+		PlayerPilot* pp = (PlayerPilot*)cc->getPilot();
+		return Vector2(pp->m_lastMoveVector.getX(), pp->m_lastMoveVector.getY());
+	}
+	std::shared_ptr<GhostController> gc = gameObject->getComponent<GhostController>();
+	if (gc != nullptr)
+	{
+		auto gp = (GhostPilot*)gc->getPilot();
+		if (gp != nullptr)
+			return Vector2(gp->getLastMovement().getX(), gp->getLastMovement().getY());
+	}
+	return Vector2();
+}
+
+//Prediction mode replacement for sendUpdate: the movement we held over the last duration milliseconds.
+//The host steps it and answers with STATE acknowledging the sequence
+void Sender::sendInput(int duration)
+{
+	if (!NetworkingManager::getInstance()->inGame())
+		return;
+	Transform* transform = gameObject->getTransform();
+	Vector2 movement = getMovement();
+	InputCommand command;
+	command.sequence = ++m_inputSequence;
+	command.moveX = movement.getX();
+	command.moveY = movement.getY();
+	command.duration = duration;
+	m_pendingInputs.push_back(command);
+	if (m_pendingInputs.size() > MAX_PENDING_INPUTS)
+		m_pendingInputs.pop_front();
+	m_inputOriginX = transform->getX();
+	m_inputOriginY = transform->getY();
+
+	//Newest first, mx0 is this input. The host skips the ones it already stepped
+	std::map<std::string, std::string> payload;
+	payload["seq"] = std::to_string(command.sequence);
+	int count = 0;
+	for (std::deque<InputCommand>::reverse_iterator it = m_pendingInputs.rbegin(); it != m_pendingInputs.rend() && count <= PREDICTION_REDUNDANT_INPUTS; ++it, ++count)
+	{
+		std::string index = std::to_string(count);
+		payload["mx" + index] = std::to_string(it->moveX);
+		payload["my" + index] = std::to_string(it->moveY);
+		payload["ms" + index] = std::to_string(it->duration);
+	}
+	payload["count"] = std::to_string(count);
+	sendNetworkMessage("INPUT", payload, false);
+}
+
+void Sender::stepInput(float &x, float &y, float moveX, float moveY, int duration)
+{
+	float length = std::sqrt(moveX * moveX + moveY * moveY);
+	if (length > 1.0f)
+	{
+		moveX /= length;
+		moveY /= length;
+	}
+	if (duration > PREDICTION_MAX_INPUT_MS)
+		duration = PREDICTION_MAX_INPUT_MS;
+	if (duration < 0)
+		duration = 0;
+	x += moveX * PREDICTION_MOVE_SPEED * duration / 1000.0f;
+	y += moveY * PREDICTION_MOVE_SPEED * duration / 1000.0f;
+}
+
+//Rebuilds our position from the host's state, every input it hasn't stepped yet and what the pilot
+//moved us since the last input went out
+void Sender::reconcile(float x, float y, int ack)
+{
+	while (!m_pendingInputs.empty() && m_pendingInputs.front().sequence <= ack)
+		m_pendingInputs.pop_front();
+
+	Transform* transform = gameObject->getTransform();
+	float predictedX = x;
+	float predictedY = y;
+	for (size_t i = 0; i < m_pendingInputs.size(); i++)
+		stepInput(predictedX, predictedY, m_pendingInputs[i].moveX, m_pendingInputs[i].moveY, m_pendingInputs[i].duration);
+	predictedX += transform->getX() - m_inputOriginX;
+	predictedY += transform->getY() - m_inputOriginY;
+
+	float correctionX = predictedX - transform->getX();
+	float correctionY = predictedY - transform->getY();
+	if (std::abs(correctionX) < PREDICTION_EPSILON && std::abs(correctionY) < PREDICTION_EPSILON)
+		return;
+	transform->setPosition(predictedX, predictedY, transform->getZ());
+	//Keep the movement since the last input relative to where we actually are now
+	m_inputOriginX += correctionX;
+	m_inputOriginY += correctionY;
+}
+
 void Sender::spawnPlayers(float p1x, float p1y, float p2x, float p2y)
 {
 	//Host tells reciever 
@@ -103,6 +203,8 @@ void Sender::spawnPlayers(float p1x, float p1y, float p2x, float p2y)
 void Sender::sendAttack ()
 {
 	std::map<std::string, std::string> payload;
+	//The host checks the hit against the world as it was at this tick
+	payload["tick"] = std::to_string (TransformHistory::getInstance ()->getViewTick ());
 	sendNetworkMessage ("ATTACK", payload);
 }
 
@@ -111,6 +213,8 @@ void Sender::sendAnimation (int animID, int animReturn)
 	std::map<std::string, std::string> payload;
 	payload["animID"] = std::to_string (animID);
 	payload["animReturn"] = std::to_string (animReturn);
+	//Receivers play the animation's sounds relative to this, not to when the packet arrives
+	payload["time"] = std::to_string (SDL_GetTicks ());
 	sendNetworkMessage ("ANIMATE", payload);
 }
 
@@ -118,6 +222,7 @@ void Sender::sendHurt (int newHP)
 {
 	std::map<std::string, std::string> payload;
 	payload["newHealth"] = std::to_string (newHP);
+	payload["time"] = std::to_string (SDL_GetTicks ());
 	sendNetworkMessage ("HURT", payload);
 }
 
@@ -179,13 +284,24 @@ void Sender::sendNetworkMessage(std::string messageKey, std::map<std::string, st
 Sender::~Sender()
 {
 	std::map<std::string, std::string> payload;
+	TransformHistory::getInstance ()->remove (m_id);
 }
 
 void Sender::onUpdate (int ticks)
 {
+	//Lockstep peers simulate every entity themselves, nothing to replicate
+	if (LockstepManager::getInstance ()->isRunning ())
+		return;
+	if (NetworkingManager::getInstance ()->isHost () && NetworkingManager::getInstance ()->inGame ()) {
+		Transform* transform = gameObject->getTransform ();
+		TransformHistory::getInstance ()->record (m_id, transform->getX (), transform->getY (), transform->getRotation ());
+	}
 	m_lastUpdate += ticks;
 	if (m_lastUpdate >= 80) {
-		sendUpdate ();
+		if (NetworkingManager::getInstance ()->usePrediction () && !NetworkingManager::getInstance ()->isHost ())
+			sendInput (m_lastUpdate);
+		else
+			sendUpdate ();
 		m_lastUpdate = 0;
 	}
 }
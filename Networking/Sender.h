@@ -5,20 +5,52 @@
 #include "Transform.h"
 #include <iostream>
 #include "Vector2.h"
+#include <deque>
+
+#define MAX_PENDING_INPUTS 64
+//Corrections smaller than this are left alone so reconciliation doesn't jitter the player
+#define PREDICTION_EPSILON 0.01f
+//Units per second at full input, has to match the speed the pilots move characters at
+#define PREDICTION_MOVE_SPEED 6.0f
+//Every INPUT also repeats this many earlier unacknowledged inputs, so a lost packet doesn't lose movement
+#define PREDICTION_REDUNDANT_INPUTS 4
+//The host steps an input for at most this long, whatever the client claims
+#define PREDICTION_MAX_INPUT_MS 250
 
 //Senders transform message and extra commands
 
+//An input command sent to the host in prediction mode, kept until the host acknowledges it
+struct InputCommand
+{
+	int sequence;
+	float moveX; //movement vector held for duration milliseconds
+	float moveY;
+	int duration;
+};
+
 class Sender : public Component
 {
 private:
 	int m_id;
 	int m_lastUpdate = 0;
+	int m_inputSequence = 0;
+	std::deque<InputCommand> m_pendingInputs;
+	float m_inputOriginX = 0;
+	float m_inputOriginY = 0;
+	Vector2 getMovement();
 
 public:
 	Sender(GameObject* gameObject, int ID);
 	void sendCreate();
 	void sendDestroy();
 	void sendUpdate();
+	void sendInput(int duration);
+	void reconcile(float x, float y, int ack);
+	/*
+	Moves x, y by one input the way the host simulates it, the client replays unacknowledged inputs
+	with the same step. The movement is clamped to unit length and the duration to PREDICTION_MAX_INPUT_MS.
+	*/
+	static void stepInput(float &x, float &y, float moveX, float moveY, int duration);
 	void sendAttack();
 	void sendAnimation (int animID, int animReturn = -1);
 	void sendSwappedItem ();
@@ -0,0 +1,274 @@
+#include "SessionHost.h"
+#include "NetworkingManager.h"
+#include "MessageManager.h"
+#include "TransformHistory.h"
+#include "LockstepManager.h"
+#include "Tracer.h"
+#include <cstring>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+Session::Session(int id, int port, SessionUpdateCallback update, void* userData)
+{
+	m_id = id;
+	m_port = port;
+	m_network = new NetworkingManager();
+	m_messages = new MessageManager();
+	m_history = new TransformHistory();
+	m_lockstep = new LockstepManager();
+	m_update = update;
+	m_userData = userData;
+	m_started = false;
+	m_rehostStart = 0;
+	m_finished = false;
+}
+
+Session::~Session()
+{
+	bind();
+	m_lockstep->stop();
+	if (m_started)
+	{
+		std::vector<int> clients = m_network->getClientIDs();
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			if (!m_network->isSelf(clients[i]))
+				m_network->closeClientAsHost(clients[i]);
+		}
+		m_network->closeClient();
+		m_network->closeUDP();
+	}
+	unbind();
+	//Detached socket threads still point at the NetworkingManager, so like hardReset we leave it allocated
+	delete m_lockstep;
+	delete m_history;
+	delete m_messages;
+}
+
+void Session::bind()
+{
+	NetworkingManager::setThreadInstance(m_network);
+	MessageManager::setThreadInstance(m_messages);
+	TransformHistory::setThreadInstance(m_history);
+	LockstepManager::setThreadInstance(m_lockstep);
+}
+
+void Session::unbind()
+{
+	NetworkingManager::setThreadInstance(nullptr);
+	MessageManager::setThreadInstance(nullptr);
+	TransformHistory::setThreadInstance(nullptr);
+	LockstepManager::setThreadInstance(nullptr);
+}
+
+bool Session::update(int ticks)
+{
+	if (m_finished)
+		return false;
+	bind();
+	if (!m_started)
+	{
+		m_network->setIP((char*)DEFAULT_IP, m_port);
+		m_started = m_network->createHost();
+		//After a reset the previous match's listening socket may not have let go of the port yet
+		if (!m_started && (m_rehostStart == 0 || SDL_GetTicks() - m_rehostStart >= SESSION_REHOST_MS))
+		{
+			std::cout << "ERROR Session " << m_id << " can't host on port " << m_port << std::endl;
+			m_finished = true;
+		}
+	}
+	if (m_started && !m_finished)
+	{
+		std::string packet;
+		while (m_network->getMessage(packet))
+			m_network->handleParsingEvents(packet);
+		m_update(this, ticks);
+		//hardReset swaps the bound instance for a new one, which hosts the next match from the next tick
+		NetworkingManager* network = NetworkingManager::getInstance();
+		if (network != m_network)
+		{
+			m_network = network;
+			m_started = false;
+			m_rehostStart = SDL_GetTicks();
+		}
+		else
+			m_network->sendQueuedEvents();
+	}
+	unbind();
+	return !m_finished;
+}
+
+void Session::finish()
+{
+	m_finished = true;
+}
+
+bool Session::isFinished()
+{
+	return m_finished;
+}
+
+int Session::getID()
+{
+	return m_id;
+}
+
+int Session::getPort()
+{
+	return m_port;
+}
+
+void* Session::getUserData()
+{
+	return m_userData;
+}
+
+NetworkingManager* Session::getNetwork()
+{
+	return m_network;
+}
+
+SessionHost::SessionHost()
+{
+	m_running = false;
+	m_nextSessionID = 0;
+}
+
+SessionHost::~SessionHost()
+{
+	stop();
+}
+
+bool SessionHost::start(int workers, bool pin)
+{
+	if (m_running)
+		return false;
+	int cores = (int)std::thread::hardware_concurrency();
+	if (cores <= 0)
+		cores = 1;
+	if (workers <= 0)
+		workers = cores;
+	m_running = true;
+	for (int i = 0; i < workers; ++i)
+	{
+		SessionWorker* worker = new SessionWorker();
+		worker->index = i;
+		worker->core = pin ? i % cores : -1;
+		worker->sessions = 0;
+		worker->thread = std::thread(&SessionHost::workerThread, this, worker);
+		m_workers.push_back(worker);
+	}
+	std::cout << "Session host running " << workers << " workers" << std::endl;
+	return true;
+}
+
+void SessionHost::stop()
+{
+	if (!m_running)
+		return;
+	m_running = false;
+	for (size_t i = 0; i < m_workers.size(); ++i)
+	{
+		m_workers[i]->thread.join();
+		delete m_workers[i];
+	}
+	m_workers.clear();
+}
+
+int SessionHost::addSession(int port, SessionUpdateCallback update, void* userData)
+{
+	if (!m_running || m_workers.empty() || update == nullptr)
+		return -1;
+	SessionWorker* target = m_workers[0];
+	for (size_t i = 1; i < m_workers.size(); ++i)
+	{
+		if (m_workers[i]->sessions < target->sessions)
+			target = m_workers[i];
+	}
+	int id = m_nextSessionID++;
+	Session* session = new Session(id, port, update, userData);
+	target->sessions++;
+	std::lock_guard<std::mutex> lock(target->mutex);
+	target->added.push_back(session);
+	return id;
+}
+
+int SessionHost::getSessionCount()
+{
+	int count = 0;
+	for (size_t i = 0; i < m_workers.size(); ++i)
+		count += m_workers[i]->sessions;
+	return count;
+}
+
+int SessionHost::getWorkerCount()
+{
+	return m_workers.size();
+}
+
+void SessionHost::workerThread(SessionWorker* worker)
+{
+	TRACE_THREAD("Session worker");
+	if (worker->core >= 0)
+		pinThread(worker->core);
+
+	std::vector<Session*> sessions;
+	Uint32 last = SDL_GetTicks();
+	while (m_running)
+	{
+		Uint32 now = SDL_GetTicks();
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			sessions.insert(sessions.end(), worker->added.begin(), worker->added.end());
+			worker->added.clear();
+		}
+		int ticks = now - last;
+		last = now;
+
+		for (size_t i = 0; i < sessions.size();)
+		{
+			TRACE_ZONE("session", "Session update");
+			if (sessions[i]->update(ticks))
+			{
+				++i;
+				continue;
+			}
+			std::cout << "Session " << sessions[i]->getID() << " finished" << std::endl;
+			delete sessions[i];
+			sessions.erase(sessions.begin() + i);
+			worker->sessions--;
+		}
+
+		//An overloaded worker just runs its sessions late rather than skipping ticks
+		Uint32 spent = SDL_GetTicks() - now;
+		if (spent < SESSION_TICK_MS)
+			SDL_Delay(SESSION_TICK_MS - spent);
+	}
+
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	sessions.insert(sessions.end(), worker->added.begin(), worker->added.end());
+	worker->added.clear();
+	for (size_t i = 0; i < sessions.size(); ++i)
+		delete sessions[i];
+	worker->sessions = 0;
+}
+
+bool SessionHost::pinThread(int core)
+{
+#ifdef __linux__
+	cpu_set_t cores;
+	CPU_ZERO(&cores);
+	CPU_SET(core, &cores);
+	int result = pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+	if (result != 0)
+	{
+		std::cout << "ERROR Can't pin thread to core " << core << ": " << strerror(result) << std::endl;
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include "GLHeaders.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//How often a worker runs each of its sessions
+#define SESSION_TICK_MS 16
+//How long a session retries its port after an ENDGAME reset, the old listening socket closes within a receive timeout
+#define SESSION_REHOST_MS 2000
+
+class NetworkingManager;
+class MessageManager;
+class TransformHistory;
+class LockstepManager;
+class Session;
+
+//The match logic, run once per tick with the session's managers bound. Call finish to end the session
+typedef void(*SessionUpdateCallback)(Session* session, int ticks);
+
+/*
+	Session
+
+	One hosted lobby or match with its own NetworkingManager, MessageManager, TransformHistory and
+	LockstepManager. While bound, getInstance on those returns this session's instance on the calling
+	thread, so the rest of the networking code doesn't need to know which match it is running for.
+	A session is only ever updated by the one worker that owns it.
+*/
+class Session
+{
+private:
+	int m_id;
+	int m_port;
+	NetworkingManager* m_network;
+	MessageManager* m_messages;
+	TransformHistory* m_history;
+	LockstepManager* m_lockstep;
+	SessionUpdateCallback m_update;
+	void* m_userData;
+	bool m_started;
+	Uint32 m_rehostStart; //0 until a reset ends the first match
+	std::atomic<bool> m_finished;
+
+public:
+	Session(int id, int port, SessionUpdateCallback update, void* userData);
+	~Session();
+
+	/*
+	Points the manager singletons at this session on the calling thread, unbind points them back at the
+	process wide instances.
+	*/
+	void bind();
+	static void unbind();
+
+	/*
+	Starts hosting on the first call, then dispatches received messages, runs the callback and flushes
+	what it queued. When the callback ends a match with hardReset, the session hosts the next one on the
+	same port. Returns false once the session has finished.
+	*/
+	bool update(int ticks);
+	void finish();
+	bool isFinished();
+
+	int getID();
+	int getPort();
+	void* getUserData();
+	NetworkingManager* getNetwork();
+};
+
+struct SessionWorker
+{
+	int index;
+	int core; //-1 when not pinned
+	std::thread thread;
+	std::mutex mutex;
+	std::vector<Session*> added; //handed over by addSession, picked up on the worker's next tick
+	std::atomic<int> sessions;
+};
+
+/*
+	Session Host
+
+	Runs many independent sessions in one process. Each worker thread is pinned to its own core and owns
+	the sessions it was given, so a session's managers are only touched by one thread and workers never
+	share state. New sessions go to the worker with the fewest.
+*/
+class SessionHost
+{
+private:
+	std::vector<SessionWorker*> m_workers;
+	std::atomic<bool> m_running;
+	std::atomic<int> m_nextSessionID;
+	void workerThread(SessionWorker* worker);
+
+public:
+	SessionHost();
+	~SessionHost();
+
+	/*
+	Starts the workers, one per core when workers is 0. With pin each worker is kept on core
+	index % cores (Linux only).
+	*/
+	bool start(int workers = 0, bool pin = true);
+	/*
+	Stops the workers once their current tick is done and ends every session.
+	*/
+	void stop();
+
+	/*
+	Hosts a new session on port. userData is handed back through Session::getUserData.
+	Returns the session id, or -1 if the host isn't running.
+	*/
+	int addSession(int port, SessionUpdateCallback update, void* userData = nullptr);
+	int getSessionCount();
+	int getWorkerCount();
+
+	/*
+	Keeps the calling thread on one core, returns false where that isn't supported.
+	*/
+	static bool pinThread(int core);
+};
@@ -0,0 +1,223 @@
+#include "SharedMemoryTransport.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <thread>
+#include <random>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//Length value that tells the reader the rest of the ring is unused and the record starts at offset 0
+#define SHM_WRAP 0xFFFFFFFF
+
+static Uint32 recordSize(Uint32 length)
+{
+	return sizeof(Uint32) + ((length + 3) & ~3u);
+}
+
+SharedMemoryTransport::SharedMemoryTransport(SharedSegment* segment, const std::string &name, bool creator)
+{
+	m_segment = segment;
+	m_name = name;
+	m_creator = creator;
+	m_out = &segment->rings[creator ? 0 : 1];
+	m_in = &segment->rings[creator ? 1 : 0];
+	m_datagramsOut = &segment->datagrams[creator ? 0 : 1];
+	m_datagramsIn = &segment->datagrams[creator ? 1 : 0];
+}
+
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+	close();
+#ifndef _WIN32
+	if (m_creator)
+		unlink();
+	munmap(m_segment, sizeof(SharedSegment));
+#endif
+}
+
+std::string SharedMemoryTransport::uniqueName(int port)
+{
+	std::random_device random;
+#ifndef _WIN32
+	int process = (int)getpid();
+#else
+	int process = 0;
+#endif
+	return "pyramidpanic-" + std::to_string(port) + "-" + std::to_string(process) + "-" + std::to_string(random() % 1000000);
+}
+
+std::shared_ptr<SharedMemoryTransport> SharedMemoryTransport::create(const std::string &name)
+{
+#ifndef _WIN32
+	std::string path = "/" + name;
+	int file = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (file == -1)
+	{
+		std::cout << "ERROR shm_open " << path << ": " << strerror(errno) << std::endl;
+		return nullptr;
+	}
+	if (ftruncate(file, sizeof(SharedSegment)) == -1)
+	{
+		std::cout << "ERROR ftruncate " << path << ": " << strerror(errno) << std::endl;
+		::close(file);
+		shm_unlink(path.c_str());
+		return nullptr;
+	}
+	void* memory = mmap(NULL, sizeof(SharedSegment), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	::close(file);
+	if (memory == MAP_FAILED)
+	{
+		shm_unlink(path.c_str());
+		return nullptr;
+	}
+	//Fresh pages are zeroed, the atomics still need constructing before the other side sees the magic
+	SharedSegment* segment = (SharedSegment*)memory;
+	for (int i = 0; i < 2; ++i)
+	{
+		new (&segment->rings[i].head) std::atomic<Uint32>(0);
+		new (&segment->rings[i].tail) std::atomic<Uint32>(0);
+		new (&segment->datagrams[i].head) std::atomic<Uint32>(0);
+		new (&segment->datagrams[i].tail) std::atomic<Uint32>(0);
+	}
+	new (&segment->closed) std::atomic<Uint32>(0);
+	std::atomic_thread_fence(std::memory_order_release);
+	segment->magic = SHM_MAGIC;
+	return std::shared_ptr<SharedMemoryTransport>(new SharedMemoryTransport(segment, name, true));
+#else
+	return nullptr;
+#endif
+}
+
+std::shared_ptr<SharedMemoryTransport> SharedMemoryTransport::open(const std::string &name)
+{
+#ifndef _WIN32
+	std::string path = "/" + name;
+	int file = shm_open(path.c_str(), O_RDWR, 0600);
+	if (file == -1)
+		return nullptr;
+	struct stat info;
+	if (fstat(file, &info) == -1 || (size_t)info.st_size < sizeof(SharedSegment))
+	{
+		::close(file);
+		return nullptr;
+	}
+	void* memory = mmap(NULL, sizeof(SharedSegment), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	::close(file);
+	if (memory == MAP_FAILED)
+		return nullptr;
+	SharedSegment* segment = (SharedSegment*)memory;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (segment->magic != SHM_MAGIC)
+	{
+		munmap(memory, sizeof(SharedSegment));
+		return nullptr;
+	}
+	return std::shared_ptr<SharedMemoryTransport>(new SharedMemoryTransport(segment, name, false));
+#else
+	return nullptr;
+#endif
+}
+
+void SharedMemoryTransport::unlink()
+{
+#ifndef _WIN32
+	shm_unlink(("/" + m_name).c_str());
+#endif
+}
+
+const std::string &SharedMemoryTransport::getName()
+{
+	return m_name;
+}
+
+bool SharedMemoryTransport::send(const std::string &packet)
+{
+	std::lock_guard<std::mutex> lock(m_sendMutex);
+	return write(m_out, packet);
+}
+
+bool SharedMemoryTransport::sendDatagram(const std::string &packet)
+{
+	std::lock_guard<std::mutex> lock(m_datagramMutex);
+	return write(m_datagramsOut, packet);
+}
+
+//Needs the ring's send mutex
+bool SharedMemoryTransport::write(SharedRing* ring, const std::string &packet)
+{
+	Uint32 size = recordSize(packet.length());
+	if (m_segment->closed.load(std::memory_order_relaxed) || size > SHM_RING_SIZE / 2)
+		return false;
+
+	Uint32 head = ring->head.load(std::memory_order_relaxed);
+	Uint32 tail = ring->tail.load(std::memory_order_acquire);
+	Uint32 offset = head & (SHM_RING_SIZE - 1);
+	Uint32 contiguous = SHM_RING_SIZE - offset;
+	//A record never wraps, if it doesn't fit before the end the rest of the ring is skipped
+	Uint32 needed = size <= contiguous ? size : contiguous + size;
+	if (SHM_RING_SIZE - (head - tail) < needed)
+		return false;
+	if (size > contiguous)
+	{
+		Uint32 wrap = SHM_WRAP;
+		memcpy(ring->data + offset, &wrap, sizeof(wrap));
+		head += contiguous;
+		offset = 0;
+	}
+	Uint32 length = packet.length();
+	memcpy(ring->data + offset, &length, sizeof(length));
+	memcpy(ring->data + offset + sizeof(length), packet.data(), length);
+	ring->head.store(head + size, std::memory_order_release);
+	return true;
+}
+
+//Takes the oldest record off the ring, false if it is empty. Only the receive thread reads
+bool SharedMemoryTransport::read(SharedRing* ring, std::string &packet)
+{
+	Uint32 tail = ring->tail.load(std::memory_order_relaxed);
+	Uint32 head = ring->head.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+	Uint32 offset = tail & (SHM_RING_SIZE - 1);
+	Uint32 length;
+	memcpy(&length, ring->data + offset, sizeof(length));
+	if (length == SHM_WRAP)
+	{
+		tail += SHM_RING_SIZE - offset;
+		offset = 0;
+		memcpy(&length, ring->data, sizeof(length));
+	}
+	packet.assign(ring->data + offset + sizeof(length), length);
+	ring->tail.store(tail + recordSize(length), std::memory_order_release);
+	return true;
+}
+
+bool SharedMemoryTransport::receive(std::string &packet)
+{
+	int idle = 0;
+	while (true)
+	{
+		//Loaded before the rings are checked, so once it is set anything sent before the close has been read
+		bool closed = m_segment->closed.load(std::memory_order_acquire) != 0;
+		if (read(m_in, packet) || read(m_datagramsIn, packet))
+			return true;
+		if (closed)
+			return false;
+		//Spin briefly for bursts, then back off so an idle connection doesn't burn a core
+		if (++idle < SHM_SPIN_COUNT)
+			std::this_thread::yield();
+		else
+			SDL_Delay(1);
+	}
+}
+
+void SharedMemoryTransport::close()
+{
+	m_segment->closed.store(1, std::memory_order_release);
+}
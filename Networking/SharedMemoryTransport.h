@@ -0,0 +1,83 @@
+#pragma once
+#include "GLHeaders.h"
+#include "Transport.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+//Bytes per direction, a power of two
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_MAGIC 0x50505348
+//Receive polls this many times before it starts sleeping a millisecond between polls
+#define SHM_SPIN_COUNT 256
+
+//Single producer, single consumer byte ring. head and tail only ever grow, offsets are taken modulo the size
+struct SharedRing
+{
+	std::atomic<Uint32> head;
+	char headPadding[60]; //head and tail on their own cache lines, each is written by one process
+	std::atomic<Uint32> tail;
+	char tailPadding[60];
+	char data[SHM_RING_SIZE];
+};
+
+struct SharedSegment
+{
+	Uint32 magic;
+	std::atomic<Uint32> closed;
+	//In each pair 0 is written by the side that created the segment, 1 by the side that opened it
+	SharedRing rings[2];
+	//UDP traffic has rings of its own, so filling them up never costs a reliable packet
+	SharedRing datagrams[2];
+};
+
+/*
+	Shared Memory Transport
+
+	Transport for peers on the same machine: rings in a POSIX shared memory segment, so messages pass
+	between the processes without a syscall. Each direction has a ring for reliable packets and one for
+	datagrams, and receive takes reliable packets first. Each record is its length followed by the bytes.
+	The client creates the segment and offers its name over TCP, and the host being able to open it
+	is what proves the two are on the same machine. Not available on Windows, those peers stay on TCP.
+*/
+class SharedMemoryTransport : public Transport
+{
+private:
+	SharedSegment* m_segment;
+	std::string m_name;
+	bool m_creator;
+	SharedRing* m_out;
+	SharedRing* m_in;
+	SharedRing* m_datagramsOut;
+	SharedRing* m_datagramsIn;
+	std::mutex m_sendMutex;
+	std::mutex m_datagramMutex;
+
+	bool write(SharedRing* ring, const std::string &packet);
+	static bool read(SharedRing* ring, std::string &packet);
+
+	SharedMemoryTransport(SharedSegment* segment, const std::string &name, bool creator);
+
+public:
+	~SharedMemoryTransport();
+
+	/*
+	A name no other running game uses, to pass to create.
+	*/
+	static std::string uniqueName(int port);
+	static std::shared_ptr<SharedMemoryTransport> create(const std::string &name);
+	/*
+	Returns nullptr when there is no such segment, which means the peer is on another machine.
+	*/
+	static std::shared_ptr<SharedMemoryTransport> open(const std::string &name);
+	/*
+	Removes the segment's name once both sides have it mapped, so nothing is left behind if we crash.
+	*/
+	void unlink();
+	const std::string &getName();
+
+	bool send(const std::string &packet);
+	bool sendDatagram(const std::string &packet);
+	bool receive(std::string &packet);
+	void close();
+};
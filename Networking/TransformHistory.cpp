@@ -0,0 +1,157 @@
+#include "TransformHistory.h"
+#include "NetworkingManager.h"
+
+TransformHistory* TransformHistory::s_instance;
+thread_local TransformHistory* TransformHistory::t_instance = NULL;
+
+TransformHistory* TransformHistory::getInstance()
+{
+	if (t_instance != NULL)
+		return t_instance;
+	if (s_instance == NULL)
+		s_instance = new TransformHistory();
+	return s_instance;
+}
+
+void TransformHistory::setThreadInstance(TransformHistory* instance)
+{
+	t_instance = instance;
+}
+
+TransformHistory::TransformHistory()
+{
+	m_viewTick = 0;
+	m_viewTickReceived = 0;
+	m_hasViewTick = false;
+}
+
+Uint32 TransformHistory::getTick()
+{
+	return SDL_GetTicks() / HISTORY_TICK_MS;
+}
+
+static float lerp(float from, float to, float t)
+{
+	return from + (to - from) * t;
+}
+
+void TransformHistory::record(int netID, float x, float y, float rotation)
+{
+	Uint32 tick = getTick();
+	std::unordered_map<int, TransformRing>::iterator it = m_entities.find(netID);
+	if (it == m_entities.end())
+	{
+		it = m_entities.insert(std::make_pair(netID, TransformRing())).first;
+		//A new entity has always been here, as far as a rewind can tell
+		for (int i = 0; i < HISTORY_TICKS; ++i)
+		{
+			TransformSample& sample = it->second.samples[i];
+			sample.tick = tick - ((tick - i) & (HISTORY_TICKS - 1));
+			sample.x = x;
+			sample.y = y;
+			sample.rotation = rotation;
+		}
+		it->second.newest = tick;
+		return;
+	}
+
+	TransformRing& ring = it->second;
+	const TransformSample previous = ring.samples[ring.newest & (HISTORY_TICKS - 1)];
+	Uint32 gap = tick - ring.newest;
+	//A long stall refills the whole window, only the last HISTORY_TICKS ticks matter
+	Uint32 first = gap > HISTORY_TICKS ? tick - (HISTORY_TICKS - 1) : ring.newest + 1;
+	for (Uint32 t = first; t != tick + 1; ++t)
+	{
+		float f = gap > 0 ? (float)(t - ring.newest) / gap : 1.0f;
+		TransformSample& sample = ring.samples[t & (HISTORY_TICKS - 1)];
+		sample.tick = t;
+		sample.x = lerp(previous.x, x, f);
+		sample.y = lerp(previous.y, y, f);
+		sample.rotation = lerp(previous.rotation, rotation, f);
+	}
+	if (gap == 0)
+	{
+		//Several frames in one tick, the latest wins
+		TransformSample& sample = ring.samples[tick & (HISTORY_TICKS - 1)];
+		sample.x = x;
+		sample.y = y;
+		sample.rotation = rotation;
+	}
+	ring.newest = tick;
+}
+
+void TransformHistory::remove(int netID)
+{
+	m_entities.erase(netID);
+}
+
+void TransformHistory::clear()
+{
+	m_entities.clear();
+	m_hasViewTick = false;
+}
+
+bool TransformHistory::rewind(int netID, double tick, RewoundTransform& transform)
+{
+	std::unordered_map<int, TransformRing>::iterator it = m_entities.find(netID);
+	if (it == m_entities.end())
+		return false;
+	const TransformRing& ring = it->second;
+
+	//Compared as doubles, the slot arithmetic below is modular and doesn't mind oldest wrapping
+	Uint32 oldest = ring.newest - (HISTORY_TICKS - 1);
+	Uint32 from;
+	float fraction;
+	if (tick >= ring.newest)
+	{
+		from = ring.newest;
+		fraction = 0.0f;
+	}
+	else if (tick <= (double)ring.newest - (HISTORY_TICKS - 1))
+	{
+		from = oldest;
+		fraction = 0.0f;
+	}
+	else
+	{
+		from = (Uint32)tick;
+		fraction = (float)(tick - from);
+	}
+	const TransformSample& a = ring.samples[from & (HISTORY_TICKS - 1)];
+	const TransformSample& b = ring.samples[(from == ring.newest ? from : from + 1) & (HISTORY_TICKS - 1)];
+	transform.netID = netID;
+	transform.x = lerp(a.x, b.x, fraction);
+	transform.y = lerp(a.y, b.y, fraction);
+	transform.rotation = lerp(a.rotation, b.rotation, fraction);
+	return true;
+}
+
+void TransformHistory::rewindWorld(double tick, std::vector<RewoundTransform>& out)
+{
+	out.clear();
+	out.reserve(m_entities.size());
+	RewoundTransform transform;
+	for (std::unordered_map<int, TransformRing>::iterator it = m_entities.begin(); it != m_entities.end(); ++it)
+	{
+		if (rewind(it->first, tick, transform))
+			out.push_back(transform);
+	}
+}
+
+void TransformHistory::receiveTick(Uint32 tick)
+{
+	//UDP can reorder, never step the view back
+	if (m_hasViewTick && (Sint32)(tick - m_viewTick) <= 0)
+		return;
+	m_viewTick = tick;
+	m_viewTickReceived = SDL_GetTicks();
+	m_hasViewTick = true;
+}
+
+double TransformHistory::getViewTick()
+{
+	if (NetworkingManager::getInstance()->isHost() || !m_hasViewTick)
+		return getTick();
+	//Remote entities keep moving on their last velocity between updates, so the view advances with time
+	return m_viewTick + (double)(SDL_GetTicks() - m_viewTickReceived) / HISTORY_TICK_MS;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include "GLHeaders.h"
+#include <unordered_map>
+#include <vector>
+
+//History resolution, ticks are the host's SDL_GetTicks divided by this
+#define HISTORY_TICK_MS 16
+//Must be a power of two, 64 ticks is about a second of rewind
+#define HISTORY_TICKS 64
+
+struct TransformSample
+{
+	Uint32 tick;
+	float x;
+	float y;
+	float rotation;
+};
+
+//Fixed size per entity, the sample for a tick lives in slot tick % HISTORY_TICKS
+struct TransformRing
+{
+	TransformSample samples[HISTORY_TICKS];
+	Uint32 newest;
+};
+
+struct RewoundTransform
+{
+	int netID;
+	float x;
+	float y;
+	float rotation;
+};
+
+/*
+	Host side lag compensation.
+
+	Every tick the host records where each networked entity is. Host messages that carry positions are
+	stamped with the tick in a "tick" field, clients answer with the tick they were looking at when they
+	acted (getViewTick, sent with ATTACK), and the host rewinds to it to check the hit against what the
+	attacker actually saw rather than where everyone is now.
+*/
+class TransformHistory
+{
+private:
+	static TransformHistory* s_instance;
+	static thread_local TransformHistory* t_instance;
+	std::unordered_map<int, TransformRing> m_entities;
+	//Client side, the newest host tick received and when we received it
+	Uint32 m_viewTick;
+	Uint32 m_viewTickReceived;
+	bool m_hasViewTick;
+	TransformHistory();
+	friend class Session;
+
+public:
+	static TransformHistory* getInstance();
+	/*
+	Makes getInstance return instance on the calling thread, nullptr goes back to the process wide one.
+	*/
+	static void setThreadInstance(TransformHistory* instance);
+	static Uint32 getTick();
+
+	/*
+	Host: stores the entity's transform for the current tick. Ticks skipped since the last call are
+	filled in by interpolation, so every tick in the window has a sample.
+	*/
+	void record(int netID, float x, float y, float rotation);
+	void remove(int netID);
+	void clear();
+
+	/*
+	Host: the entity's transform at a past tick, fractions interpolate between ticks. Ticks older than
+	the history are clamped to the oldest sample and future ones to the newest.
+	Returns false if the entity has no history.
+	*/
+	bool rewind(int netID, double tick, RewoundTransform& transform);
+	/*
+	Host: every recorded entity at tick, out is cleared first.
+	*/
+	void rewindWorld(double tick, std::vector<RewoundTransform>& out);
+
+	/*
+	Client: remembers the newest host tick seen in a message's "tick" field.
+	*/
+	void receiveTick(Uint32 tick);
+	/*
+	The tick the local player is looking at: the newest host tick received plus the time since,
+	or the current tick on the host.
+	*/
+	double getViewTick();
+};
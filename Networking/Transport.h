@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+
+/*
+	A message channel to one peer that can stand in for its TCP socket and UDP channel.
+
+	NetworkingManager sends through a connection's transport when it has one, and runs a receive thread
+	that feeds whatever arrives into the same message queue the socket threads use. Packets are delivered
+	whole. Those given to send are reliable and ordered, so the one transport carries both TCP and UDP
+	traffic, with UDP traffic going through sendDatagram where it can't crowd out the reliable packets.
+*/
+class Transport
+{
+public:
+	virtual ~Transport() {}
+
+	/*
+	Never blocks, returns false if the packet can't be queued (full or closed).
+	*/
+	virtual bool send(const std::string &packet) = 0;
+
+	/*
+	Send for packets that may be lost, like UDP. Transports that keep them apart from reliable
+	packets override it.
+	*/
+	virtual bool sendDatagram(const std::string &packet) { return send(packet); }
+
+	/*
+	Blocks until a packet arrives, returns false once either side has closed.
+	*/
+	virtual bool receive(std::string &packet) = 0;
+
+	virtual void close() = 0;
+};
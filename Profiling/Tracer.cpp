@@ -0,0 +1,190 @@
+#include "Tracer.h"
+#include <fstream>
+#include <iostream>
+#include <map>
+
+std::atomic<bool> Tracer::s_enabled(false);
+Uint64 Tracer::s_origin = 0;
+std::mutex Tracer::s_mutex;
+std::vector<TraceBuffer*> Tracer::s_buffers;
+std::set<std::string> Tracer::s_names;
+
+//Gives the buffer back when its thread exits, detached network threads come and go with connections
+struct TraceBufferOwner
+{
+	TraceBuffer* buffer = nullptr;
+	~TraceBufferOwner()
+	{
+		if (buffer == nullptr)
+			return;
+		std::lock_guard<std::mutex> lock(Tracer::s_mutex);
+		buffer->inUse = false;
+	}
+};
+
+static thread_local TraceBufferOwner t_owner;
+static thread_local const char* t_threadName = nullptr;
+static thread_local std::map<std::string, const char*> t_internCache;
+
+TraceBuffer* Tracer::getBuffer()
+{
+	if (t_owner.buffer != nullptr)
+		return t_owner.buffer;
+	std::lock_guard<std::mutex> lock(s_mutex);
+	TraceBuffer* buffer = nullptr;
+	for (size_t i = 0; i < s_buffers.size() && buffer == nullptr; ++i)
+	{
+		if (!s_buffers[i]->inUse)
+			buffer = s_buffers[i];
+	}
+	if (buffer == nullptr)
+	{
+		buffer = new TraceBuffer();
+		buffer->threadID = (int)s_buffers.size() + 1;
+		s_buffers.push_back(buffer);
+	}
+	//Whatever the exited thread recorded would otherwise be exported under this thread's name
+	buffer->written = 0;
+	buffer->inUse = true;
+	buffer->threadName = t_threadName;
+	t_owner.buffer = buffer;
+	return buffer;
+}
+
+void Tracer::start()
+{
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		if (s_origin == 0)
+			s_origin = SDL_GetPerformanceCounter();
+	}
+	s_enabled = true;
+}
+
+void Tracer::stop()
+{
+	s_enabled = false;
+}
+
+void Tracer::setThreadName(const char* name)
+{
+	if (t_threadName == name)
+		return;
+	t_threadName = name;
+	if (t_owner.buffer != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		t_owner.buffer->threadName = name;
+	}
+}
+
+const char* Tracer::intern(const std::string& name)
+{
+	std::map<std::string, const char*>::iterator cached = t_internCache.find(name);
+	if (cached != t_internCache.end())
+		return cached->second;
+	const char* interned;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		interned = s_names.insert(name).first->c_str();
+	}
+	t_internCache[name] = interned;
+	return interned;
+}
+
+void Tracer::record(const char* category, const char* name, Uint64 start, Uint64 end, bool instant)
+{
+	TraceBuffer* buffer = getBuffer();
+	Uint32 index = buffer->written.load(std::memory_order_relaxed);
+	TraceEvent& event = buffer->events[index % TRACE_BUFFER_EVENTS];
+	event.category = category;
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	event.instant = instant;
+	buffer->written.store(index + 1, std::memory_order_release);
+}
+
+void Tracer::markFrame()
+{
+	if (!isEnabled())
+		return;
+	Uint64 now = SDL_GetPerformanceCounter();
+	record("frame", "Frame", now, now, true);
+}
+
+void Tracer::clear()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	for (size_t i = 0; i < s_buffers.size(); ++i)
+		s_buffers[i]->written = 0;
+	s_origin = SDL_GetPerformanceCounter();
+}
+
+//Names are string literals or message keys, only quotes, backslashes and control characters need escaping
+static void writeJsonString(std::ofstream& file, const char* text)
+{
+	file << '"';
+	for (const char* c = text != nullptr ? text : ""; *c != '\0'; ++c)
+	{
+		if (*c == '"' || *c == '\\')
+			file << '\\' << *c;
+		else if ((unsigned char)*c < 0x20)
+			file << ' ';
+		else
+			file << *c;
+	}
+	file << '"';
+}
+
+bool Tracer::writeChromeTrace(const std::string& path)
+{
+	std::ofstream file(path.c_str(), std::ios::trunc);
+	if (!file)
+	{
+		std::cout << "ERROR Tracer can't write " << path << std::endl;
+		return false;
+	}
+	double toMicroseconds = 1000000.0 / SDL_GetPerformanceFrequency();
+	file.setf(std::ios::fixed);
+	file.precision(3);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+	bool first = true;
+	std::lock_guard<std::mutex> lock(s_mutex);
+	for (size_t i = 0; i < s_buffers.size(); ++i)
+	{
+		TraceBuffer* buffer = s_buffers[i];
+		Uint32 written = buffer->written.load(std::memory_order_acquire);
+		Uint32 oldest = written > TRACE_BUFFER_EVENTS ? written - TRACE_BUFFER_EVENTS : 0;
+		if (written == 0)
+			continue;
+
+		file << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadID << ",\"args\":{\"name\":";
+		if (buffer->threadName != nullptr)
+			writeJsonString(file, buffer->threadName);
+		else
+			file << "\"Thread " << buffer->threadID << "\"";
+		file << "}}";
+		first = false;
+
+		for (Uint32 index = oldest; index != written; ++index)
+		{
+			const TraceEvent& event = buffer->events[index % TRACE_BUFFER_EVENTS];
+			//Recorded before a clear or an earlier start
+			if (event.start < s_origin)
+				continue;
+			file << ",\n{\"name\":";
+			writeJsonString(file, event.name);
+			file << ",\"cat\":";
+			writeJsonString(file, event.category);
+			file << ",\"pid\":1,\"tid\":" << buffer->threadID << ",\"ts\":" << (event.start - s_origin) * toMicroseconds;
+			if (event.instant)
+				file << ",\"ph\":\"i\",\"s\":\"g\"}";
+			else
+				file << ",\"ph\":\"X\",\"dur\":" << (event.end - event.start) * toMicroseconds << "}";
+		}
+	}
+	file << "\n]}\n";
+	return (bool)file;
+}
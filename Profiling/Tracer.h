@@ -0,0 +1,121 @@
+/*
+	Tracer
+
+	Frame tracer shared by networking, message dispatch and audio, for telling which of them caused a
+	hitch. TRACE_ZONE times the rest of the enclosing scope. Each thread records into its own ring of
+	TRACE_BUFFER_EVENTS events with no locks, and the oldest events are overwritten. While tracing is off,
+	a zone costs one relaxed atomic load.
+
+		Tracer::start();
+		...
+		Tracer::stop();
+		Tracer::writeChromeTrace("trace.json");
+
+	The file opens in chrome://tracing and in the Perfetto UI (ui.perfetto.dev). TRACE_FRAME marks frame
+	boundaries, call it once per frame from the game loop. Building with DISABLE_TRACING compiles every
+	macro out.
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include <atomic>
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+
+#define TRACE_BUFFER_EVENTS 16384 //per thread
+
+struct TraceEvent
+{
+	const char* category;
+	const char* name;
+	Uint64 start; //performance counter ticks
+	Uint64 end;
+	bool instant;
+};
+
+//Written only by its thread, read by writeChromeTrace
+struct TraceBuffer
+{
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+	std::atomic<Uint32> written; //events ever recorded, the slot is written % TRACE_BUFFER_EVENTS
+	int threadID;
+	const char* threadName; //guarded by Tracer::s_mutex
+	bool inUse; //guarded by Tracer::s_mutex. False once the thread has exited, the buffer is then emptied and handed to the next new thread
+};
+
+class Tracer
+{
+private:
+	static std::atomic<bool> s_enabled;
+	static Uint64 s_origin;
+	static std::mutex s_mutex;
+	static std::vector<TraceBuffer*> s_buffers;
+	static std::set<std::string> s_names;
+	static TraceBuffer* getBuffer();
+	friend struct TraceBufferOwner;
+
+public:
+	static void start();
+	static void stop();
+	static bool isEnabled()
+	{
+		return s_enabled.load(std::memory_order_relaxed);
+	}
+	/*
+	Names the calling thread in the trace. Takes a string literal, cheap enough to call every callback.
+	*/
+	static void setThreadName(const char* name);
+	/*
+	Returns a pointer to a copy of name that lives as long as the program, for zones named at run time.
+	*/
+	static const char* intern(const std::string& name);
+	static void record(const char* category, const char* name, Uint64 start, Uint64 end, bool instant);
+	static void markFrame();
+	/*
+	Drops everything recorded so far.
+	*/
+	static void clear();
+	/*
+	Writes the Chrome trace event JSON. Call after stop, a thread still recording could overwrite the
+	oldest events while they are being written.
+	*/
+	static bool writeChromeTrace(const std::string& path);
+};
+
+class TraceZone
+{
+private:
+	const char* m_category;
+	const char* m_name;
+	Uint64 m_start;
+
+public:
+	TraceZone(const char* category, const char* name)
+	{
+		m_category = category;
+		m_name = Tracer::isEnabled() ? name : nullptr;
+		m_start = m_name != nullptr ? SDL_GetPerformanceCounter() : 0;
+	}
+	~TraceZone()
+	{
+		if (m_name != nullptr)
+			Tracer::record(m_category, m_name, m_start, SDL_GetPerformanceCounter(), false);
+	}
+};
+
+#ifdef DISABLE_TRACING
+#define TRACE_ZONE(category, name)
+#define TRACE_ZONE_DYNAMIC(category, name)
+#define TRACE_FRAME()
+#define TRACE_THREAD(name)
+#else
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(category, name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(category, name)
+//name is a std::string, only interned while tracing
+#define TRACE_ZONE_DYNAMIC(category, name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(category, Tracer::isEnabled() ? Tracer::intern(name) : nullptr)
+#define TRACE_FRAME() Tracer::markFrame()
+#define TRACE_THREAD(name) Tracer::setThreadName(name)
+#endif
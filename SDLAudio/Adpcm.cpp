@@ -0,0 +1,136 @@
+#include "Adpcm.h"
+#include <cstring>
+
+static const int s_stepTable[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+	337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+	2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+	15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int s_indexTable[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8,
+	-1, -1, -1, -1, 2, 4, 6, 8
+};
+
+//Predictor and step index of one channel, shared by the encoder and decoder so both stay in step
+struct AdpcmState
+{
+	int predictor;
+	int index;
+};
+
+static int clampIndex(int index)
+{
+	return index < 0 ? 0 : (index > 88 ? 88 : index);
+}
+
+static int clampSample(int sample)
+{
+	return sample < -32768 ? -32768 : (sample > 32767 ? 32767 : sample);
+}
+
+static int decodeNibble(AdpcmState& state, int nibble)
+{
+	int step = s_stepTable[state.index];
+	int delta = step >> 3;
+	if (nibble & 4)
+		delta += step;
+	if (nibble & 2)
+		delta += step >> 1;
+	if (nibble & 1)
+		delta += step >> 2;
+	state.predictor = clampSample(nibble & 8 ? state.predictor - delta : state.predictor + delta);
+	state.index = clampIndex(state.index + s_indexTable[nibble]);
+	return state.predictor;
+}
+
+static int encodeSample(AdpcmState& state, int sample)
+{
+	int step = s_stepTable[state.index];
+	int diff = sample - state.predictor;
+	int nibble = 0;
+	if (diff < 0)
+	{
+		nibble = 8;
+		diff = -diff;
+	}
+	if (diff >= step)
+	{
+		nibble |= 4;
+		diff -= step;
+	}
+	if (diff >= step >> 1)
+	{
+		nibble |= 2;
+		diff -= step >> 1;
+	}
+	if (diff >= step >> 2)
+		nibble |= 1;
+	//Run the decoder so the encoder tracks exactly what playback will reconstruct
+	decodeNibble(state, nibble);
+	return nibble;
+}
+
+void Adpcm::encode(const Sint16* samples, Uint32 frames, AdpcmSound& sound)
+{
+	Uint32 blocks = (frames + ADPCM_BLOCK_FRAMES - 1) / ADPCM_BLOCK_FRAMES;
+	sound.frames = frames;
+	sound.data.assign(blocks * ADPCM_BLOCK_SIZE, 0);
+
+	AdpcmState state[2];
+	for (int c = 0; c < 2; ++c)
+	{
+		state[c].predictor = frames > 0 ? samples[c] : 0;
+		state[c].index = 0;
+	}
+	for (Uint32 block = 0; block < blocks; ++block)
+	{
+		Uint8* out = &sound.data[block * ADPCM_BLOCK_SIZE];
+		AdpcmBlockHeader header;
+		for (int c = 0; c < 2; ++c)
+		{
+			header.predictor[c] = (Sint16)state[c].predictor;
+			header.index[c] = (Uint8)state[c].index;
+			header.padding[c] = 0;
+		}
+		memcpy(out, &header, sizeof(header));
+		out += sizeof(header);
+
+		Uint32 first = block * ADPCM_BLOCK_FRAMES;
+		Uint32 count = frames - first < ADPCM_BLOCK_FRAMES ? frames - first : ADPCM_BLOCK_FRAMES;
+		for (Uint32 i = 0; i < count; ++i)
+		{
+			int left = encodeSample(state[0], samples[(first + i) * 2]);
+			int right = encodeSample(state[1], samples[(first + i) * 2 + 1]);
+			out[i] = (Uint8)(left | (right << 4));
+		}
+	}
+}
+
+Uint32 Adpcm::decodeBlock(const AdpcmSound& sound, Uint32 block, Sint16* out)
+{
+	Uint32 first = block * ADPCM_BLOCK_FRAMES;
+	if (first >= sound.frames)
+		return 0;
+	Uint32 count = sound.frames - first < ADPCM_BLOCK_FRAMES ? sound.frames - first : ADPCM_BLOCK_FRAMES;
+
+	const Uint8* in = &sound.data[block * ADPCM_BLOCK_SIZE];
+	AdpcmBlockHeader header;
+	memcpy(&header, in, sizeof(header));
+	in += sizeof(header);
+	AdpcmState state[2];
+	for (int c = 0; c < 2; ++c)
+	{
+		state[c].predictor = header.predictor[c];
+		state[c].index = clampIndex(header.index[c]);
+	}
+
+	for (Uint32 i = 0; i < count; ++i)
+	{
+		out[i * 2] = (Sint16)decodeNibble(state[0], in[i] & 0x0F);
+		out[i * 2 + 1] = (Sint16)decodeNibble(state[1], in[i] >> 4);
+	}
+	return count;
+}
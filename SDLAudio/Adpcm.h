@@ -0,0 +1,45 @@
+/*
+	IMA-ADPCM codec for 16-bit stereo sound effects, 4 bits per sample.
+
+	Sounds are split into blocks of ADPCM_BLOCK_FRAMES frames. Each block starts with the predictor and
+	step index of both channels, so any block can be decoded on its own. That lets the software mixer
+	keep a sound compressed in memory and only expand the block a voice is currently playing.
+	Block layout: AdpcmBlockHeader, then one byte per frame with the left nibble low, right nibble high.
+	In-memory format only, never written to disk.
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include <vector>
+
+#define ADPCM_BLOCK_FRAMES 1024
+
+struct AdpcmBlockHeader
+{
+	Sint16 predictor[2];
+	Uint8 index[2];
+	Uint8 padding[2];
+};
+
+#define ADPCM_BLOCK_SIZE (sizeof(AdpcmBlockHeader) + ADPCM_BLOCK_FRAMES)
+
+struct AdpcmSound
+{
+	std::vector<Uint8> data;
+	Uint32 frames;
+};
+
+class Adpcm
+{
+public:
+	/*
+	Encodes interleaved stereo samples.
+	*/
+	static void encode(const Sint16* samples, Uint32 frames, AdpcmSound& sound);
+
+	/*
+	Decodes one block into out, which needs room for ADPCM_BLOCK_FRAMES stereo frames.
+	Returns the number of frames written, less than a full block only for the last one.
+	*/
+	static Uint32 decodeBlock(const AdpcmSound& sound, Uint32 block, Sint16* out);
+};
@@ -1,5 +1,11 @@
 #pragma once
 
+//The format the mixer is opened with, audio packs are built for the same one
+#define AUDIO_FREQUENCY 44100
+#define AUDIO_FORMAT MIX_DEFAULT_FORMAT
+#define AUDIO_CHANNELS 2
+#define AUDIO_CHUNK_SIZE 1024
+
 //These are keys to access the proper audio chunks
 #define MUSIC_MENU 0
 #define MUSIC_LEVEL_1 1
@@ -37,4 +43,58 @@
 #define PATH_SFX_BUTTON_HOVER "Game/Assets/Audio/Torch.wav"
 #define PATH_SFX_ITEM "Game/Assets/Audio/Item.wav"
 #define PATH_SFX_TRAP "Game/Assets/Audio/Trap.wav"
-#define PATH_SFX_THRONE "Game/Assets/Audio/Throne.wav"
\ No newline at end of file
+#define PATH_SFX_THRONE "Game/Assets/Audio/Throne.wav"
+#define PATH_SFX_PACK "Game/Assets/Audio/SFX.pack"
+
+//When every channel is busy a sound steals the lowest priority (then quietest) voice, never a higher one
+#define PRIORITY_MUSIC 0
+#define PRIORITY_SFX_HIT 9
+#define PRIORITY_SFX_SWORD 7
+#define PRIORITY_SFX_BOW 6
+#define PRIORITY_SFX_SHIELD 7
+#define PRIORITY_SFX_DASH 4
+#define PRIORITY_SFX_DOOR 5
+#define PRIORITY_SFX_BUTTON_HOVER 2
+#define PRIORITY_SFX_ITEM 5
+#define PRIORITY_SFX_TRAP 8
+#define PRIORITY_SFX_THRONE 8
+
+//Most copies of a sound effect alive at once (0 = no limit), a new one replaces the quietest if it is louder
+#define MAX_INSTANCES_MUSIC 0
+#define MAX_INSTANCES_SFX_HIT 4
+#define MAX_INSTANCES_SFX_SWORD 4
+#define MAX_INSTANCES_SFX_BOW 3
+#define MAX_INSTANCES_SFX_SHIELD 3
+#define MAX_INSTANCES_SFX_DASH 2
+#define MAX_INSTANCES_SFX_DOOR 2
+#define MAX_INSTANCES_SFX_BUTTON_HOVER 1
+#define MAX_INSTANCES_SFX_ITEM 2
+#define MAX_INSTANCES_SFX_TRAP 4
+#define MAX_INSTANCES_SFX_THRONE 1
+
+struct AudioAsset
+{
+	int id;
+	const char* path;
+	bool music;
+	int priority;
+	int maxInstances;
+};
+
+//Every asset above, used by the loader thread and the pack builder
+static const AudioAsset s_audioBank[] = {
+	{ MUSIC_MENU, PATH_MUSIC_MENU, true, PRIORITY_MUSIC, MAX_INSTANCES_MUSIC },
+	{ MUSIC_LEVEL_1, PATH_MUSIC_LEVEL_1, true, PRIORITY_MUSIC, MAX_INSTANCES_MUSIC },
+	{ MUSIC_GHOST, PATH_MUSIC_GHOST, true, PRIORITY_MUSIC, MAX_INSTANCES_MUSIC },
+	{ SFX_HIT, PATH_SFX_HIT, false, PRIORITY_SFX_HIT, MAX_INSTANCES_SFX_HIT },
+	{ SFX_SWORD, PATH_SFX_SWORD, false, PRIORITY_SFX_SWORD, MAX_INSTANCES_SFX_SWORD },
+	{ SFX_BOW, PATH_SFX_BOW, false, PRIORITY_SFX_BOW, MAX_INSTANCES_SFX_BOW },
+	{ SFX_SHIELD, PATH_SFX_SHIELD, false, PRIORITY_SFX_SHIELD, MAX_INSTANCES_SFX_SHIELD },
+	{ SFX_DASH, PATH_SFX_DASH, false, PRIORITY_SFX_DASH, MAX_INSTANCES_SFX_DASH },
+	{ SFX_DOOR, PATH_SFX_DOOR, false, PRIORITY_SFX_DOOR, MAX_INSTANCES_SFX_DOOR },
+	{ SFX_BUTTON_HOVER, PATH_SFX_BUTTON_HOVER, false, PRIORITY_SFX_BUTTON_HOVER, MAX_INSTANCES_SFX_BUTTON_HOVER },
+	{ SFX_ITEM, PATH_SFX_ITEM, false, PRIORITY_SFX_ITEM, MAX_INSTANCES_SFX_ITEM },
+	{ SFX_TRAP, PATH_SFX_TRAP, false, PRIORITY_SFX_TRAP, MAX_INSTANCES_SFX_TRAP },
+	{ SFX_THRONE, PATH_SFX_THRONE, false, PRIORITY_SFX_THRONE, MAX_INSTANCES_SFX_THRONE }
+};
+#define AUDIO_BANK_SIZE (sizeof(s_audioBank) / sizeof(s_audioBank[0]))
\ No newline at end of file
@@ -9,4 +9,12 @@ AudioListener::AudioListener(GameObject* gameObject) : Component(gameObject)
 
 AudioListener::~AudioListener()
 {
+	AudioManager::getInstance()->removeListener(gameObject);
+	AudioManager::getInstance()->releaseUpdateDriver(this);
+}
+
+//Whichever audio component drives it, the manager updates once per frame
+void AudioListener::onUpdate(int ticks)
+{
+	AudioManager::getInstance()->driveUpdate(this, ticks);
 }
\ No newline at end of file
@@ -11,6 +11,6 @@ public:
 	AudioListener(GameObject* gameObject);
 	~AudioListener();
 	void onStart() {};
-	void onUpdate(int ticks) {};
+	void onUpdate(int ticks);
 	void onEnd() {};
 };
\ No newline at end of file
@@ -1,11 +1,40 @@
 /*
 	Audio Manager
 
-	Uses Mix_PlayMusic for background soundtrack.
-	Cycles through 16 available channels for playing sound effects. (plays on first available channel)
+	Background music plays on one of two deck channels reserved after the sound effect channels. Each
+	track is a MusicStream: the loader thread decodes it a block at a time into a ring of MUSIC_STREAM_MS,
+	and the deck's channel effect plays from that ring, so no track is ever decoded whole and the audio
+	thread never decodes. Switching tracks crossfades from one deck to the other (setCrossfade). Only the
+	menu track is opened at startup. Scenes preload the track they switch to next, which fills its ring
+	before playMusic is called, and a track is closed once it has faded out. Tracks MusicStream can't
+	decode (mp3) fall back to Mix_PlayMusic. SDL_mixer has a single music stream, so switching between
+	those fades one out before the next fades in.
+	Sound effects are virtual voices (m_sounds) and only the audible ones hold one of 16 real channels.
+	Free channels are kept in a list refilled as channels finish, and when the pool is full a sound
+	takes the channel of the lowest priority, then quietest, real voice (priorities live in AudioBank.h).
+	Sounds that lose their channel or fall out of range keep running on the clock without any mixing and
+	are promoted back, resuming at their current position, once they are audible and win a channel.
+	Looping emitters (playLoop) stay virtual for as long as they are out of range.
+	A sound effect requested again within DEDUP_WINDOW_MS (ten arrows in one frame) is merged into the
+	loudest copy with the gains summed, and each sound has an instance limit in AudioBank.h.
+	Sound effects are mixed by SoftwareMixer on MAX_SOFTWARE_VOICES voices, so the game thread never takes
+	the audio device lock for them. setSoftwareMixer(false), or a device it can't mix for, uses 16 SDL_mixer
+	channels instead, whose finished callbacks are passed to the game thread through m_finishedChannels.
 	Listener is a pointer to the player game object.
 	Audio source is played by a game object with its x and y position.
-	The manager calculates the distance between the listener and source to apply distanced effect by altering the volume.
+	Every frame (update, driven by one AudioListener or AudioSource, see driveUpdate) the manager follows
+	each playing sound's source and recomputes its distance attenuation (configurable curve) and stereo
+	pan in one batched pass.
+
+	Assets are loaded on a background loader thread. Music is queued at startup, sound effects are
+	loaded the first time they are played or when a scene preloads them. Until an asset is ready,
+	playSound skips it and playMusic starts the track once it finishes loading.
+	If PATH_SFX_PACK exists, sound effects are mapped from it instead and are ready immediately.
+	With the software mixer, setCompressedEffects keeps sound effects as IMA-ADPCM (Adpcm.h) instead.
+
+	setOfflineRender runs the manager without a device: the software mixer renders sound effects in fixed
+	blocks as update() advances the simulation, into memory or a WAV file, for regression tests and
+	headless servers. Virtual sounds run on the rendered clock instead of SDL_GetTicks there.
 
 	*Latest Update - March 29, 2018
 	- Added fixes to play audio on mac
@@ -21,8 +50,68 @@
 */
 
 #include "AudioManager.h"
+#include "Tracer.h"
 
 AudioManager* AudioManager::s_instance;
+bool AudioManager::s_offline = false;
+
+static const AudioAsset* findAudioAsset(int id)
+{
+	for (size_t i = 0; i < AUDIO_BANK_SIZE; ++i)
+	{
+		if (s_audioBank[i].id == id)
+			return &s_audioBank[i];
+	}
+	return nullptr;
+}
+
+//Without a device Mix_LoadWAV can't convert, so the WAV is converted to the mixer format with SDL directly
+static Mix_Chunk* loadConvertedWAV(const std::string& path)
+{
+	SDL_AudioSpec spec;
+	Uint8* buffer;
+	Uint32 length;
+	if (SDL_LoadWAV(path.c_str(), &spec, &buffer, &length) == NULL)
+	{
+		std::cout << "ERROR SDL_LoadWAV " << path << ": " << SDL_GetError() << std::endl;
+		return NULL;
+	}
+	SDL_AudioCVT cvt;
+	if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, AUDIO_FORMAT, AUDIO_CHANNELS, AUDIO_FREQUENCY) < 0)
+	{
+		std::cout << "ERROR SDL_BuildAudioCVT " << path << ": " << SDL_GetError() << std::endl;
+		SDL_FreeWAV(buffer);
+		return NULL;
+	}
+	cvt.len = length;
+	cvt.buf = (Uint8*)SDL_malloc(length * cvt.len_mult);
+	memcpy(cvt.buf, buffer, length);
+	SDL_FreeWAV(buffer);
+	if (cvt.needed && SDL_ConvertAudio(&cvt) < 0)
+	{
+		std::cout << "ERROR SDL_ConvertAudio " << path << ": " << SDL_GetError() << std::endl;
+		SDL_free(cvt.buf);
+		return NULL;
+	}
+	//Allocated the way SDL_mixer does, so Mix_FreeChunk can free it
+	Mix_Chunk* chunk = (Mix_Chunk*)SDL_malloc(sizeof(Mix_Chunk));
+	chunk->allocated = 1;
+	chunk->abuf = cvt.buf;
+	chunk->alen = cvt.needed ? cvt.len_cvt : length;
+	chunk->volume = MIX_MAX_VOLUME;
+	return chunk;
+}
+
+//Must be called before the first getInstance
+void AudioManager::setOfflineRender(bool enabled)
+{
+	if (s_instance != NULL)
+	{
+		std::cout << "ERROR AudioManager::setOfflineRender must be called before getInstance" << std::endl;
+		return;
+	}
+	s_offline = enabled;
+}
 
 AudioManager* AudioManager::getInstance()
 {
@@ -39,114 +128,1265 @@ void AudioManager::release()
 
 AudioManager::AudioManager()
 {
-	Mix_GetError();
-	//if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
-	if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 1024) < 0)
-		std::cout << "ERROR Opening Mix_OpenAudio: " << Mix_GetError() << std::endl;
-
-	Mix_AllocateChannels(MAX_CHANNELS);
-
-	m_musicFiles[MUSIC_MENU] = Mix_LoadMUS(BuildPath(PATH_MUSIC_MENU).c_str());
-	m_musicFiles[MUSIC_LEVEL_1] = Mix_LoadMUS(BuildPath(PATH_MUSIC_LEVEL_1).c_str());
-	m_musicFiles[MUSIC_GHOST] = Mix_LoadMUS(BuildPath(PATH_MUSIC_GHOST).c_str());
-	m_audioFiles[SFX_BOW] = Mix_LoadWAV(BuildPath(PATH_SFX_BOW).c_str());
-	m_audioFiles[SFX_HIT] = Mix_LoadWAV(BuildPath(PATH_SFX_HIT).c_str());
-	m_audioFiles[SFX_SWORD] = Mix_LoadWAV(BuildPath(PATH_SFX_SWORD).c_str());
-	m_audioFiles[SFX_SHIELD] = Mix_LoadWAV(BuildPath(PATH_SFX_SHIELD).c_str());
-	m_audioFiles[SFX_DASH] = Mix_LoadWAV(BuildPath(PATH_SFX_DASH).c_str());
-	m_audioFiles[SFX_DOOR] = Mix_LoadWAV(BuildPath(PATH_SFX_DOOR).c_str());
-	m_audioFiles[SFX_BUTTON_HOVER] = Mix_LoadWAV(BuildPath(PATH_SFX_BUTTON_HOVER).c_str());
-	m_audioFiles[SFX_ITEM] = Mix_LoadWAV(BuildPath(PATH_SFX_ITEM).c_str());
-	m_audioFiles[SFX_TRAP] = Mix_LoadWAV(BuildPath(PATH_SFX_TRAP).c_str());
-	m_audioFiles[SFX_THRONE] = Mix_LoadWAV(BuildPath(PATH_SFX_THRONE).c_str());
-	std::cout << Mix_GetError() << std::endl;
+	m_offline = nullptr;
+	if (!s_offline)
+	{
+		Mix_GetError();
+		//if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 2048) < 0)
+		if (Mix_OpenAudio(AUDIO_FREQUENCY, AUDIO_FORMAT, AUDIO_CHANNELS, AUDIO_CHUNK_SIZE) < 0)
+			std::cout << "ERROR Opening Mix_OpenAudio: " << Mix_GetError() << std::endl;
+
+		//Sound effects use channels 0 to MAX_CHANNELS - 1, the music decks sit after them
+		Mix_AllocateChannels(MAX_CHANNELS + MUSIC_DECKS);
+	}
+
+	m_nextSound = 0;
+	m_mixer = nullptr;
 	m_listener = nullptr;
+	m_updateDriver = nullptr;
+	m_updateDriven = 0;
+	m_hasListenerPosition = false;
+	m_listenerX = 0;
+	m_listenerY = 0;
+	setAttenuation(ATTENUATION_LINEAR, MIN_DISTANCE, MAX_DISTANCE, 1.0f);
+
+	//Pre-converted sound effects, no decoding needed. Falls back to loading WAV files on demand
+	int frequency, channels;
+	Uint16 format;
+	if (s_offline || !Mix_QuerySpec(&frequency, &format, &channels))
+	{
+		frequency = AUDIO_FREQUENCY;
+		format = AUDIO_FORMAT;
+		channels = AUDIO_CHANNELS;
+	}
+	m_frequency = frequency;
+	m_frameBytes = (SDL_AUDIO_BITSIZE(format) / 8) * channels;
+	m_outputFormat = format;
+	m_outputChannels = channels;
+	m_deckSilence.assign(AUDIO_CHUNK_SIZE * m_frameBytes, SDL_AUDIO_ISSIGNED(format) ? 0 : 0x80);
+	m_deckChunk.allocated = 0;
+	m_deckChunk.abuf = &m_deckSilence[0];
+	m_deckChunk.alen = (Uint32)m_deckSilence.size();
+	m_deckChunk.volume = MIX_MAX_VOLUME;
+	m_stats.setBufferPeriod(AUDIO_CHUNK_SIZE, frequency);
+
+	if (s_offline)
+	{
+		//No device: sound effects go straight to a software mixer that update() renders
+		m_mixer = new SoftwareMixer();
+		m_mixer->setFinishedCallback(&AudioManager::channelFinished);
+		m_mixer->setStats(&m_stats);
+		m_offline = new OfflineRenderer(m_mixer, frequency);
+		resetVoices(MAX_SOFTWARE_VOICES);
+	}
+	else
+	{
+		resetVoices(MAX_CHANNELS);
+		Mix_ChannelFinished(&AudioManager::sdlChannelFinished);
+		//Runs once per callback after the channels are mixed, used to spot late callbacks
+		Mix_RegisterEffect(MIX_CHANNEL_POST, &AudioManager::callbackProbe, NULL, this);
+		//Sound effects go through the lock-free command ring, SDL_mixer channels remain the fallback
+		setSoftwareMixer(true);
+	}
+
+	if (m_pack.open(BuildPath(PATH_SFX_PACK), frequency, format, channels))
+	{
+		std::vector<int> ids = m_pack.getIds();
+		for (size_t i = 0; i < ids.size(); ++i)
+		{
+			m_audioFiles[ids[i]] = m_pack.getChunk(ids[i]);
+			m_loadStates[ids[i]] = AUDIO_READY;
+		}
+	}
+
+	m_compressEffects = false;
+	m_scheduling = false;
+	m_scheduledStart = 0;
+	m_pendingMusic = -1;
+	m_currentMusic = -1;
+	m_musicDeck = 0;
+	for (int i = 0; i < MUSIC_DECKS; ++i)
+		m_deckMusic[i] = -1;
+	m_pendingStream = -1;
+	m_crossfade = MUSIC_CROSSFADE_MS;
+	m_loaderRunning = true;
+	m_loaderThread = std::thread(&AudioManager::loaderThread, this);
+
+	//The menu track is needed right away, the rest are opened when a scene preloads them
+	if (!s_offline)
+		requestLoad(MUSIC_MENU);
 }
 
 AudioManager::~AudioManager()
 {
+	{
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		m_loaderRunning = false;
+	}
+	m_loadReady.notify_all();
+	if (m_loaderThread.joinable())
+		m_loaderThread.join();
+	if (m_offline == nullptr)
+	{
+		//Removes the deck effects too, so the audio thread is done with the streams before they are freed
+		for (int i = 0; i < MUSIC_DECKS; ++i)
+			Mix_HaltChannel(MAX_CHANNELS + i);
+		Mix_ChannelFinished(NULL);
+		Mix_UnregisterEffect(MIX_CHANNEL_POST, &AudioManager::callbackProbe);
+	}
+	delete m_offline;
+	delete m_mixer;
+	for (size_t i = 0; i < m_retiredChunks.size(); ++i)
+		Mix_FreeChunk(m_retiredChunks[i].second);
 	Mix_Quit();
 }
 
+//Queues an asset for the loader thread unless it is already loading or loaded
+void AudioManager::requestLoad(int audioInput)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		AudioLoadState& state = m_loadStates[audioInput];
+		if (state != AUDIO_UNLOADED)
+			return;
+		state = AUDIO_LOADING;
+		if (m_offline == nullptr)
+		{
+			m_loadRequests.push_back(audioInput);
+			m_loadReady.notify_one();
+			return;
+		}
+	}
+	//Offline there is no audio thread to protect, and loading in place keeps renders deterministic
+	loadAsset(audioInput);
+}
+
+//Loads requested assets and, at least every MUSIC_REFILL_MS, tops up the music streams
+void AudioManager::loaderThread()
+{
+	TRACE_THREAD("Audio loader");
+	while (true)
+	{
+		int audioInput = -1;
+		std::vector<std::shared_ptr<MusicStream>> streams;
+		{
+			std::unique_lock<std::mutex> lock(m_loadMutex);
+			m_loadReady.wait_for(lock, std::chrono::milliseconds(MUSIC_REFILL_MS), [this] { return !m_loaderRunning || !m_loadRequests.empty(); });
+			if (!m_loaderRunning)
+				return;
+			if (!m_loadRequests.empty())
+			{
+				audioInput = m_loadRequests.front();
+				m_loadRequests.pop_front();
+			}
+			for (std::map<int, std::shared_ptr<MusicStream>>::iterator it = m_musicStreams.begin(); it != m_musicStreams.end(); ++it)
+				streams.push_back(it->second);
+		}
+		if (audioInput != -1)
+			loadAsset(audioInput);
+		for (size_t i = 0; i < streams.size(); ++i)
+			streams[i]->refill();
+	}
+}
+
+//Decodes one asset. Runs on the loader thread, or on the caller's thread when rendering offline
+void AudioManager::loadAsset(int audioInput)
+{
+	TRACE_ZONE("audio", "loadAsset");
+	const AudioAsset* asset = findAudioAsset(audioInput);
+	if (asset == nullptr)
+	{
+		std::cout << "ERROR Unknown audio id: " << audioInput << std::endl;
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		m_loadStates[audioInput] = AUDIO_FAILED;
+		return;
+	}
+
+	//Decoding happens outside the lock so the game thread never waits on file I/O
+	Uint32 loadStart = SDL_GetTicks();
+	if (asset->music && m_offline != nullptr)
+	{
+		//Music isn't part of the offline mix
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		m_loadStates[audioInput] = AUDIO_FAILED;
+		return;
+	}
+	else if (asset->music)
+	{
+		//The ring is filled before the track is ready, so a deck starts on decoded audio.
+		//Formats MusicStream can't read are streamed with Mix_Music instead
+		std::shared_ptr<MusicStream> track(MusicStream::open(BuildPath(asset->path), m_frequency, m_outputFormat, m_outputChannels));
+		if (track != nullptr && !track->refill())
+		{
+			std::cout << "ERROR Can't decode " << asset->path << std::endl;
+			track = nullptr;
+		}
+		Mix_Music* music = NULL;
+		if (track == nullptr)
+		{
+			music = Mix_LoadMUS(BuildPath(asset->path).c_str());
+			if (music == NULL)
+				std::cout << "ERROR Mix_LoadMUS " << asset->path << ": " << Mix_GetError() << std::endl;
+		}
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		if (track != nullptr)
+			m_musicStreams[audioInput] = track;
+		else
+			m_musicFiles[audioInput] = music;
+		m_loadStates[audioInput] = track != nullptr || music != NULL ? AUDIO_READY : AUDIO_FAILED;
+		if ((track != nullptr || music != NULL) && m_pendingMusic == audioInput)
+		{
+			m_pendingMusic = -1;
+			startMusic(audioInput);
+		}
+	}
+	else
+	{
+		Mix_Chunk* chunk;
+		if (m_offline != nullptr)
+			chunk = loadConvertedWAV(BuildPath(asset->path));
+		else
+		{
+			chunk = Mix_LoadWAV(BuildPath(asset->path).c_str());
+			if (chunk == NULL)
+				std::cout << "ERROR Mix_LoadWAV " << asset->path << ": " << Mix_GetError() << std::endl;
+		}
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		//Nothing can be playing a chunk that isn't in m_audioFiles yet
+		if (chunk != NULL && m_compressEffects)
+		{
+			Mix_Chunk* placeholder = compressChunk(audioInput, chunk);
+			if (placeholder != chunk)
+				Mix_FreeChunk(chunk);
+			chunk = placeholder;
+		}
+		m_audioFiles[audioInput] = chunk;
+		m_loadStates[audioInput] = chunk != NULL ? AUDIO_READY : AUDIO_FAILED;
+	}
+	m_stats.recordLoad(audioInput, SDL_GetTicks() - loadStart);
+}
+
+//Scenes pass the sounds they are about to use so they are decoded before the first play
+void AudioManager::preload(const std::vector<int>& audioInputs)
+{
+	for (size_t i = 0; i < audioInputs.size(); ++i)
+		requestLoad(audioInputs[i]);
+}
+
+AudioLoadState AudioManager::getLoadState(int audioInput)
+{
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	std::map<int, AudioLoadState>::iterator it = m_loadStates.find(audioInput);
+	return it != m_loadStates.end() ? it->second : AUDIO_UNLOADED;
+}
+
+//Returns NULL and starts loading the sound if it isn't ready yet
+Mix_Chunk* AudioManager::getChunk(int sfxInput)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		std::map<int, Mix_Chunk*>::iterator it = m_audioFiles.find(sfxInput);
+		if (it != m_audioFiles.end())
+			return it->second;
+	}
+	requestLoad(sfxInput);
+	if (m_offline == nullptr)
+		return NULL;
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	std::map<int, Mix_Chunk*>::iterator it = m_audioFiles.find(sfxInput);
+	return it != m_audioFiles.end() ? it->second : NULL;
+}
+
 void AudioManager::setListener(GameObject* listenerObject)
 {
 	m_listener = listenerObject;
 }
 
-//Music will be looped in the background
+void AudioManager::removeListener(GameObject* listenerObject)
+{
+	if (m_listener == listenerObject)
+		m_listener = nullptr;
+}
+
+void AudioManager::setListenerPosition(float x, float y)
+{
+	m_hasListenerPosition = true;
+	m_listenerX = x;
+	m_listenerY = y;
+}
+
+//The listener object if there is one, otherwise the fixed position. False if neither is set
+bool AudioManager::getListenerPosition(float& x, float& y)
+{
+	if (m_listener != nullptr)
+	{
+		x = m_listener->getTransform()->getX();
+		y = m_listener->getTransform()->getY();
+		return true;
+	}
+	x = m_listenerX;
+	y = m_listenerY;
+	return m_hasListenerPosition;
+}
+
+/*
+Encodes a loaded PCM chunk as IMA-ADPCM and returns the placeholder that replaces it, which keeps the
+length but has no samples. The caller frees the PCM chunk. Needs m_loadMutex.
+*/
+Mix_Chunk* AudioManager::compressChunk(int sfxInput, Mix_Chunk* chunk)
+{
+	//Pack chunks are mapped from disk, compressing them wouldn't save anything
+	if (chunk == m_pack.getChunk(sfxInput))
+		return chunk;
+	AdpcmSound* compressed = new AdpcmSound();
+	Adpcm::encode((const Sint16*)chunk->abuf, chunk->alen / (2 * sizeof(Sint16)), *compressed);
+	m_compressedFiles[sfxInput] = compressed;
+
+	//Mix_FreeChunk releases it with SDL_free
+	Mix_Chunk* placeholder = (Mix_Chunk*)SDL_malloc(sizeof(Mix_Chunk));
+	placeholder->allocated = 0;
+	placeholder->abuf = NULL;
+	placeholder->alen = chunk->alen;
+	placeholder->volume = chunk->volume;
+	return placeholder;
+}
+
+AdpcmSound* AudioManager::getCompressed(int sfxInput)
+{
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	std::map<int, AdpcmSound*>::iterator it = m_compressedFiles.find(sfxInput);
+	return it != m_compressedFiles.end() ? it->second : nullptr;
+}
+
+/*
+Keeps sound effects as IMA-ADPCM, about a quarter of the memory, expanded block by block while they
+play. Only the software mixer can play them. Effects already loaded are converted too unless playing.
+*/
+bool AudioManager::setCompressedEffects(bool enabled)
+{
+	if (enabled && m_mixer == nullptr)
+	{
+		std::cout << "ERROR Compressed sound effects need the software mixer" << std::endl;
+		return false;
+	}
+	std::set<int> playing;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		for (std::map<int, Voice>::iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+			playing.insert(it->second.sfx);
+	}
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	m_compressEffects = enabled;
+	if (!enabled)
+		return true;
+	//A voice halted just before this can still be mixing the PCM until the callback applies the halt
+	Uint32 fence = 0;
+	for (std::map<int, Mix_Chunk*>::iterator it = m_audioFiles.begin(); it != m_audioFiles.end(); ++it)
+	{
+		if (it->second == NULL || m_compressedFiles.count(it->first) != 0 || playing.count(it->first) != 0)
+			continue;
+		Mix_Chunk* placeholder = compressChunk(it->first, it->second);
+		if (placeholder == it->second)
+			continue;
+		if (fence == 0)
+			fence = m_mixer->fence();
+		m_retiredChunks.push_back(std::make_pair(fence, it->second));
+		it->second = placeholder;
+	}
+	return true;
+}
+
+//Retired chunks whose fence was dropped on a full ring get a new one
+void AudioManager::freeRetiredChunks()
+{
+	if (m_mixer == nullptr)
+		return;
+	Uint32 fence = 0;
+	for (size_t i = 0; i < m_retiredChunks.size();)
+	{
+		if (m_retiredChunks[i].first == 0)
+		{
+			if (fence == 0)
+				fence = m_mixer->fence();
+			m_retiredChunks[i].first = fence;
+		}
+		if (m_retiredChunks[i].first != 0 && m_mixer->fencePassed(m_retiredChunks[i].first))
+		{
+			Mix_FreeChunk(m_retiredChunks[i].second);
+			m_retiredChunks[i] = m_retiredChunks.back();
+			m_retiredChunks.pop_back();
+		}
+		else
+			++i;
+	}
+}
+
+AudioStats& AudioManager::getStats()
+{
+	return m_stats;
+}
+
+//Effect on the post channel, called on the audio thread once per callback
+void AudioManager::callbackProbe(int channel, void* stream, int len, void* udata)
+{
+	((AudioManager*)udata)->m_stats.markCallback();
+}
+
+//Music will be looped in the background, crossfading from whatever was playing
 void AudioManager::playMusic(int musicInput)
 {
-	if (Mix_PlayMusic(m_musicFiles[musicInput], -1) == -1)
+	TRACE_ZONE("audio", "playMusic");
+	if (m_offline != nullptr)
+		return;
+	bool ready;
+	{
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		//Whatever was waiting to load is superseded by this track
+		m_pendingMusic = -1;
+		ready = m_musicStreams.count(musicInput) != 0 || m_musicFiles.count(musicInput) != 0;
+		if (ready)
+			startMusic(musicInput);
+		else
+			m_pendingMusic = musicInput; //the loader thread starts it once its stream is filled
+	}
+	if (!ready)
+		requestLoad(musicInput);
+}
+
+//Fades the current deck out and the track in on the other one. Needs m_loadMutex
+void AudioManager::startMusic(int musicInput)
+{
+	if (musicInput == m_currentMusic)
+		return;
+	int outgoing = MAX_CHANNELS + m_musicDeck;
+	if (Mix_Playing(outgoing))
+		Mix_FadeOutChannel(outgoing, m_crossfade);
+	if (m_currentMusic != -1)
+		m_retiredMusic.insert(m_currentMusic);
+	m_retiredMusic.erase(musicInput);
+	m_currentMusic = musicInput;
+	m_pendingStream = -1;
+
+	std::map<int, std::shared_ptr<MusicStream>>::iterator track = m_musicStreams.find(musicInput);
+	if (track == m_musicStreams.end())
+	{
+		//Streamed fallback. SDL_mixer has one music stream and Mix_FadeInMusic blocks until it finishes
+		//fading out, so a streamed track playing now fades out first and updateMusic fades this one in
+		if (Mix_PlayingMusic() && !Mix_PausedMusic())
+		{
+			Mix_FadeOutMusic(m_crossfade);
+			m_pendingStream = musicInput;
+			return;
+		}
+		Mix_HaltMusic();
+		std::map<int, Mix_Music*>::iterator music = m_musicFiles.find(musicInput);
+		if (music != m_musicFiles.end() && music->second != NULL && Mix_FadeInMusic(music->second, -1, m_crossfade) == -1)
+			printf("Mix_FadeInMusic: %s\n", Mix_GetError());
+		return;
+	}
+
+	if (Mix_PlayingMusic())
+		Mix_FadeOutMusic(m_crossfade);
+	m_musicDeck = 1 - m_musicDeck;
+	int incoming = MAX_CHANNELS + m_musicDeck;
+	//Halting also removes the effect of whatever track the deck had
+	Mix_HaltChannel(incoming);
+	Mix_Volume(incoming, MAX_VOLUME);
+	m_deckMusic[m_musicDeck] = musicInput;
+	if (!Mix_RegisterEffect(incoming, &AudioManager::deckEffect, NULL, track->second.get()))
+		printf("Mix_RegisterEffect: %s\n", Mix_GetError());
+	else if (Mix_FadeInChannel(incoming, &m_deckChunk, -1, m_crossfade) == -1)
+		printf("Mix_FadeInChannel: %s\n", Mix_GetError());
+}
+
+//Effect on a deck channel, replaces the silent chunk with the deck's track before the fade is applied
+void AudioManager::deckEffect(int channel, void* stream, int len, void* udata)
+{
+	((MusicStream*)udata)->read((Uint8*)stream, len);
+}
+
+//Game thread: starts a streamed track once the previous one has faded out, and closes music streams
+//nothing plays any more so they can be loaded again when needed
+void AudioManager::updateMusic()
+{
+	if (m_offline != nullptr)
+		return;
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	if (m_pendingStream != -1 && !Mix_PlayingMusic())
+	{
+		std::map<int, Mix_Music*>::iterator music = m_musicFiles.find(m_pendingStream);
+		if (music != m_musicFiles.end() && music->second != NULL && Mix_FadeInMusic(music->second, -1, m_crossfade) == -1)
+			printf("Mix_FadeInMusic: %s\n", Mix_GetError());
+		m_pendingStream = -1;
+	}
+	for (std::set<int>::iterator it = m_retiredMusic.begin(); it != m_retiredMusic.end();)
 	{
-		printf("Mix_PlayMusic: %s\n", Mix_GetError());
+		bool playing = false;
+		for (int i = 0; i < MUSIC_DECKS; ++i)
+			playing = playing || (m_deckMusic[i] == *it && Mix_Playing(MAX_CHANNELS + i));
+		if (playing)
+		{
+			++it;
+			continue;
+		}
+		//Mix_Music tracks only hold a file handle, they stay open
+		std::map<int, std::shared_ptr<MusicStream>>::iterator track = m_musicStreams.find(*it);
+		if (track != m_musicStreams.end())
+		{
+			//SDL_mixer drops the effect of a stopped channel, unregistering takes the device lock to be sure the
+			//audio thread is out of it. The loader thread lets go of its reference after the refill it may be in
+			for (int i = 0; i < MUSIC_DECKS; ++i)
+			{
+				if (m_deckMusic[i] != *it)
+					continue;
+				Mix_UnregisterAllEffects(MAX_CHANNELS + i);
+				m_deckMusic[i] = -1;
+			}
+			m_musicStreams.erase(track);
+			m_loadStates.erase(*it);
+		}
+		m_retiredMusic.erase(it++);
 	}
 }
+
+void AudioManager::setCrossfade(int milliseconds)
+{
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	m_crossfade = milliseconds > 0 ? milliseconds : 0;
+}
+
 void AudioManager::pauseMusic()
 {
+	for (int i = 0; i < MUSIC_DECKS; ++i)
+		Mix_Pause(MAX_CHANNELS + i);
 	if (Mix_PlayingMusic() != 0)
 		Mix_PauseMusic();
 }
 
 void AudioManager::resumeMusic()
 {
+	for (int i = 0; i < MUSIC_DECKS; ++i)
+		Mix_Resume(MAX_CHANNELS + i);
 	if (Mix_PausedMusic() != 0)
 		Mix_ResumeMusic();
 }
 
-//Sound effects has a pool of 16 channels to play on
-void AudioManager::playSound(int sfxInput, float sourceX, float sourceY)
+/*
+SDL_mixer's channel callback, on the audio thread or inside Mix_HaltChannel. Both hold the device lock, so
+there is only ever one producer at a time. The music decks aren't sound effect channels.
+*/
+void AudioManager::sdlChannelFinished(int channel)
 {
-	//loop through channels to find first available
-	for (int i = 0; i < MAX_CHANNELS; ++i)
+	if (channel < 0 || channel >= MAX_CHANNELS)
+		return;
+	AudioManager* self = s_instance;
+	//Sound effects are on the software mixer, which reports its own voices
+	if (self == NULL || self->m_mixer != nullptr)
+		return;
+	if (!self->m_finishedChannels.push(channel))
+		self->m_stats.countQueueOverflow();
+}
+
+void AudioManager::pollFinishedChannels()
+{
+	int channel;
+	while (m_finishedChannels.pop(channel))
+		channelFinished(channel);
+}
+
+//Game thread, called for every channel or software mixer voice that stops
+void AudioManager::channelFinished(int channel)
+{
+	AudioManager* self = s_instance;
+	if (self == NULL || channel < 0)
+		return;
+	std::lock_guard<std::mutex> lock(self->m_voiceMutex);
+	if (channel >= (int)self->m_channels.size() || self->m_channels[channel] == -1)
+		return;
+	int id = self->m_channels[channel];
+	self->m_channels[channel] = -1;
+	self->m_freeChannels.push_back(channel);
+
+	std::map<int, Voice>::iterator it = self->m_sounds.find(id);
+	if (it == self->m_sounds.end())
+		return;
+	//Virtualized and looping sounds live on without a channel, anything else is done
+	if (it->second.virtualizing || it->second.loop)
 	{
-		if (!Mix_Playing(i))
+		it->second.channel = -1;
+		it->second.virtualizing = false;
+	}
+	else
+		self->m_sounds.erase(it);
+}
+
+//Rebuilds the channel pool, every sound becomes virtual until the next update promotes it
+void AudioManager::resetVoices(int count)
+{
+	std::lock_guard<std::mutex> lock(m_voiceMutex);
+	m_channels.assign(count, -1);
+	m_tailChunks.assign(count, Mix_Chunk());
+	m_freeChannels.clear();
+	//Pushed in reverse so channel 0 is handed out first
+	for (int i = count - 1; i >= 0; --i)
+		m_freeChannels.push_back(i);
+	for (std::map<int, Voice>::iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+	{
+		it->second.channel = -1;
+		it->second.virtualizing = false;
+	}
+}
+
+//Length of a chunk in milliseconds, used to advance virtual sounds
+Uint32 AudioManager::chunkLength(Mix_Chunk* chunk)
+{
+	return (Uint32)((Uint64)chunk->alen / m_frameBytes * 1000 / m_frequency);
+}
+
+/*
+Gives the sound a real channel, virtualizing the lowest priority (then quietest, then oldest) real sound if
+the pool is full. A same priority victim is only replaced when the sound is louder by more than margin.
+Returns the channel, or -1 if the sound has to stay virtual.
+*/
+int AudioManager::acquireChannel(int id, int margin)
+{
+	int victimChannel = -1;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		std::map<int, Voice>::iterator request = m_sounds.find(id);
+		if (request == m_sounds.end())
+			return -1;
+		if (m_freeChannels.empty())
 		{
-			//checks for listener
-			if (m_listener != nullptr && m_listener != NULL)
-			{
-				m_listenerX = m_listener->getTransform()->getX();
-				m_listenerY = m_listener->getTransform()->getY();
-				//checks distance between player and source
-				m_distance = sqrt(pow((sourceX - m_listenerX), 2.0) + pow((sourceY - m_listenerY), 2.0));
-			}
-			else
+			Voice* victim = nullptr;
+			for (std::map<int, Voice>::iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
 			{
-				//std::cout << "No listener found!" << endl;
-				m_distance = 0;
-				//break;
+				Voice& voice = it->second;
+				if (voice.channel == -1 || voice.virtualizing)
+					continue;
+				if (victim == nullptr || voice.priority < victim->priority
+					|| (voice.priority == victim->priority && voice.loudness < victim->loudness)
+					|| (voice.priority == victim->priority && voice.loudness == victim->loudness && voice.startTick < victim->startTick))
+					victim = &voice;
 			}
+			if (victim == nullptr || victim->priority > request->second.priority
+				|| (victim->priority == request->second.priority && victim->loudness + margin > request->second.loudness))
+				return -1;
+			victim->virtualizing = true;
+			victimChannel = victim->channel;
+			m_stats.countStolen();
+		}
+	}
 
-			//play normally when source is withing range of the player
-			if (m_distance < MIN_DISTANCE)
+	//Halting runs channelFinished, so the lock must be released first
+	if (victimChannel != -1)
+		haltChannel(victimChannel);
+
+	std::lock_guard<std::mutex> lock(m_voiceMutex);
+	std::map<int, Voice>::iterator request = m_sounds.find(id);
+	if (request == m_sounds.end() || m_freeChannels.empty())
+		return -1;
+	int channel = m_freeChannels.back();
+	m_freeChannels.pop_back();
+	m_channels[channel] = id;
+	request->second.channel = channel;
+	request->second.appliedLeft = -1;
+	request->second.appliedRight = -1;
+	return channel;
+}
+
+//Starts a sound on the channel acquireChannel gave it, resuming from where its virtual playback got to
+bool AudioManager::startChannel(int channel, int id)
+{
+	int sfx;
+	bool loop;
+	float left, right;
+	Sint32 elapsed;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		std::map<int, Voice>::iterator it = m_sounds.find(id);
+		if (it == m_sounds.end() || it->second.channel != channel)
+			return false;
+		sfx = it->second.sfx;
+		loop = it->second.loop;
+		left = it->second.left;
+		right = it->second.right;
+		//Negative for a sound scheduled a little ahead
+		elapsed = (Sint32)(getTime() - it->second.startTick);
+		it->second.appliedLeft = (int)(left * 255);
+		it->second.appliedRight = (int)(right * 255);
+	}
+
+	Mix_Chunk* chunk = getChunk(sfx);
+	Uint32 frames = chunk != NULL ? chunk->alen / m_frameBytes : 0;
+	Uint32 offset = frames > 0 && elapsed > 0 ? (Uint32)((Uint64)elapsed * m_frequency / 1000) : 0;
+	Uint32 delay = elapsed < 0 ? (Uint32)((Uint64)(-elapsed) * m_frequency / 1000) : 0;
+	if (loop && frames > 0)
+		offset %= frames;
+	//A tail chunk isn't worth it for a few milliseconds, and that lets a loop start as a real loop.
+	//The software mixer seeks for free, so it keeps the exact position
+	if (m_mixer == nullptr && offset < (Uint32)(m_frequency * VIRTUAL_RESUME_MS / 1000))
+		offset = 0;
+	if (chunk != NULL && offset < frames && playChannel(channel, sfx, left, right, offset, loop, delay))
+		return true;
+
+	//Failed or already past the end, free the channel and forget the sound
+	std::lock_guard<std::mutex> lock(m_voiceMutex);
+	if (m_channels[channel] == id)
+	{
+		m_channels[channel] = -1;
+		m_freeChannels.push_back(channel);
+	}
+	m_sounds.erase(id);
+	return false;
+}
+
+//Gain for a source at distance from the listener, 0 at and beyond the max distance
+float AudioManager::attenuate(float distance)
+{
+	if (distance <= m_minDistance)
+		return 1.0f;
+	if (distance >= m_maxDistance)
+		return 0.0f;
+	switch (m_attenuationCurve)
+	{
+	case ATTENUATION_INVERSE:
+		return m_minDistance / (m_minDistance + m_rolloff * (distance - m_minDistance));
+	case ATTENUATION_EXPONENTIAL:
+		return pow(distance / m_minDistance, -m_rolloff);
+	case ATTENUATION_LINEAR:
+	default:
+		return 1.0f - (distance - m_minDistance) / (m_maxDistance - m_minDistance);
+	}
+}
+
+//Computes the left/right gains of one source, returns false when it is out of range
+bool AudioManager::spatialize(float sourceX, float sourceY, float gain, float& left, float& right)
+{
+	float listenerX, listenerY;
+	if (!getListenerPosition(listenerX, listenerY))
+	{
+		//No listener, play everything centered at full volume
+		left = right = gain > 1.0f ? 1.0f : gain;
+		return gain > 0.0f;
+	}
+	float dx = sourceX - listenerX;
+	float dy = sourceY - listenerY;
+	float distance = sqrt(dx * dx + dy * dy);
+	float attenuated = gain * attenuate(distance);
+	//Balance law: the far side is turned down, the near side stays at full level
+	float pan = dx / (distance > m_minDistance ? distance : m_minDistance);
+	left = attenuated * (pan > 0.0f ? 1.0f - pan : 1.0f);
+	right = attenuated * (pan < 0.0f ? 1.0f + pan : 1.0f);
+	//Merged sounds can have a gain above 1, the mixer levels can't go past full
+	left = left > 1.0f ? 1.0f : left;
+	right = right > 1.0f ? 1.0f : right;
+	return attenuated > 0.0f;
+}
+
+//Registers a sound and plays it right away if it is audible and wins a channel, otherwise it starts virtual
+int AudioManager::startSound(int sfxInput, float sourceX, float sourceY, GameObject* source, bool loop, Uint32 startTime)
+{
+	TRACE_ZONE("audio", "startSound");
+	//Not decoded yet, skip it rather than stall the frame
+	Mix_Chunk* chunk = getChunk(sfxInput);
+	if (chunk == NULL)
+		return -1;
+
+	const AudioAsset* asset = findAudioAsset(sfxInput);
+	Voice sound;
+	sound.sfx = sfxInput;
+	sound.priority = asset != nullptr ? asset->priority : 0;
+	sound.startTick = startTime;
+	sound.length = chunkLength(chunk);
+	sound.loop = loop;
+	sound.channel = -1;
+	sound.virtualizing = false;
+	sound.source = source;
+	sound.x = sourceX;
+	sound.y = sourceY;
+	sound.gain = 1.0f;
+	bool audible = spatialize(sourceX, sourceY, sound.gain, sound.left, sound.right);
+	sound.loudness = (int)(MAX_VOLUME * (sound.left > sound.right ? sound.left : sound.right));
+	sound.appliedLeft = -1;
+	sound.appliedRight = -1;
+
+	int id;
+	int replaced = -1;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		//Loops are separate emitters, only one-shots are merged and limited
+		if (!loop)
+		{
+			std::map<int, Voice>::iterator quietest = m_sounds.end();
+			int instances = 0;
+			for (std::map<int, Voice>::iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
 			{
-				playChannel(i, MAX_VOLUME, m_distance, sfxInput);
-				break;
+				Voice& other = it->second;
+				if (other.sfx != sfxInput || other.loop)
+					continue;
+				//Either way round, a scheduled request can be earlier than one already playing
+				if (abs((Sint32)(sound.startTick - other.startTick)) <= DEDUP_WINDOW_MS)
+				{
+					mergeSound(other, sound);
+					return it->first;
+				}
+				++instances;
+				if (quietest == m_sounds.end() || other.loudness < quietest->second.loudness
+					|| (other.loudness == quietest->second.loudness && other.startTick < quietest->second.startTick))
+					quietest = it;
 			}
-			//set the distance and volume of the channel when the source is further away
-			else if (m_distance < MAX_DISTANCE)
+			if (asset != nullptr && asset->maxInstances > 0 && instances >= asset->maxInstances)
 			{
-				m_distance *= DISTANCE_OFFSET;
-				playChannel(i, DISTANCE_VOLUME, m_distance, sfxInput);
-				break;
+				if (quietest->second.loudness >= sound.loudness)
+				{
+					m_stats.countDropped();
+					return -1;
+				}
+				replaced = quietest->first;
 			}
 		}
+		if (replaced == -1 && m_sounds.size() >= MAX_VIRTUAL_VOICES)
+		{
+			m_stats.countDropped();
+			return -1;
+		}
+		id = m_nextSound++;
+		m_sounds[id] = sound;
+	}
+	if (replaced != -1)
+		stopSound(replaced);
+
+	if (audible && sound.loudness >= VIRTUAL_LOUDNESS && isDue(sound, getTime()))
+	{
+		int channel = acquireChannel(id, 0);
+		if (channel != -1 && !startChannel(channel, id))
+			return -1;
 	}
+	return id;
 }
 
-void AudioManager::playChannel(int channel, int volume, int distance, int sfxInput)
+//Keeps the louder of the two positions and raises the gain so the voice carries both copies
+void AudioManager::mergeSound(Voice& kept, const Voice& request)
 {
-	if (!Mix_Volume(channel, volume))
+	float keptLevel = kept.left > kept.right ? kept.left : kept.right;
+	float requestLevel = request.left > request.right ? request.left : request.right;
+	float total = keptLevel + requestLevel;
+	if (requestLevel > keptLevel)
 	{
-		std::cout << "ERROR Mix_Volume: " << Mix_GetError() << std::endl;
+		kept.source = request.source;
+		kept.x = request.x;
+		kept.y = request.y;
+		kept.gain = request.gain;
+		kept.left = request.left;
+		kept.right = request.right;
+		keptLevel = requestLevel;
+	}
+	m_stats.countMerged();
+	if (keptLevel <= 0.0f)
+		return;
+	float scale = total / keptLevel;
+	kept.gain *= scale;
+	if (kept.gain > DEDUP_MAX_GAIN)
+	{
+		scale *= DEDUP_MAX_GAIN / kept.gain;
+		kept.gain = DEDUP_MAX_GAIN;
+	}
+	kept.left = kept.left * scale > 1.0f ? 1.0f : kept.left * scale;
+	kept.right = kept.right * scale > 1.0f ? 1.0f : kept.right * scale;
+	kept.loudness = (int)(MAX_VOLUME * (kept.left > kept.right ? kept.left : kept.right));
+}
+
+//Whether a sound can take a channel yet, the software mixer can be handed it early with a delay
+bool AudioManager::isDue(const Voice& sound, Uint32 now)
+{
+	Sint32 wait = (Sint32)(sound.startTick - now);
+	return wait <= 0 || (m_mixer != nullptr && wait <= SCHEDULE_LOOKAHEAD_MS);
+}
+
+void AudioManager::playSound(int sfxInput, float sourceX, float sourceY, GameObject* source)
+{
+	startSound(sfxInput, sourceX, sourceY, source, false, m_scheduling ? m_scheduledStart : getTime());
+}
+
+void AudioManager::playSoundAt(int sfxInput, float sourceX, float sourceY, Uint32 startTime, GameObject* source)
+{
+	startSound(sfxInput, sourceX, sourceY, source, false, startTime);
+}
+
+void AudioManager::beginSchedule(Uint32 startTime)
+{
+	m_scheduling = true;
+	m_scheduledStart = startTime;
+}
+
+void AudioManager::endSchedule()
+{
+	m_scheduling = false;
+}
+
+int AudioManager::playLoop(int sfxInput, float sourceX, float sourceY, GameObject* source)
+{
+	return startSound(sfxInput, sourceX, sourceY, source, true, getTime());
+}
+
+void AudioManager::stopSound(int sound)
+{
+	int channel;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		std::map<int, Voice>::iterator it = m_sounds.find(sound);
+		if (it == m_sounds.end())
+			return;
+		channel = it->second.channel;
+		m_sounds.erase(it);
+	}
+	//channelFinished only frees the channel once the sound is gone
+	if (channel != -1)
+		haltChannel(channel);
+}
+
+//Either way channelFinished has run for the channel by the time this returns
+void AudioManager::haltChannel(int channel)
+{
+	if (m_mixer != nullptr)
+		m_mixer->halt(channel);
+	else
+	{
+		Mix_HaltChannel(channel);
+		pollFinishedChannels();
 	}
-	if (!Mix_SetDistance(channel, distance))
+}
+
+//delay is only honoured by the software mixer, SDL_mixer channels are never started ahead of time
+bool AudioManager::playChannel(int channel, int sfxInput, float gainLeft, float gainRight, Uint32 offset, bool loop, Uint32 delay)
+{
+	Mix_Chunk* chunk = getChunk(sfxInput);
+	if (m_mixer != nullptr)
+	{
+		AdpcmSound* compressed = getCompressed(sfxInput);
+		if (compressed != nullptr)
+			return m_mixer->playAdpcm(channel, compressed, gainLeft, gainRight, loop ? -1 : 0, offset, delay);
+		return m_mixer->play(channel, chunk, gainLeft, gainRight, loop ? -1 : 0, offset, delay);
+	}
+	if (!Mix_Volume(channel, MAX_VOLUME))
 	{
 		std::cout << "ERROR Mix_Volume: " << Mix_GetError() << std::endl;
 	}
-	if (Mix_PlayChannel(channel, m_audioFiles[sfxInput], 0) == -1)
+	//Distance and pan are both carried by the panning levels
+	if (!Mix_SetPanning(channel, (Uint8)(gainLeft * 255), (Uint8)(gainRight * 255)))
+	{
+		std::cout << "ERROR Mix_SetPanning: " << Mix_GetError() << std::endl;
+	}
+	int loops = loop ? -1 : 0;
+	if (offset > 0)
+	{
+		//SDL_mixer can't seek a chunk, so play the tail of it. A loop plays the tail once, then
+		//channelFinished makes it virtual and the next update restarts it from the top
+		Mix_Chunk& tail = m_tailChunks[channel];
+		tail.allocated = 0;
+		tail.abuf = chunk->abuf + offset * m_frameBytes;
+		tail.alen = chunk->alen - offset * m_frameBytes;
+		tail.volume = chunk->volume;
+		chunk = &tail;
+		loops = 0;
+	}
+	if (Mix_PlayChannel(channel, chunk, loops) == -1)
 	{
 		std::cout << "ERROR Mix_PlayChannel: " << Mix_GetError() << std::endl;
+		return false;
+	}
+	return true;
+}
+
+Uint32 AudioManager::getTime()
+{
+	return m_offline != nullptr ? m_offline->getTime() : SDL_GetTicks();
+}
+
+/*
+Once per frame: updates the voices, then when rendering offline mixes ticks worth of audio.
+*/
+void AudioManager::update(int ticks)
+{
+	TRACE_ZONE("audio", "AudioManager::update");
+	updateVoices();
+	updateMusic();
+	if (m_offline != nullptr)
+		m_offline->advance(ticks);
+}
+
+void AudioManager::driveUpdate(Component* component, int ticks)
+{
+	Uint32 now = SDL_GetTicks();
+	if (m_updateDriver != component && m_updateDriver != nullptr && now - m_updateDriven < UPDATE_DRIVER_TIMEOUT_MS)
+		return;
+	m_updateDriver = component;
+	m_updateDriven = now;
+	update(ticks);
+}
+
+void AudioManager::releaseUpdateDriver(Component* component)
+{
+	if (m_updateDriver == component)
+		m_updateDriver = nullptr;
+}
+
+bool AudioManager::recordOffline(const std::string& wavPath, bool keepSamples)
+{
+	if (m_offline == nullptr)
+	{
+		std::cout << "ERROR AudioManager isn't rendering offline" << std::endl;
+		return false;
+	}
+	return m_offline->record(wavPath, keepSamples);
+}
+
+void AudioManager::stopRecording()
+{
+	if (m_offline != nullptr)
+		m_offline->stopRecording();
+}
+
+//Interleaved stereo kept since recordOffline(..., true)
+const std::vector<Sint16>& AudioManager::getOfflineSamples()
+{
+	static const std::vector<Sint16> empty;
+	return m_offline != nullptr ? m_offline->getSamples() : empty;
+}
+
+bool AudioManager::isOffline()
+{
+	return m_offline != nullptr;
+}
+
+/*
+Follows every sound's source and recomputes distance attenuation and pan for all of
+them in one pass over m_spatial. Real sounds that went silent are virtualized, audible virtual sounds
+are promoted in priority order, and the levels that changed are pushed to the mixer.
+*/
+void AudioManager::updateVoices()
+{
+	//Voices and channels that ran out are reported here, on the game thread
+	if (m_mixer != nullptr)
+		m_mixer->pollFinished();
+	else
+		pollFinishedChannels();
+	freeRetiredChunks();
+
+	SpatialBatch& batch = m_spatial;
+	batch.sound.clear();
+	batch.x.clear();
+	batch.y.clear();
+	batch.gain.clear();
+	Uint32 now = getTime();
+	int realVoices = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		std::map<int, Voice>::iterator it = m_sounds.begin();
+		while (it != m_sounds.end())
+		{
+			Voice& sound = it->second;
+			//Virtual one-shots finish on the clock, since nothing is playing them. Signed, scheduled ones may not have started
+			if (sound.channel == -1 && !sound.loop && (Sint32)(now - sound.startTick) >= (Sint32)sound.length)
+			{
+				it = m_sounds.erase(it);
+				continue;
+			}
+			if (sound.source != nullptr)
+			{
+				sound.x = sound.source->getTransform()->getX();
+				sound.y = sound.source->getTransform()->getY();
+			}
+			if (sound.channel != -1)
+				++realVoices;
+			batch.sound.push_back(it->first);
+			batch.x.push_back(sound.x);
+			batch.y.push_back(sound.y);
+			batch.gain.push_back(sound.gain);
+			++it;
+		}
+	}
+
+	size_t count = batch.sound.size();
+	m_stats.setVoices(realVoices, (int)count - realVoices);
+	if (count == 0)
+		return;
+	batch.left.resize(count);
+	batch.right.resize(count);
+
+	float listenerX, listenerY;
+	bool hasListener = getListenerPosition(listenerX, listenerY);
+	float minDistance = m_minDistance;
+	for (size_t i = 0; i < count; ++i)
+	{
+		float dx = hasListener ? batch.x[i] - listenerX : 0.0f;
+		float dy = hasListener ? batch.y[i] - listenerY : 0.0f;
+		float distance = sqrt(dx * dx + dy * dy);
+		float attenuated = batch.gain[i] * attenuate(distance);
+		float pan = dx / (distance > minDistance ? distance : minDistance);
+		float left = attenuated * (pan > 0.0f ? 1.0f - pan : 1.0f);
+		float right = attenuated * (pan < 0.0f ? 1.0f + pan : 1.0f);
+		batch.left[i] = left > 1.0f ? 1.0f : left;
+		batch.right[i] = right > 1.0f ? 1.0f : right;
+	}
+
+	//Only touch channels whose levels actually moved
+	std::vector<int>& silenced = batch.silenced;
+	std::vector<int>& promoted = batch.promoted;
+	std::vector<int>& changed = batch.changed;
+	silenced.clear();
+	promoted.clear();
+	changed.clear();
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		for (size_t i = 0; i < count; ++i)
+		{
+			std::map<int, Voice>::iterator it = m_sounds.find(batch.sound[i]);
+			if (it == m_sounds.end())
+				continue;
+			Voice& sound = it->second;
+			sound.left = batch.left[i];
+			sound.right = batch.right[i];
+			sound.loudness = (int)(MAX_VOLUME * (sound.left > sound.right ? sound.left : sound.right));
+			if (sound.channel == -1)
+			{
+				if (sound.loudness >= VIRTUAL_LOUDNESS && isDue(sound, now))
+					promoted.push_back(it->first);
+				continue;
+			}
+			if (sound.virtualizing)
+				continue;
+			if (sound.loudness < VIRTUAL_LOUDNESS)
+			{
+				sound.virtualizing = true;
+				silenced.push_back(sound.channel);
+				continue;
+			}
+			int left = (int)(sound.left * 255);
+			int right = (int)(sound.right * 255);
+			if (left == sound.appliedLeft && right == sound.appliedRight)
+				continue;
+			sound.appliedLeft = left;
+			sound.appliedRight = right;
+			changed.push_back(i);
+		}
+		//Most important first, so the best candidates get the channels that are left
+		std::sort(promoted.begin(), promoted.end(), [this](int a, int b) {
+			const Voice& first = m_sounds[a];
+			const Voice& second = m_sounds[b];
+			if (first.priority != second.priority)
+				return first.priority > second.priority;
+			return first.loudness > second.loudness;
+		});
+	}
+
+	for (size_t i = 0; i < silenced.size(); ++i)
+		haltChannel(silenced[i]);
+	for (size_t i = 0; i < changed.size(); ++i)
+	{
+		int channel;
+		{
+			std::lock_guard<std::mutex> lock(m_voiceMutex);
+			std::map<int, Voice>::iterator it = m_sounds.find(batch.sound[changed[i]]);
+			if (it == m_sounds.end() || it->second.channel == -1)
+				continue;
+			channel = it->second.channel;
+		}
+		if (m_mixer != nullptr)
+			m_mixer->setGain(channel, batch.left[changed[i]], batch.right[changed[i]]);
+		else
+			Mix_SetPanning(channel, (Uint8)(batch.left[changed[i]] * 255), (Uint8)(batch.right[changed[i]] * 255));
+	}
+	for (size_t i = 0; i < promoted.size(); ++i)
+	{
+		//Same priority sounds only swap when clearly louder, so two close sources don't trade every frame
+		int channel = acquireChannel(promoted[i], VIRTUAL_HYSTERESIS);
+		if (channel == -1)
+			break;
+		startChannel(channel, promoted[i]);
+	}
+}
+
+//One-shots keep playing from the source's last position once it is destroyed, its loops stop
+void AudioManager::detachSource(GameObject* source)
+{
+	std::vector<int> loops;
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		for (std::map<int, Voice>::iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+		{
+			Voice& sound = it->second;
+			if (sound.source != source)
+				continue;
+			if (sound.loop)
+				loops.push_back(it->first);
+			sound.x = source->getTransform()->getX();
+			sound.y = source->getTransform()->getY();
+			sound.source = nullptr;
+		}
+	}
+	for (size_t i = 0; i < loops.size(); ++i)
+		stopSound(loops[i]);
+}
+
+void AudioManager::setAttenuation(AttenuationCurve curve, float minDistance, float maxDistance, float rolloff)
+{
+	m_attenuationCurve = curve;
+	m_minDistance = minDistance;
+	m_maxDistance = maxDistance > minDistance ? maxDistance : minDistance + 1.0f;
+	m_rolloff = rolloff;
+}
+
+//Switches sound effects between SDL_mixer's channels and the built-in SIMD mixer. Playing sounds go
+//virtual and resume where they were on the new mixer at the next update
+bool AudioManager::setSoftwareMixer(bool enabled)
+{
+	if (enabled == (m_mixer != nullptr))
+		return true;
+	//Offline rendering is always the software mixer
+	if (m_offline != nullptr)
+		return false;
+	if (!enabled)
+	{
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		if (!m_compressedFiles.empty())
+		{
+			std::cout << "ERROR SDL_mixer can't play compressed sound effects, keep the software mixer" << std::endl;
+			return false;
+		}
+	}
+
+	if (!enabled)
+	{
+		m_mixer->uninstall();
+		delete m_mixer;
+		m_mixer = nullptr;
+		resetVoices(MAX_CHANNELS);
+		return true;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_voiceMutex);
+		for (std::map<int, Voice>::iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+			it->second.virtualizing = it->second.channel != -1;
+	}
+	//The music decks keep playing on SDL_mixer
+	for (int i = 0; i < MAX_CHANNELS; ++i)
+		haltChannel(i);
+	resetVoices(MAX_SOFTWARE_VOICES);
+	SoftwareMixer* mixer = new SoftwareMixer();
+	mixer->setFinishedCallback(&AudioManager::channelFinished);
+	mixer->setStats(&m_stats);
+	m_mixer = mixer;
+	if (!mixer->install())
+	{
+		m_mixer = nullptr;
+		delete mixer;
+		resetVoices(MAX_CHANNELS);
+		return false;
 	}
+	return true;
 }
 
 void AudioManager::closeAudio()
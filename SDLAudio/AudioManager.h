@@ -1,11 +1,44 @@
 /*
 	Audio Manager
 
-	Uses Mix_PlayMusic for background soundtrack.
-	Cycles through 16 available channels for playing sound effects. (plays on first available channel)
+	Background music plays on one of two deck channels reserved after the sound effect channels. Each
+	track is a MusicStream: the loader thread decodes it a block at a time into a ring of MUSIC_STREAM_MS,
+	and the deck's channel effect plays from that ring, so no track is ever decoded whole and the audio
+	thread never decodes. Switching tracks crossfades from one deck to the other (setCrossfade). Only the
+	menu track is opened at startup. Scenes preload the track they switch to next, which fills its ring
+	before playMusic is called, and a track is closed once it has faded out. Tracks MusicStream can't
+	decode (mp3) fall back to Mix_PlayMusic. SDL_mixer has a single music stream, so switching between
+	those fades one out before the next fades in.
+	Sound effects are virtual voices (m_sounds) and only the audible ones hold one of 16 real channels.
+	Free channels are kept in a list refilled as channels finish, and when the pool is full a sound
+	takes the channel of the lowest priority, then quietest, real voice (priorities live in AudioBank.h).
+	Sounds that lose their channel or fall out of range keep running on the clock without any mixing and
+	are promoted back, resuming at their current position, once they are audible and win a channel.
+	Looping emitters (playLoop) stay virtual for as long as they are out of range.
+	A sound effect requested again within DEDUP_WINDOW_MS (ten arrows in one frame) is merged into the
+	loudest copy with the gains summed, and each sound has an instance limit in AudioBank.h.
+	Sound effects are mixed by SoftwareMixer on MAX_SOFTWARE_VOICES voices, so the game thread never takes
+	the audio device lock for them. setSoftwareMixer(false), or a device it can't mix for, uses 16 SDL_mixer
+	channels instead, whose finished callbacks are passed to the game thread through m_finishedChannels.
 	Listener is a pointer to the player game object.
 	Audio source is played by a game object with its x and y position.
-	The manager calculates the distance between the listener and source to apply distanced effect by altering the volume.
+	Every frame (update, driven by one AudioListener or AudioSource, see driveUpdate) the manager follows
+	each playing sound's source and recomputes its distance attenuation (configurable curve) and stereo
+	pan in one batched pass.
+
+	Assets are loaded on a background loader thread. Music is queued at startup, sound effects are
+	loaded the first time they are played or when a scene preloads them. Until an asset is ready,
+	playSound skips it and playMusic starts the track once it finishes loading.
+	If PATH_SFX_PACK exists, sound effects are mapped from it instead and are ready immediately.
+	With the software mixer, setCompressedEffects keeps sound effects as IMA-ADPCM (Adpcm.h) instead.
+	playSoundAt schedules a sound for a time on the manager's clock, used for network events so remote
+	sounds keep the spacing they had on the sender. Sounds due later wait as virtual voices, the software
+	mixer starts them to the sample with a delay, SDL_mixer channels on the first update past the time.
+	Sounds scheduled in the past start partway through.
+
+	setOfflineRender runs the manager without a device: the software mixer renders sound effects in fixed
+	blocks as update() advances the simulation, into memory or a WAV file, for regression tests and
+	headless servers. Virtual sounds run on the rendered clock instead of SDL_GetTicks there.
 
 	*Latest Update - March 29, 2018
 		- Added fixes to play audio on mac
@@ -24,31 +57,195 @@
 #include "GLHeaders.h"
 #include <iostream>
 #include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 #include "AudioBank.h"
+#include "AudioPack.h"
+#include "SoftwareMixer.h"
+#include "SpscQueue.h"
+#include "MusicStream.h"
+#include "AudioStats.h"
+#include "OfflineRenderer.h"
 #include "HelperFunctions.h"
 #include "GameObject.h"
 #include "SpriteRendererManager.h"
 #include "Transform.h"
 
 #define MAX_CHANNELS 16
+#define MUSIC_DECKS 2
+#define MUSIC_CROSSFADE_MS 1500
+#define MUSIC_REFILL_MS 100 //how often the loader thread tops up the music streams
 #define MIN_DISTANCE 25
 #define MAX_DISTANCE 40
 #define MAX_VOLUME 128
-#define DISTANCE_OFFSET 4
-#define DISTANCE_VOLUME 100
+#define MAX_VIRTUAL_VOICES 128
+#define UPDATE_DRIVER_TIMEOUT_MS 100 //another audio component takes over update if the driving one stops updating
+#define VIRTUAL_LOUDNESS 1 //real channels are only spent on sounds at least this loud (0-128)
+#define VIRTUAL_HYSTERESIS 8 //louder than this over a same priority real sound to take its channel
+#define VIRTUAL_RESUME_MS 20 //promoted sounds closer to their start than this play from the top
+#define DEDUP_WINDOW_MS 30 //the same sound effect started this close together is merged into one voice
+#define DEDUP_MAX_GAIN 2.0f
+#define SCHEDULE_LOOKAHEAD_MS 50 //software mixer voices are started this far ahead of a scheduled time
+#define FINISHED_CHANNEL_QUEUE_SIZE 64 //a channel finishes at most once between two polls, so MAX_CHANNELS would do
+
+enum AttenuationCurve
+{
+	ATTENUATION_LINEAR, //full volume up to the min distance, fading linearly to silence at the max distance
+	ATTENUATION_INVERSE, //min / (min + rolloff * (distance - min)), cut off at the max distance
+	ATTENUATION_EXPONENTIAL //(distance / min) ^ -rolloff, cut off at the max distance
+};
+
+//A playing sound, real while it holds a channel and virtual otherwise
+struct Voice
+{
+	int sfx;
+	int priority;
+	int loudness;
+	Uint32 startTick; //when playback started (or is scheduled to), the position of a virtual sound is derived from it
+	Uint32 length; //milliseconds
+	bool loop;
+	int channel; //-1 while virtual
+	bool virtualizing; //halted to free the channel, channelFinished keeps the sound
+	GameObject* source; //followed every frame, nullptr for fixed positions
+	float x;
+	float y;
+	float gain;
+	float left;
+	float right;
+	int appliedLeft; //panning levels last sent to the mixer
+	int appliedRight;
+};
+
+//Struct of arrays filled once per frame for the spatial pass
+struct SpatialBatch
+{
+	std::vector<int> sound;
+	std::vector<float> x;
+	std::vector<float> y;
+	std::vector<float> gain;
+	std::vector<float> left;
+	std::vector<float> right;
+	std::vector<int> changed;
+	std::vector<int> silenced;
+	std::vector<int> promoted;
+};
+
+enum AudioLoadState
+{
+	AUDIO_UNLOADED,
+	AUDIO_LOADING,
+	AUDIO_READY,
+	AUDIO_FAILED
+};
 
 class AudioManager
 {
 private:
 	static AudioManager* s_instance;
+	static bool s_offline;
+	OfflineRenderer* m_offline;
 
 	GameObject* m_listener;
+	//The audio component whose onUpdate runs update this frame, so several components still update once
+	Component* m_updateDriver;
+	Uint32 m_updateDriven;
+	bool m_hasListenerPosition;
+	float m_listenerX;
+	float m_listenerY;
+	bool getListenerPosition(float& x, float& y);
+	AudioStats m_stats;
+	static void callbackProbe(int channel, void* stream, int len, void* udata);
+	//Filled by the loader thread, guarded by m_loadMutex
 	std::map<int, Mix_Chunk*> m_audioFiles;
 	std::map<int, Mix_Music*> m_musicFiles;
+	//Music played on the deck channels. The loader thread refills them outside the lock, on its own reference
+	std::map<int, std::shared_ptr<MusicStream>> m_musicStreams;
+	//Output format the streams convert to
+	Uint16 m_outputFormat;
+	int m_outputChannels;
+	//What a deck channel actually plays, a looping silent chunk whose samples deckEffect replaces
+	std::vector<Uint8> m_deckSilence;
+	Mix_Chunk m_deckChunk;
+	static void deckEffect(int channel, void* stream, int len, void* udata);
+	std::map<int, AudioLoadState> m_loadStates;
+	//IMA-ADPCM copies of sound effects, m_audioFiles then only holds a placeholder with the length
+	std::map<int, AdpcmSound*> m_compressedFiles;
+	bool m_compressEffects;
+	Mix_Chunk* compressChunk(int sfxInput, Mix_Chunk* chunk);
+	AdpcmSound* getCompressed(int sfxInput);
+	//PCM chunks replaced while the mixer may still be reading them, freed once it passes the fence. Game thread only
+	std::vector<std::pair<Uint32, Mix_Chunk*>> m_retiredChunks;
+	void freeRetiredChunks();
+	AudioPack m_pack;
 
-	float m_distance;
-	float m_listenerX;
-	float m_listenerY;
+	std::thread m_loaderThread;
+	std::mutex m_loadMutex;
+	std::condition_variable m_loadReady;
+	std::deque<int> m_loadRequests;
+	bool m_loaderRunning;
+	int m_pendingMusic;
+	int m_currentMusic;
+	int m_musicDeck;
+	int m_deckMusic[MUSIC_DECKS];
+	int m_crossfade;
+	//Tracks faded out by a switch, freed by updateMusic once no deck plays them
+	std::set<int> m_retiredMusic;
+	//Streamed track waiting for the previous one to fade out
+	int m_pendingStream;
+	void startMusic(int musicInput);
+	void updateMusic();
+
+	//Guards m_sounds, m_channels and m_freeChannels. channelFinished only runs on the game thread, the audio
+	//thread never takes it
+	std::mutex m_voiceMutex;
+	std::map<int, Voice> m_sounds;
+	int m_nextSound;
+	//Sound id per SDL_mixer channel (or software mixer voice when m_mixer is installed), -1 when free
+	std::vector<int> m_channels;
+	std::vector<int> m_freeChannels;
+	//Per channel chunk pointing into the middle of a sound, used to resume a promoted sound
+	std::vector<Mix_Chunk> m_tailChunks;
+	SoftwareMixer* m_mixer;
+	int m_frequency;
+	int m_frameBytes;
+
+	static void channelFinished(int channel);
+	static void sdlChannelFinished(int channel);
+	//SDL_mixer channels that stopped, pushed under the device lock (audio thread or Mix_HaltChannel) and
+	//popped by pollFinishedChannels on the game thread
+	SpscQueue<int, FINISHED_CHANNEL_QUEUE_SIZE> m_finishedChannels;
+	void pollFinishedChannels();
+	void resetVoices(int count);
+	Uint32 chunkLength(Mix_Chunk* chunk);
+	int acquireChannel(int id, int margin);
+	bool startChannel(int channel, int id);
+	int startSound(int sfxInput, float x, float y, GameObject* source, bool loop, Uint32 startTime);
+	bool isDue(const Voice& sound, Uint32 now);
+	bool m_scheduling;
+	Uint32 m_scheduledStart;
+	void mergeSound(Voice& kept, const Voice& request);
+	void haltChannel(int channel);
+	void requestLoad(int audioInput);
+	void loaderThread();
+	void loadAsset(int audioInput);
+	void updateVoices();
+	Mix_Chunk* getChunk(int sfxInput);
+
+	SpatialBatch m_spatial;
+	AttenuationCurve m_attenuationCurve;
+	float m_minDistance;
+	float m_maxDistance;
+	float m_rolloff;
+	float attenuate(float distance);
+	bool spatialize(float sourceX, float sourceY, float gain, float& left, float& right);
 
 	AudioManager();
 	~AudioManager();
@@ -56,11 +253,64 @@ private:
 public:
 	static AudioManager* getInstance();
 	static void release();
+	/*
+	Runs without an output device, sound effects are mixed into memory or a WAV file as update() is
+	called. Music isn't rendered. Call before the first getInstance.
+	*/
+	static void setOfflineRender(bool enabled);
 	void setListener(GameObject* listenerObject);
+	void removeListener(GameObject* listenerObject);
+	/*
+	Fixed listener position used while there is no listener object, for tools and benchmarks.
+	*/
+	void setListenerPosition(float x, float y);
+	void preload(const std::vector<int>& audioInputs);
+	AudioLoadState getLoadState(int audioInput);
 	void playMusic(int musicInput);
 	void pauseMusic();
 	void resumeMusic();
-	void playSound(int sfxInput, float x, float y);
-	void playChannel(int channel, int volume, int distance, int sfxInput);
+	void setCrossfade(int milliseconds);
+	void playSound(int sfxInput, float x, float y, GameObject* source = nullptr);
+	/*
+	Plays a sound starting at startTime on getTime's clock. A time in the past starts it that far in.
+	*/
+	void playSoundAt(int sfxInput, float x, float y, Uint32 startTime, GameObject* source = nullptr);
+	/*
+	Until endSchedule, every playSound is scheduled at startTime. Lets code that doesn't know about
+	the network (animations, health changes) play a remote event's sounds at the event's time.
+	*/
+	void beginSchedule(Uint32 startTime);
+	void endSchedule();
+	/*
+	Milliseconds on the clock sounds run on: SDL_GetTicks, or the amount rendered when offline.
+	*/
+	Uint32 getTime();
+	/*
+	Plays a sound until stopSound, returns its id or -1. Costs nothing while the emitter is out of range.
+	*/
+	int playLoop(int sfxInput, float x, float y, GameObject* source = nullptr);
+	void stopSound(int sound);
+	bool playChannel(int channel, int sfxInput, float gainLeft, float gainRight, Uint32 offset, bool loop, Uint32 delay = 0);
+	/*
+	Reports finished voices, runs the spatial pass and music switches, and advances the offline clock
+	by ticks. Must run once per frame: in game driveUpdate does that, tools without components call it.
+	*/
+	void update(int ticks);
+	/*
+	Called from every AudioListener and AudioSource onUpdate. Only one of them, the driver, runs update,
+	and when the driver is destroyed or stops updating for UPDATE_DRIVER_TIMEOUT_MS the next caller
+	takes over.
+	*/
+	void driveUpdate(Component* component, int ticks);
+	void releaseUpdateDriver(Component* component);
+	void detachSource(GameObject* source);
+	void setAttenuation(AttenuationCurve curve, float minDistance, float maxDistance, float rolloff);
+	bool setSoftwareMixer(bool enabled);
+	bool setCompressedEffects(bool enabled);
+	AudioStats& getStats();
+	bool recordOffline(const std::string& wavPath, bool keepSamples);
+	void stopRecording();
+	const std::vector<Sint16>& getOfflineSamples();
+	bool isOffline();
 	void closeAudio();
 };
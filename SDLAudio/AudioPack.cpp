@@ -0,0 +1,207 @@
+#include "AudioPack.h"
+#include <iostream>
+#include <fstream>
+
+#if defined _WIN32 || defined _WIN64
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+AudioPack::AudioPack()
+{
+	m_data = NULL;
+	m_size = 0;
+#if defined _WIN32 || defined _WIN64
+	m_file = INVALID_HANDLE_VALUE;
+	m_mapping = NULL;
+#else
+	m_file = -1;
+#endif
+}
+
+AudioPack::~AudioPack()
+{
+	close();
+}
+
+bool AudioPack::open(const std::string& path, int frequency, Uint16 format, int channels)
+{
+	close();
+
+#if defined _WIN32 || defined _WIN64
+	m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	m_size = (size_t)size.QuadPart;
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (m_mapping == NULL)
+	{
+		close();
+		return false;
+	}
+	m_data = (Uint8*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (m_data == NULL)
+	{
+		close();
+		return false;
+	}
+#else
+	m_file = ::open(path.c_str(), O_RDONLY);
+	if (m_file == -1)
+		return false;
+	struct stat info;
+	if (fstat(m_file, &info) == -1 || info.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	m_size = (size_t)info.st_size;
+	void* mapping = mmap(NULL, m_size, PROT_READ, MAP_SHARED, m_file, 0);
+	if (mapping == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	m_data = (Uint8*)mapping;
+#endif
+
+	if (m_size < sizeof(AudioPackHeader))
+	{
+		std::cout << "ERROR AudioPack too small: " << path << std::endl;
+		close();
+		return false;
+	}
+	const AudioPackHeader* header = (const AudioPackHeader*)m_data;
+	if (header->magic != AUDIO_PACK_MAGIC || header->version != AUDIO_PACK_VERSION)
+	{
+		std::cout << "ERROR AudioPack bad header: " << path << std::endl;
+		close();
+		return false;
+	}
+	if (header->frequency != (Uint32)frequency || header->format != format || header->channels != channels)
+	{
+		std::cout << "AudioPack " << path << " was built for another mixer format, rebuild it" << std::endl;
+		close();
+		return false;
+	}
+	if (m_size < sizeof(AudioPackHeader) + (size_t)header->count * sizeof(AudioPackEntry))
+	{
+		std::cout << "ERROR AudioPack truncated: " << path << std::endl;
+		close();
+		return false;
+	}
+
+	const AudioPackEntry* entries = (const AudioPackEntry*)(m_data + sizeof(AudioPackHeader));
+	for (Uint32 i = 0; i < header->count; ++i)
+	{
+		if ((size_t)entries[i].offset + entries[i].length > m_size)
+		{
+			std::cout << "ERROR AudioPack entry " << entries[i].id << " out of bounds" << std::endl;
+			continue;
+		}
+		Mix_Chunk& chunk = m_chunks[entries[i].id];
+		chunk.allocated = 0;
+		//The mapping is read-only, the mixer never writes to abuf
+		chunk.abuf = m_data + entries[i].offset;
+		chunk.alen = entries[i].length;
+		chunk.volume = MIX_MAX_VOLUME;
+	}
+	return true;
+}
+
+void AudioPack::close()
+{
+	m_chunks.clear();
+#if defined _WIN32 || defined _WIN64
+	if (m_data != NULL)
+		UnmapViewOfFile(m_data);
+	if (m_mapping != NULL)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+#else
+	if (m_data != NULL)
+		munmap(m_data, m_size);
+	if (m_file != -1)
+		::close(m_file);
+	m_file = -1;
+#endif
+	m_data = NULL;
+	m_size = 0;
+}
+
+bool AudioPack::isOpen()
+{
+	return m_data != NULL;
+}
+
+Mix_Chunk* AudioPack::getChunk(int id)
+{
+	std::map<int, Mix_Chunk>::iterator it = m_chunks.find(id);
+	return it != m_chunks.end() ? &it->second : NULL;
+}
+
+std::vector<int> AudioPack::getIds()
+{
+	std::vector<int> ids;
+	for (std::map<int, Mix_Chunk>::iterator it = m_chunks.begin(); it != m_chunks.end(); ++it)
+		ids.push_back(it->first);
+	return ids;
+}
+
+bool AudioPack::build(const std::string& path, const std::map<int, Mix_Chunk*>& chunks, int frequency, Uint16 format, int channels)
+{
+	std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		std::cout << "ERROR AudioPack can't write " << path << std::endl;
+		return false;
+	}
+
+	AudioPackHeader header;
+	header.magic = AUDIO_PACK_MAGIC;
+	header.version = AUDIO_PACK_VERSION;
+	header.frequency = frequency;
+	header.format = format;
+	header.channels = channels;
+	header.count = (Uint32)chunks.size();
+
+	//Samples start after the entry table, each one aligned so mixing kernels can use aligned loads
+	std::vector<AudioPackEntry> entries;
+	Uint32 offset = sizeof(AudioPackHeader) + header.count * sizeof(AudioPackEntry);
+	for (std::map<int, Mix_Chunk*>::const_iterator it = chunks.begin(); it != chunks.end(); ++it)
+	{
+		offset = (offset + AUDIO_PACK_ALIGNMENT - 1) & ~(Uint32)(AUDIO_PACK_ALIGNMENT - 1);
+		AudioPackEntry entry;
+		entry.id = it->first;
+		entry.offset = offset;
+		entry.length = it->second->alen;
+		entries.push_back(entry);
+		offset += entry.length;
+	}
+
+	file.write((const char*)&header, sizeof(header));
+	if (!entries.empty())
+		file.write((const char*)&entries[0], entries.size() * sizeof(AudioPackEntry));
+	size_t i = 0;
+	for (std::map<int, Mix_Chunk*>::const_iterator it = chunks.begin(); it != chunks.end(); ++it, ++i)
+	{
+		std::streamoff padding = entries[i].offset - (Uint32)file.tellp();
+		for (std::streamoff p = 0; p < padding; ++p)
+			file.put(0);
+		file.write((const char*)it->second->abuf, it->second->alen);
+	}
+	return (bool)file;
+}
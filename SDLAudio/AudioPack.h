@@ -0,0 +1,80 @@
+/*
+	Audio Pack
+
+	A single file holding every sound effect as raw PCM, already converted to the format the mixer is
+	opened with. At runtime the file is memory mapped read-only and each Mix_Chunk points straight into
+	the mapping, so there is no decoding or conversion at startup and the pages are shared by every
+	process that maps the same pack.
+
+	Packs must be built for the format in AudioBank.h (AUDIO_FREQUENCY, AUDIO_FORMAT, AUDIO_CHANNELS).
+	Layout: AudioPackHeader, AudioPackEntry[count], then the sample data of every entry, each aligned
+	to AUDIO_PACK_ALIGNMENT bytes. Values are stored in the byte order of the machine that built it.
+
+	Built offline by Tools/AudioPackBuilder.
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include <string>
+#include <vector>
+#include <map>
+#include "AudioBank.h"
+
+#define AUDIO_PACK_MAGIC 0x4B415050 //"PPAK"
+#define AUDIO_PACK_VERSION 1
+#define AUDIO_PACK_ALIGNMENT 16
+
+struct AudioPackHeader
+{
+	Uint32 magic;
+	Uint32 version;
+	Uint32 frequency;
+	Uint16 format;
+	Uint16 channels;
+	Uint32 count;
+};
+
+struct AudioPackEntry
+{
+	Sint32 id;
+	Uint32 offset;
+	Uint32 length;
+};
+
+class AudioPack
+{
+private:
+	Uint8* m_data;
+	size_t m_size;
+#if defined _WIN32 || defined _WIN64
+	void* m_file;
+	void* m_mapping;
+#else
+	int m_file;
+#endif
+	//Chunks are owned here, never hand them to Mix_FreeChunk
+	std::map<int, Mix_Chunk> m_chunks;
+
+public:
+	AudioPack();
+	~AudioPack();
+
+	/*
+	Maps the pack and validates it against the mixer format. Returns false if the file is missing,
+	malformed or was built for another format, in which case the caller should load WAV files instead.
+	*/
+	bool open(const std::string& path, int frequency, Uint16 format, int channels);
+	void close();
+	bool isOpen();
+
+	/*
+	Returns the chunk for an AudioBank id, or NULL if the pack doesn't contain it.
+	*/
+	Mix_Chunk* getChunk(int id);
+	std::vector<int> getIds();
+
+	/*
+	Writes a pack from chunks that were loaded with the mixer opened in the target format.
+	*/
+	static bool build(const std::string& path, const std::map<int, Mix_Chunk*>& chunks, int frequency, Uint16 format, int channels);
+};
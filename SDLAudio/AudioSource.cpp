@@ -8,10 +8,30 @@ AudioSource::AudioSource(GameObject* gameObject) : Component(gameObject)
 
 AudioSource::~AudioSource()
 {
+	//One-shots still playing keep the last position instead of following a dead object, loops stop
+	AudioManager::getInstance()->detachSource(gameObject);
+	AudioManager::getInstance()->releaseUpdateDriver(this);
+}
+
+//Keeps sounds updating in scenes without a listener
+void AudioSource::onUpdate(int ticks)
+{
+	AudioManager::getInstance()->driveUpdate(this, ticks);
 }
 
 
 void AudioSource::playSFX(int sfxFile)
 {
-	AudioManager::getInstance()->playSound(sfxFile, gameObject->getTransform()->getX(), gameObject->getTransform()->getY());
+	AudioManager::getInstance()->playSound(sfxFile, gameObject->getTransform()->getX(), gameObject->getTransform()->getY(), gameObject);
+}
+
+//Ambient emitters (torches, traps) loop until stopped or the object is destroyed
+int AudioSource::playLoop(int sfxFile)
+{
+	return AudioManager::getInstance()->playLoop(sfxFile, gameObject->getTransform()->getX(), gameObject->getTransform()->getY(), gameObject);
+}
+
+void AudioSource::stopSound(int sound)
+{
+	AudioManager::getInstance()->stopSound(sound);
 }
@@ -11,7 +11,9 @@ public:
 	AudioSource(GameObject* gameObject);
 	~AudioSource();
 	void onStart() {};
-	void onUpdate(int ticks) {};
+	void onUpdate(int ticks);
 	void onEnd() {};
 	void playSFX(int sfxFile);
+	int playLoop(int sfxFile);
+	void stopSound(int sound);
 };
@@ -0,0 +1,140 @@
+#include "AudioStats.h"
+
+AudioStats::AudioStats()
+{
+	m_bufferPeriodUs = 0;
+	reset();
+}
+
+void AudioStats::reset()
+{
+	m_callbacks = 0;
+	m_underruns = 0;
+	for (int i = 0; i < AUDIO_STATS_BUCKETS; ++i)
+		m_durationHistogram[i] = 0;
+	m_totalDuration = 0;
+	m_maxDuration = 0;
+	m_timedCallbacks = 0;
+	m_lastCallback = 0;
+	m_realVoices = 0;
+	m_virtualVoices = 0;
+	m_stolenVoices = 0;
+	m_mergedSounds = 0;
+	m_droppedSounds = 0;
+	m_queueOverflows = 0;
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	m_loadTimes.clear();
+}
+
+void AudioStats::setBufferPeriod(int frames, int frequency)
+{
+	m_bufferPeriodUs = frequency > 0 ? frames * 1000000.0 / frequency : 0;
+}
+
+void AudioStats::markCallback()
+{
+	Uint64 now = SDL_GetPerformanceCounter();
+	if (m_lastCallback != 0 && m_bufferPeriodUs > 0)
+	{
+		double intervalUs = (now - m_lastCallback) * 1000000.0 / SDL_GetPerformanceFrequency();
+		if (intervalUs > m_bufferPeriodUs * AUDIO_UNDERRUN_FACTOR)
+			m_underruns++;
+	}
+	m_lastCallback = now;
+	m_callbacks++;
+}
+
+void AudioStats::timeCallback(Uint64 start, Uint64 end)
+{
+	Uint64 duration = end - start;
+	Uint64 us = duration * 1000000 / SDL_GetPerformanceFrequency();
+	int bucket = 0;
+	for (Uint64 limit = 16; bucket < AUDIO_STATS_BUCKETS - 1 && us >= limit; limit *= 2)
+		bucket++;
+	m_durationHistogram[bucket]++;
+	m_totalDuration += duration;
+	m_timedCallbacks++;
+	//Only the audio thread writes it, so a plain compare and store is enough
+	if (duration > m_maxDuration)
+		m_maxDuration = duration;
+}
+
+void AudioStats::setVoices(int real, int virtualVoices)
+{
+	m_realVoices = real;
+	m_virtualVoices = virtualVoices;
+}
+
+void AudioStats::countStolen()
+{
+	m_stolenVoices++;
+}
+
+void AudioStats::countMerged()
+{
+	m_mergedSounds++;
+}
+
+void AudioStats::countDropped()
+{
+	m_droppedSounds++;
+}
+
+void AudioStats::countQueueOverflow()
+{
+	m_queueOverflows++;
+}
+
+void AudioStats::recordLoad(int audioInput, Uint32 milliseconds)
+{
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	m_loadTimes[audioInput] = milliseconds;
+}
+
+AudioStatsSnapshot AudioStats::snapshot()
+{
+	AudioStatsSnapshot snapshot;
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	snapshot.callbacks = m_callbacks;
+	snapshot.underruns = m_underruns;
+	for (int i = 0; i < AUDIO_STATS_BUCKETS; ++i)
+		snapshot.durationHistogram[i] = m_durationHistogram[i];
+	Uint64 timed = m_timedCallbacks;
+	snapshot.averageDurationUs = timed > 0 ? m_totalDuration * 1000000.0 / frequency / timed : 0;
+	snapshot.maxDurationUs = m_maxDuration * 1000000.0 / frequency;
+	snapshot.bufferPeriodUs = m_bufferPeriodUs;
+	snapshot.realVoices = m_realVoices;
+	snapshot.virtualVoices = m_virtualVoices;
+	snapshot.stolenVoices = m_stolenVoices;
+	snapshot.mergedSounds = m_mergedSounds;
+	snapshot.droppedSounds = m_droppedSounds;
+	snapshot.queueOverflows = m_queueOverflows;
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	snapshot.loadTimes = m_loadTimes;
+	return snapshot;
+}
+
+void AudioStats::print(std::ostream& out)
+{
+	AudioStatsSnapshot stats = snapshot();
+	out << "Audio callbacks: " << stats.callbacks << ", underruns: " << stats.underruns
+		<< ", buffer period: " << stats.bufferPeriodUs << "us" << std::endl;
+	out << "Mix time: average " << stats.averageDurationUs << "us, max " << stats.maxDurationUs << "us" << std::endl;
+	Uint64 limit = 16;
+	for (int i = 0; i < AUDIO_STATS_BUCKETS; ++i, limit *= 2)
+	{
+		if (stats.durationHistogram[i] == 0)
+			continue;
+		if (i == AUDIO_STATS_BUCKETS - 1)
+			out << "  >= " << limit / 2 << "us: ";
+		else
+			out << "  < " << limit << "us: ";
+		out << stats.durationHistogram[i] << std::endl;
+	}
+	out << "Voices: " << stats.realVoices << " real, " << stats.virtualVoices << " virtual, "
+		<< stats.stolenVoices << " stolen, " << stats.mergedSounds << " merged, " << stats.droppedSounds << " dropped" << std::endl;
+	if (stats.queueOverflows > 0)
+		out << "Queue overflows: " << stats.queueOverflows << std::endl;
+	for (std::map<int, Uint32>::iterator it = stats.loadTimes.begin(); it != stats.loadTimes.end(); ++it)
+		out << "  asset " << it->first << " loaded in " << it->second << "ms" << std::endl;
+}
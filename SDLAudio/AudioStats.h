@@ -0,0 +1,90 @@
+/*
+	Audio Stats
+
+	Counters the AudioManager keeps about itself, cheap enough to leave on in release builds.
+	The audio thread only touches atomics, everything else is written from the game or loader thread.
+
+	- Callback timing: how long the mixing we own (the software mixer's postmix) takes per callback,
+	  as a histogram of power-of-two microsecond buckets.
+	- Underruns: callbacks that arrived later than AUDIO_UNDERRUN_FACTOR buffer periods after the
+	  previous one, which means the device ran dry while we were late.
+	- Voices: real and virtual sounds at the last update, and running totals of stolen, merged and
+	  dropped sounds.
+	- Queue overflows: mixer commands and finished channels lost to a full lock-free ring, which means
+	  the audio thread or the game thread stalled. Kept apart from dropped sounds, which are a policy.
+	- Load times per asset, measured on the loader thread.
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <iostream>
+
+#define AUDIO_STATS_BUCKETS 16 //bucket 0 is under 16us, each next one doubles, the last one is open ended
+#define AUDIO_UNDERRUN_FACTOR 1.5
+
+struct AudioStatsSnapshot
+{
+	Uint64 callbacks;
+	Uint64 underruns;
+	Uint64 durationHistogram[AUDIO_STATS_BUCKETS];
+	double averageDurationUs;
+	double maxDurationUs;
+	double bufferPeriodUs;
+	int realVoices;
+	int virtualVoices;
+	Uint64 stolenVoices;
+	Uint64 mergedSounds;
+	Uint64 droppedSounds;
+	Uint64 queueOverflows;
+	std::map<int, Uint32> loadTimes; //milliseconds
+};
+
+class AudioStats
+{
+private:
+	std::atomic<Uint64> m_callbacks;
+	std::atomic<Uint64> m_underruns;
+	std::atomic<Uint64> m_durationHistogram[AUDIO_STATS_BUCKETS];
+	std::atomic<Uint64> m_totalDuration; //performance counter ticks
+	std::atomic<Uint64> m_maxDuration;
+	std::atomic<Uint64> m_timedCallbacks;
+	Uint64 m_lastCallback; //audio thread only
+	double m_bufferPeriodUs;
+
+	std::atomic<int> m_realVoices;
+	std::atomic<int> m_virtualVoices;
+	std::atomic<Uint64> m_stolenVoices;
+	std::atomic<Uint64> m_mergedSounds;
+	std::atomic<Uint64> m_droppedSounds;
+	std::atomic<Uint64> m_queueOverflows;
+
+	std::mutex m_loadMutex;
+	std::map<int, Uint32> m_loadTimes;
+
+public:
+	AudioStats();
+
+	void reset();
+	void setBufferPeriod(int frames, int frequency);
+
+	/*
+	Audio thread. markCallback is called once per callback, timeCallback with the performance
+	counter values around the work done in it.
+	*/
+	void markCallback();
+	void timeCallback(Uint64 start, Uint64 end);
+
+	void setVoices(int real, int virtualVoices);
+	void countStolen();
+	void countMerged();
+	void countDropped();
+	//Any thread, a push to a full SpscQueue
+	void countQueueOverflow();
+	void recordLoad(int audioInput, Uint32 milliseconds);
+
+	AudioStatsSnapshot snapshot();
+	void print(std::ostream& out);
+};
@@ -0,0 +1,103 @@
+#include "MusicStream.h"
+#include "Tracer.h"
+#include <iostream>
+#include <cstring>
+//Single file library, the decoder is compiled into this translation unit
+#include "stb_vorbis.c"
+
+MusicStream::MusicStream()
+{
+	m_vorbis = NULL;
+	m_sourceChannels = 0;
+	m_convert = NULL;
+	m_frameBytes = 0;
+	m_silence = 0;
+	m_written = 0;
+	m_read = 0;
+}
+
+MusicStream* MusicStream::open(const std::string& path, int frequency, Uint16 format, int channels)
+{
+	int error = 0;
+	stb_vorbis* vorbis = stb_vorbis_open_filename(path.c_str(), &error, NULL);
+	if (vorbis == NULL)
+		return nullptr;
+	stb_vorbis_info info = stb_vorbis_get_info(vorbis);
+	SDL_AudioStream* convert = SDL_NewAudioStream(AUDIO_S16SYS, (Uint8)info.channels, (int)info.sample_rate, format, (Uint8)channels, frequency);
+	if (convert == NULL)
+	{
+		std::cout << "ERROR SDL_NewAudioStream " << path << ": " << SDL_GetError() << std::endl;
+		stb_vorbis_close(vorbis);
+		return nullptr;
+	}
+
+	MusicStream* stream = new MusicStream();
+	stream->m_vorbis = vorbis;
+	stream->m_sourceChannels = info.channels;
+	stream->m_decoded.resize(MUSIC_DECODE_FRAMES * info.channels);
+	stream->m_convert = convert;
+	stream->m_frameBytes = (SDL_AUDIO_BITSIZE(format) / 8) * channels;
+	stream->m_silence = SDL_AUDIO_ISSIGNED(format) ? 0 : 0x80;
+	stream->m_ring.resize((size_t)frequency * MUSIC_STREAM_MS / 1000 * stream->m_frameBytes);
+	return stream;
+}
+
+MusicStream::~MusicStream()
+{
+	SDL_FreeAudioStream(m_convert);
+	stb_vorbis_close(m_vorbis);
+}
+
+bool MusicStream::refill()
+{
+	TRACE_ZONE("audio", "MusicStream::refill");
+	size_t size = m_ring.size();
+	bool restarted = false;
+	while (true)
+	{
+		size_t written = m_written.load(std::memory_order_relaxed);
+		size_t space = size - (written - m_read.load(std::memory_order_acquire));
+		if (space == 0)
+			return true;
+
+		//Hand over what is already converted, up to the end of the ring at most
+		size_t offset = written % size;
+		size_t bytes = space < size - offset ? space : size - offset;
+		int available = SDL_AudioStreamAvailable(m_convert);
+		if ((size_t)available < bytes)
+			bytes = available;
+		bytes -= bytes % m_frameBytes;
+		if (bytes > 0)
+		{
+			SDL_AudioStreamGet(m_convert, &m_ring[offset], (int)bytes);
+			m_written.store(written + bytes, std::memory_order_release);
+			continue;
+		}
+
+		int frames = stb_vorbis_get_samples_short_interleaved(m_vorbis, m_sourceChannels, &m_decoded[0], (int)m_decoded.size());
+		if (frames == 0)
+		{
+			//End of the track. A second end without any audio in between means the file is broken
+			if (restarted || !stb_vorbis_seek_start(m_vorbis))
+				return false;
+			restarted = true;
+			continue;
+		}
+		restarted = false;
+		SDL_AudioStreamPut(m_convert, &m_decoded[0], frames * m_sourceChannels * (int)sizeof(Sint16));
+	}
+}
+
+void MusicStream::read(Uint8* out, int len)
+{
+	size_t size = m_ring.size();
+	size_t read = m_read.load(std::memory_order_relaxed);
+	size_t available = m_written.load(std::memory_order_acquire) - read;
+	size_t bytes = (size_t)len < available ? (size_t)len : available;
+	size_t offset = read % size;
+	size_t first = bytes < size - offset ? bytes : size - offset;
+	memcpy(out, &m_ring[offset], first);
+	memcpy(out + first, &m_ring[0], bytes - first);
+	m_read.store(read + bytes, std::memory_order_release);
+	memset(out + bytes, m_silence, len - bytes);
+}
@@ -0,0 +1,59 @@
+/*
+	Music Stream
+
+	One music track decoded a little at a time into a bounded ring of PCM already in the device format,
+	so a track is never decoded up front or held in memory whole. OGG Vorbis is decoded with stb_vorbis
+	and converted with SDL_AudioStream. At the end of the file it carries on from the start, so looping
+	has no gap.
+
+	The ring has a single writer and a single reader: the loader thread keeps it topped up with refill,
+	and the audio thread takes from it in the music deck's channel effect (read). If the reader catches
+	up with the writer it plays silence rather than wait.
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include <string>
+#include <vector>
+#include <atomic>
+
+#define MUSIC_STREAM_MS 2000 //decoded audio buffered ahead of the deck
+#define MUSIC_DECODE_FRAMES 4096 //source frames decoded per step of refill
+
+struct stb_vorbis;
+
+class MusicStream
+{
+private:
+	stb_vorbis* m_vorbis;
+	int m_sourceChannels;
+	std::vector<Sint16> m_decoded;
+	SDL_AudioStream* m_convert;
+	int m_frameBytes;
+	Uint8 m_silence;
+
+	std::vector<Uint8> m_ring;
+	//Byte counts since the stream opened, the ring index is the count modulo its size
+	std::atomic<size_t> m_written; //loader thread only
+	std::atomic<size_t> m_read; //audio thread only
+
+	MusicStream();
+
+public:
+	/*
+	Returns nullptr if the file can't be decoded this way (not OGG Vorbis), the caller falls back
+	to Mix_LoadMUS.
+	*/
+	static MusicStream* open(const std::string& path, int frequency, Uint16 format, int channels);
+	~MusicStream();
+
+	/*
+	Loader thread. Decodes until the ring is full, false if the file stopped decoding.
+	*/
+	bool refill();
+
+	/*
+	Audio thread. Fills len bytes, with silence for whatever the ring doesn't have yet.
+	*/
+	void read(Uint8* out, int len);
+};
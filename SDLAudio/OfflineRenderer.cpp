@@ -0,0 +1,120 @@
+#include "OfflineRenderer.h"
+#include "Tracer.h"
+#include <iostream>
+#include <cstring>
+
+//WAV fields are little endian whatever the machine is
+static void writeLE(std::ofstream& file, Uint32 value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		file.put((char)((value >> (8 * i)) & 0xFF));
+}
+
+OfflineRenderer::OfflineRenderer(SoftwareMixer* mixer, int frequency)
+{
+	m_mixer = mixer;
+	m_frequency = frequency;
+	m_renderedFrames = 0;
+	m_owedTicks = 0;
+	m_block.resize(AUDIO_CHUNK_SIZE * 2);
+	m_keepSamples = false;
+	m_fileFrames = 0;
+}
+
+OfflineRenderer::~OfflineRenderer()
+{
+	stopRecording();
+}
+
+bool OfflineRenderer::record(const std::string& wavPath, bool keepSamples)
+{
+	stopRecording();
+	m_samples.clear();
+	m_keepSamples = keepSamples;
+	if (wavPath.empty())
+		return true;
+	m_file.open(wavPath.c_str(), std::ios::binary | std::ios::trunc);
+	if (!m_file)
+	{
+		std::cout << "ERROR OfflineRenderer can't write " << wavPath << std::endl;
+		return false;
+	}
+	m_fileFrames = 0;
+	//Sizes are patched in by stopRecording
+	writeWavHeader(0);
+	return true;
+}
+
+void OfflineRenderer::stopRecording()
+{
+	m_keepSamples = false;
+	if (!m_file.is_open())
+		return;
+	m_file.seekp(0);
+	writeWavHeader(m_fileFrames);
+	m_file.close();
+}
+
+void OfflineRenderer::writeWavHeader(Uint32 frames)
+{
+	Uint32 dataBytes = frames * 2 * sizeof(Sint16);
+	m_file.write("RIFF", 4);
+	writeLE(m_file, 36 + dataBytes, 4);
+	m_file.write("WAVEfmt ", 8);
+	writeLE(m_file, 16, 4); //fmt chunk size
+	writeLE(m_file, 1, 2); //PCM
+	writeLE(m_file, 2, 2); //channels
+	writeLE(m_file, m_frequency, 4);
+	writeLE(m_file, m_frequency * 2 * sizeof(Sint16), 4); //bytes per second
+	writeLE(m_file, 2 * sizeof(Sint16), 2); //bytes per frame
+	writeLE(m_file, 16, 2); //bits per sample
+	m_file.write("data", 4);
+	writeLE(m_file, dataBytes, 4);
+}
+
+void OfflineRenderer::advance(int ticks)
+{
+	if (ticks <= 0)
+		return;
+	m_owedTicks += (Uint64)ticks * m_frequency;
+	Uint64 blockTicks = (Uint64)AUDIO_CHUNK_SIZE * 1000;
+	while (m_owedTicks >= blockTicks)
+	{
+		renderBlock();
+		m_owedTicks -= blockTicks;
+	}
+}
+
+void OfflineRenderer::renderBlock()
+{
+	TRACE_ZONE("audio", "Offline render block");
+	memset(&m_block[0], 0, m_block.size() * sizeof(Sint16));
+	m_mixer->mix(&m_block[0], AUDIO_CHUNK_SIZE);
+	m_renderedFrames += AUDIO_CHUNK_SIZE;
+	//Voices that ended in this block are freed before the next one starts
+	m_mixer->pollFinished();
+
+	if (m_keepSamples)
+		m_samples.insert(m_samples.end(), m_block.begin(), m_block.end());
+	if (m_file.is_open())
+	{
+		for (size_t i = 0; i < m_block.size(); ++i)
+			writeLE(m_file, (Uint16)m_block[i], 2);
+		m_fileFrames += AUDIO_CHUNK_SIZE;
+	}
+}
+
+Uint64 OfflineRenderer::getRenderedFrames()
+{
+	return m_renderedFrames;
+}
+
+Uint32 OfflineRenderer::getTime()
+{
+	return (Uint32)(m_renderedFrames * 1000 / m_frequency);
+}
+
+const std::vector<Sint16>& OfflineRenderer::getSamples()
+{
+	return m_samples;
+}
@@ -0,0 +1,53 @@
+/*
+	Offline Renderer
+
+	Drives a SoftwareMixer without an audio device. The mix advances by however many milliseconds of
+	simulation it is given, in fixed AUDIO_CHUNK_SIZE blocks, as fast as the CPU allows, so the same
+	inputs always produce the same samples. Blocks can be kept in memory, written to a 16-bit stereo
+	WAV file, both, or thrown away (headless servers).
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include "AudioBank.h"
+#include "SoftwareMixer.h"
+#include <string>
+#include <vector>
+#include <fstream>
+
+class OfflineRenderer
+{
+private:
+	SoftwareMixer* m_mixer;
+	int m_frequency;
+	Uint64 m_renderedFrames;
+	Uint64 m_owedTicks; //milliseconds times frequency, so no rounding is lost between calls
+	std::vector<Sint16> m_block;
+	std::vector<Sint16> m_samples;
+	bool m_keepSamples;
+	std::ofstream m_file;
+	Uint32 m_fileFrames;
+
+	void renderBlock();
+	void writeWavHeader(Uint32 frames);
+
+public:
+	OfflineRenderer(SoftwareMixer* mixer, int frequency);
+	~OfflineRenderer();
+
+	/*
+	Starts capturing from the next block. An empty path records into memory only.
+	*/
+	bool record(const std::string& wavPath, bool keepSamples);
+	void stopRecording();
+
+	/*
+	Renders every whole block that fits in the time advanced so far.
+	*/
+	void advance(int ticks);
+
+	Uint64 getRenderedFrames();
+	//Milliseconds of audio rendered, the clock offline sounds run on
+	Uint32 getTime();
+	const std::vector<Sint16>& getSamples();
+};
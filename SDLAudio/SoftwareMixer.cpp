@@ -0,0 +1,374 @@
+#include "SoftwareMixer.h"
+#include "Tracer.h"
+#include <iostream>
+
+#if defined __AVX2__
+#include <immintrin.h>
+#elif defined __SSE2__ || defined _M_X64 || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOFTWARE_MIXER_SSE2
+#endif
+
+//acc[0..frames*2) += src * gain, src interleaved stereo
+static void accumulateVoice(float* acc, const Sint16* src, int frames, float gainLeft, float gainRight)
+{
+	int i = 0;
+#if defined __AVX2__
+	__m256 gain = _mm256_setr_ps(gainLeft, gainRight, gainLeft, gainRight, gainLeft, gainRight, gainLeft, gainRight);
+	for (; i + 4 <= frames; i += 4)
+	{
+		__m256 samples = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(src + i * 2))));
+		_mm256_storeu_ps(acc + i * 2, _mm256_add_ps(_mm256_loadu_ps(acc + i * 2), _mm256_mul_ps(samples, gain)));
+	}
+#elif defined SOFTWARE_MIXER_SSE2
+	__m128 gain = _mm_setr_ps(gainLeft, gainRight, gainLeft, gainRight);
+	for (; i + 4 <= frames; i += 4)
+	{
+		__m128i samples = _mm_loadu_si128((const __m128i*)(src + i * 2));
+		//Sign extend by unpacking into the high half and shifting back down
+		__m128 low = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16));
+		__m128 high = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16));
+		_mm_storeu_ps(acc + i * 2, _mm_add_ps(_mm_loadu_ps(acc + i * 2), _mm_mul_ps(low, gain)));
+		_mm_storeu_ps(acc + i * 2 + 4, _mm_add_ps(_mm_loadu_ps(acc + i * 2 + 4), _mm_mul_ps(high, gain)));
+	}
+#endif
+	for (; i < frames; ++i)
+	{
+		acc[i * 2] += src[i * 2] * gainLeft;
+		acc[i * 2 + 1] += src[i * 2 + 1] * gainRight;
+	}
+}
+
+//stream[0..samples) = clamp(stream + acc)
+static void writeStream(Sint16* stream, const float* acc, int samples)
+{
+	int i = 0;
+#if defined __AVX2__
+	for (; i + 16 <= samples; i += 16)
+	{
+		__m256 low = _mm256_add_ps(_mm256_loadu_ps(acc + i), _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(stream + i)))));
+		__m256 high = _mm256_add_ps(_mm256_loadu_ps(acc + i + 8), _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(stream + i + 8)))));
+		//packs works per 128-bit lane, permute puts the four quarters back in order
+		__m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(low), _mm256_cvtps_epi32(high));
+		_mm256_storeu_si256((__m256i*)(stream + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+#elif defined SOFTWARE_MIXER_SSE2
+	for (; i + 8 <= samples; i += 8)
+	{
+		__m128i current = _mm_loadu_si128((const __m128i*)(stream + i));
+		__m128 low = _mm_add_ps(_mm_loadu_ps(acc + i), _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(current, current), 16)));
+		__m128 high = _mm_add_ps(_mm_loadu_ps(acc + i + 4), _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(current, current), 16)));
+		//packs saturates, which is the clamp
+		_mm_storeu_si128((__m128i*)(stream + i), _mm_packs_epi32(_mm_cvtps_epi32(low), _mm_cvtps_epi32(high)));
+	}
+#endif
+	for (; i < samples; ++i)
+	{
+		float value = stream[i] + acc[i];
+		if (value > 32767.0f)
+			value = 32767.0f;
+		else if (value < -32768.0f)
+			value = -32768.0f;
+		stream[i] = (Sint16)value;
+	}
+}
+
+SoftwareMixer::SoftwareMixer()
+{
+	for (int i = 0; i < MAX_SOFTWARE_VOICES; ++i)
+	{
+		m_voices[i].playing = false;
+		m_voices[i].serial = 0;
+		m_voices[i].adpcm = NULL;
+		m_active[i] = false;
+		m_serials[i] = 0;
+	}
+	m_fenceSerial = 0;
+	m_passedFence = 0;
+	m_finished = NULL;
+	m_installed = false;
+	m_stats = NULL;
+	m_accumulator.resize(AUDIO_CHUNK_SIZE * AUDIO_CHANNELS);
+}
+
+SoftwareMixer::~SoftwareMixer()
+{
+	uninstall();
+}
+
+bool SoftwareMixer::install()
+{
+	int frequency, channels;
+	Uint16 format;
+	if (!Mix_QuerySpec(&frequency, &format, &channels) || format != AUDIO_S16SYS || channels != 2)
+	{
+		std::cout << "ERROR SoftwareMixer needs a 16-bit stereo device" << std::endl;
+		return false;
+	}
+	Mix_SetPostMix(&SoftwareMixer::postMix, this);
+	m_installed = true;
+	return true;
+}
+
+void SoftwareMixer::uninstall()
+{
+	if (!m_installed)
+		return;
+	Mix_SetPostMix(NULL, NULL);
+	m_installed = false;
+}
+
+void SoftwareMixer::setFinishedCallback(void (*finished)(int voice))
+{
+	m_finished = finished;
+}
+
+//Mix times are recorded into stats, set it before install
+void SoftwareMixer::setStats(AudioStats* stats)
+{
+	m_stats = stats;
+}
+
+//Only the audio thread pops the ring, so when it has stalled long enough to fill it the command is dropped
+bool SoftwareMixer::post(const MixerCommand& command)
+{
+	if (m_commands.push(command))
+		return true;
+	if (m_stats != NULL)
+		m_stats->countQueueOverflow();
+	return false;
+}
+
+bool SoftwareMixer::play(int voice, Mix_Chunk* chunk, float gainLeft, float gainRight, int loops, Uint32 startFrame, Uint32 delayFrames)
+{
+	if (voice < 0 || voice >= MAX_SOFTWARE_VOICES || chunk == NULL)
+		return false;
+	MixerCommand command;
+	command.type = MIXER_PLAY;
+	command.voice = voice;
+	command.samples = (const Sint16*)chunk->abuf;
+	command.adpcm = NULL;
+	command.frames = chunk->alen / (2 * sizeof(Sint16));
+	command.position = command.frames > 0 ? startFrame % command.frames : 0;
+	command.delay = delayFrames;
+	command.loops = loops;
+	command.gainLeft = gainLeft;
+	command.gainRight = gainRight;
+	command.serial = ++m_serials[voice];
+	m_active[voice] = command.frames > 0 && post(command);
+	return m_active[voice];
+}
+
+bool SoftwareMixer::playAdpcm(int voice, const AdpcmSound* sound, float gainLeft, float gainRight, int loops, Uint32 startFrame, Uint32 delayFrames)
+{
+	if (voice < 0 || voice >= MAX_SOFTWARE_VOICES || sound == NULL)
+		return false;
+	MixerCommand command;
+	command.type = MIXER_PLAY;
+	command.voice = voice;
+	command.samples = NULL;
+	command.adpcm = sound;
+	command.frames = sound->frames;
+	command.position = command.frames > 0 ? startFrame % command.frames : 0;
+	command.delay = delayFrames;
+	command.loops = loops;
+	command.gainLeft = gainLeft;
+	command.gainRight = gainRight;
+	command.serial = ++m_serials[voice];
+	m_active[voice] = command.frames > 0 && post(command);
+	return m_active[voice];
+}
+
+void SoftwareMixer::halt(int voice)
+{
+	if (voice < 0 || voice >= MAX_SOFTWARE_VOICES)
+		return;
+	bool wasPlaying = m_active[voice];
+	m_active[voice] = false;
+	MixerCommand command;
+	command.type = MIXER_HALT;
+	command.voice = voice;
+	post(command);
+	if (wasPlaying && m_finished != NULL)
+		m_finished(voice);
+}
+
+void SoftwareMixer::setGain(int voice, float gainLeft, float gainRight)
+{
+	if (voice < 0 || voice >= MAX_SOFTWARE_VOICES)
+		return;
+	MixerCommand command;
+	command.type = MIXER_GAIN;
+	command.voice = voice;
+	command.gainLeft = gainLeft;
+	command.gainRight = gainRight;
+	post(command);
+}
+
+bool SoftwareMixer::isPlaying(int voice)
+{
+	return voice >= 0 && voice < MAX_SOFTWARE_VOICES && m_active[voice];
+}
+
+Uint32 SoftwareMixer::fence()
+{
+	MixerCommand command;
+	command.type = MIXER_FENCE;
+	command.voice = 0;
+	command.serial = m_fenceSerial + 1;
+	if (!post(command))
+		return 0;
+	return ++m_fenceSerial;
+}
+
+bool SoftwareMixer::fencePassed(Uint32 fence)
+{
+	return (Sint32)(m_passedFence - fence) >= 0;
+}
+
+//Reports voices that ran out since the last call. A voice that was halted or replaced since is skipped
+void SoftwareMixer::pollFinished()
+{
+	MixerFinished finished;
+	while (m_finishedVoices.pop(finished))
+	{
+		if (finished.voice == -1)
+		{
+			m_passedFence = finished.serial;
+			continue;
+		}
+		if (finished.serial != m_serials[finished.voice] || !m_active[finished.voice])
+			continue;
+		m_active[finished.voice] = false;
+		if (m_finished != NULL)
+			m_finished(finished.voice);
+	}
+}
+
+//Runs on the audio thread at the start of every callback
+void SoftwareMixer::applyCommands()
+{
+	MixerCommand command;
+	while (m_commands.pop(command))
+	{
+		MixerVoice& v = m_voices[command.voice];
+		switch (command.type)
+		{
+		case MIXER_PLAY:
+			v.samples = command.samples;
+			v.adpcm = command.adpcm;
+			v.decodedBlock = 0xFFFFFFFF;
+			v.frames = command.frames;
+			v.position = command.position;
+			v.delay = command.delay;
+			v.loops = command.loops;
+			v.gainLeft = command.gainLeft;
+			v.gainRight = command.gainRight;
+			v.serial = command.serial;
+			v.playing = v.frames > 0;
+			break;
+		case MIXER_HALT:
+			v.playing = false;
+			break;
+		case MIXER_GAIN:
+			v.gainLeft = command.gainLeft;
+			v.gainRight = command.gainRight;
+			break;
+		case MIXER_FENCE:
+			{
+				//If the ring is full the game side waits for a later fence
+				MixerFinished finished;
+				finished.voice = -1;
+				finished.serial = command.serial;
+				if (!m_finishedVoices.push(finished) && m_stats != NULL)
+					m_stats->countQueueOverflow();
+			}
+			break;
+		}
+	}
+}
+
+void SoftwareMixer::mix(Sint16* stream, int frames)
+{
+	applyCommands();
+
+	if ((int)m_accumulator.size() < frames * 2)
+		m_accumulator.resize(frames * 2);
+	float* acc = &m_accumulator[0];
+	memset(acc, 0, frames * 2 * sizeof(float));
+
+	bool mixed = false;
+	for (int i = 0; i < MAX_SOFTWARE_VOICES; ++i)
+	{
+		MixerVoice& voice = m_voices[i];
+		if (!voice.playing)
+			continue;
+		mixed = true;
+
+		int written = 0;
+		if (voice.delay > 0)
+		{
+			written = voice.delay < (Uint32)frames ? (int)voice.delay : frames;
+			voice.delay -= written;
+		}
+		while (written < frames && voice.playing)
+		{
+			int count = voice.frames - voice.position;
+			if (count > frames - written)
+				count = frames - written;
+			const Sint16* samples;
+			if (voice.adpcm != NULL)
+			{
+				Uint32 block = voice.position / ADPCM_BLOCK_FRAMES;
+				if (block != voice.decodedBlock)
+				{
+					Adpcm::decodeBlock(*voice.adpcm, block, voice.block);
+					voice.decodedBlock = block;
+				}
+				Uint32 offset = voice.position % ADPCM_BLOCK_FRAMES;
+				if (count > (int)(ADPCM_BLOCK_FRAMES - offset))
+					count = ADPCM_BLOCK_FRAMES - offset;
+				samples = voice.block + offset * 2;
+			}
+			else
+				samples = voice.samples + voice.position * 2;
+			accumulateVoice(acc + written * 2, samples, count, voice.gainLeft, voice.gainRight);
+			written += count;
+			voice.position += count;
+
+			if (voice.position >= voice.frames)
+			{
+				if (voice.loops == 0)
+				{
+					voice.playing = false;
+					//If the ring is somehow full the voice stays active on the game side until it is reused
+					MixerFinished finished;
+					finished.voice = i;
+					finished.serial = voice.serial;
+					if (!m_finishedVoices.push(finished) && m_stats != NULL)
+						m_stats->countQueueOverflow();
+				}
+				else
+				{
+					if (voice.loops > 0)
+						voice.loops--;
+					voice.position = 0;
+				}
+			}
+		}
+	}
+
+	if (mixed)
+		writeStream(stream, acc, frames * 2);
+}
+
+void SoftwareMixer::postMix(void* udata, Uint8* stream, int len)
+{
+	SoftwareMixer* self = (SoftwareMixer*)udata;
+	TRACE_THREAD("Audio callback");
+	TRACE_ZONE("audio", "Software mix");
+	Uint64 start = SDL_GetPerformanceCounter();
+	self->mix((Sint16*)stream, len / (2 * sizeof(Sint16)));
+	if (self->m_stats != NULL)
+		self->m_stats->timeCallback(start, SDL_GetPerformanceCounter());
+}
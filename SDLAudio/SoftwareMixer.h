@@ -0,0 +1,142 @@
+/*
+	Software Mixer
+
+	Optional replacement for SDL_mixer's channel mixing, installed with Mix_SetPostMix so it adds its
+	voices into the stream after SDL_mixer is done with music. Voices are accumulated in float with
+	per-voice left/right gain (distance attenuation and panning folded in), then saturated into the
+	16-bit output. The kernels use SSE2, or AVX2 when the build enables it, with a scalar fallback.
+
+	Only works with the AUDIO_S16SYS stereo output AudioManager opens. Voices are indexed like
+	SDL_mixer channels and report finished voices the same way Mix_ChannelFinished does.
+
+	The game thread never takes the audio device lock. play/halt/setGain post commands to a lock-free
+	ring that the audio callback drains before mixing, and voices that run out are passed back through
+	a second ring that pollFinished drains on the game thread, so the finished callback always runs on
+	the game thread. If the callback stalls long enough to fill the command ring, further commands are
+	dropped and counted as queue overflows in AudioStats.
+*/
+
+#pragma once
+#include "GLHeaders.h"
+#include "AudioBank.h"
+#include "SpscQueue.h"
+#include "AudioStats.h"
+#include "Adpcm.h"
+#include <vector>
+
+#define MAX_SOFTWARE_VOICES 256
+#define MIXER_COMMAND_QUEUE_SIZE 4096
+#define MIXER_FINISHED_QUEUE_SIZE 1024
+
+//Owned by the audio thread
+struct MixerVoice
+{
+	const Sint16* samples; //interleaved stereo
+	Uint32 frames;
+	Uint32 position;
+	Uint32 delay; //frames of silence left before the first sample, for scheduled starts
+	int loops; //-1 loops forever, like Mix_PlayChannel
+	float gainLeft;
+	float gainRight;
+	bool playing;
+	Uint32 serial; //which play command started it
+	//Compressed sounds are expanded one block at a time into the voice's own buffer
+	const AdpcmSound* adpcm;
+	Uint32 decodedBlock;
+	Sint16 block[ADPCM_BLOCK_FRAMES * 2];
+};
+
+enum MixerCommandType
+{
+	MIXER_PLAY,
+	MIXER_HALT,
+	MIXER_GAIN,
+	MIXER_FENCE //passed back through the finished ring with voice -1
+};
+
+struct MixerCommand
+{
+	MixerCommandType type;
+	int voice;
+	const Sint16* samples;
+	const AdpcmSound* adpcm;
+	Uint32 frames;
+	Uint32 position;
+	Uint32 delay;
+	int loops;
+	float gainLeft;
+	float gainRight;
+	Uint32 serial;
+};
+
+struct MixerFinished
+{
+	int voice;
+	Uint32 serial;
+};
+
+class SoftwareMixer
+{
+private:
+	MixerVoice m_voices[MAX_SOFTWARE_VOICES];
+	std::vector<float> m_accumulator;
+	void (*m_finished)(int voice);
+	bool m_installed;
+	AudioStats* m_stats;
+
+	//Game thread's view of the voices
+	bool m_active[MAX_SOFTWARE_VOICES];
+	Uint32 m_serials[MAX_SOFTWARE_VOICES];
+	Uint32 m_fenceSerial;
+	Uint32 m_passedFence;
+
+	SpscQueue<MixerCommand, MIXER_COMMAND_QUEUE_SIZE> m_commands;
+	SpscQueue<MixerFinished, MIXER_FINISHED_QUEUE_SIZE> m_finishedVoices;
+
+	bool post(const MixerCommand& command);
+	void applyCommands();
+	static void postMix(void* udata, Uint8* stream, int len);
+
+public:
+	SoftwareMixer();
+	~SoftwareMixer();
+
+	/*
+	Hooks the mixer into SDL_mixer. Returns false if the device isn't 16-bit stereo.
+	*/
+	bool install();
+	void uninstall();
+
+	/*
+	Called on the game thread, from halt or from pollFinished for voices that ran out.
+	*/
+	void setFinishedCallback(void (*finished)(int voice));
+	void setStats(AudioStats* stats);
+	void pollFinished();
+
+	/*
+	Starts the chunk startFrame frames in, so a sound can resume where it left off. delayFrames of
+	silence are mixed first, counted from the next callback, for sounds scheduled slightly ahead.
+	Returns false if the command ring is full because the audio callback has stalled.
+	*/
+	bool play(int voice, Mix_Chunk* chunk, float gainLeft, float gainRight, int loops, Uint32 startFrame = 0, Uint32 delayFrames = 0);
+	/*
+	Same as play for a sound kept as IMA-ADPCM, it must stay alive while the voice plays.
+	*/
+	bool playAdpcm(int voice, const AdpcmSound* sound, float gainLeft, float gainRight, int loops, Uint32 startFrame = 0, Uint32 delayFrames = 0);
+	void halt(int voice);
+	void setGain(int voice, float gainLeft, float gainRight);
+	bool isPlaying(int voice);
+	/*
+	Marks the current point in the command stream. Once fencePassed returns true for it, the audio thread
+	has applied every command posted before it, so nothing halted by then is still being mixed. Only
+	noticed through pollFinished. Returns 0 if the command ring is full, try again later.
+	*/
+	Uint32 fence();
+	bool fencePassed(Uint32 fence);
+
+	/*
+	Adds every playing voice into an interleaved stereo stream. Runs on the audio thread.
+	*/
+	void mix(Sint16* stream, int frames);
+};
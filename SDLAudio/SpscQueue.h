@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+
+/*
+	Fixed size lock-free ring for exactly one producer thread and one consumer thread.
+
+	Used between the game thread and the audio callback, where neither side may wait on the other.
+	Capacity must be a power of two, one slot is never used so full and empty can be told apart.
+*/
+template <typename T, size_t Capacity>
+class SpscQueue
+{
+private:
+	static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of two");
+
+	T m_items[Capacity];
+	//Written only by the consumer
+	std::atomic<size_t> m_head;
+	//Written only by the producer
+	std::atomic<size_t> m_tail;
+
+public:
+	SpscQueue() : m_head(0), m_tail(0) {}
+
+	//Producer side. Returns false without blocking if the ring is full
+	bool push(const T& item)
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t next = (tail + 1) & (Capacity - 1);
+		if (next == m_head.load(std::memory_order_acquire))
+			return false;
+		m_items[tail] = item;
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	//Consumer side. Returns false if the ring is empty
+	bool pop(T& item)
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+		item = m_items[head];
+		m_head.store((head + 1) & (Capacity - 1), std::memory_order_release);
+		return true;
+	}
+
+	bool empty()
+	{
+		return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+	}
+};
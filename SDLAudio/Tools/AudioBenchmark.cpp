@@ -0,0 +1,136 @@
+/*
+	Audio Benchmark
+
+	Headless stress test for AudioManager, meant for CI machines without a sound card. Runs on SDL's
+	dummy driver unless SDL_AUDIODRIVER is already set (disk works too), fires spatialized sound effects
+	at random positions around a fixed listener at 60 updates per second, then prints the game-side
+	cost per frame and AudioManager's stats:
+
+		AudioBenchmark [seconds] [requests per second] [--channels | --offline] [--trace file.json]
+
+	--channels mixes on SDL_mixer channels instead of the software mixer AudioManager defaults to.
+	--offline renders through AudioManager's offline mode with no device at all, as fast as possible.
+	--trace records the run with Tracer and writes it as a Chrome trace.
+
+	Links against the engine like the game does, run it from the game's root directory so the sound
+	effects (or SFX.pack) are found.
+*/
+
+#include "AudioManager.h"
+#include "Tracer.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+#define BENCHMARK_FRAME_MS 16
+#define BENCHMARK_LOAD_TIMEOUT_MS 10000
+
+int main(int argc, char* argv[])
+{
+	int seconds = 10;
+	int requestsPerSecond = 5000;
+	bool software = true;
+	bool offline = false;
+	const char* tracePath = NULL;
+	int position = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--channels") == 0)
+			software = false;
+		else if (strcmp(argv[i], "--offline") == 0)
+			offline = true;
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else if (position++ == 0)
+			seconds = atoi(argv[i]);
+		else
+			requestsPerSecond = atoi(argv[i]);
+	}
+
+	if (SDL_getenv("SDL_AUDIODRIVER") == NULL)
+		SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_Init(SDL_INIT_AUDIO) < 0)
+	{
+		std::cout << "ERROR SDL_Init: " << SDL_GetError() << std::endl;
+		return 1;
+	}
+
+	AudioManager::setOfflineRender(offline);
+	AudioManager* audio = AudioManager::getInstance();
+	if (!offline && !audio->setSoftwareMixer(software))
+	{
+		std::cout << "ERROR Couldn't switch mixers" << std::endl;
+		return 1;
+	}
+
+	std::vector<int> sfx;
+	for (size_t i = 0; i < AUDIO_BANK_SIZE; ++i)
+	{
+		if (!s_audioBank[i].music)
+			sfx.push_back(s_audioBank[i].id);
+	}
+	audio->preload(sfx);
+	Uint32 loadStart = SDL_GetTicks();
+	for (size_t i = 0; i < sfx.size(); ++i)
+	{
+		while (audio->getLoadState(sfx[i]) == AUDIO_LOADING && SDL_GetTicks() - loadStart < BENCHMARK_LOAD_TIMEOUT_MS)
+			SDL_Delay(1);
+		if (audio->getLoadState(sfx[i]) != AUDIO_READY)
+			std::cout << "WARNING sound effect " << sfx[i] << " did not load" << std::endl;
+	}
+
+	audio->setListenerPosition(0, 0);
+	audio->getStats().reset();
+	if (tracePath != NULL)
+		Tracer::start();
+
+	std::mt19937 random(1);
+	std::uniform_int_distribution<size_t> pickSound(0, sfx.size() - 1);
+	//Spread sources past the audible range so virtualization is exercised too
+	std::uniform_real_distribution<float> pickPosition(-2.0f * MAX_DISTANCE, 2.0f * MAX_DISTANCE);
+
+	int frames = seconds * 1000 / BENCHMARK_FRAME_MS;
+	double requestsPerFrame = requestsPerSecond * BENCHMARK_FRAME_MS / 1000.0;
+	double owed = 0;
+	double totalUs = 0;
+	double maxUs = 0;
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		TRACE_FRAME();
+		Uint32 frameStart = SDL_GetTicks();
+		Uint64 start = SDL_GetPerformanceCounter();
+		owed += requestsPerFrame;
+		for (; owed >= 1.0; owed -= 1.0)
+			audio->playSound(sfx[pickSound(random)], pickPosition(random), pickPosition(random));
+		audio->update(BENCHMARK_FRAME_MS);
+		double us = (SDL_GetPerformanceCounter() - start) * 1000000.0 / frequency;
+		totalUs += us;
+		if (us > maxUs)
+			maxUs = us;
+
+		Uint32 elapsed = SDL_GetTicks() - frameStart;
+		if (!offline && elapsed < BENCHMARK_FRAME_MS)
+			SDL_Delay(BENCHMARK_FRAME_MS - elapsed);
+	}
+
+	if (offline)
+		std::cout << "Offline render" << std::endl;
+	else
+		std::cout << "Driver: " << SDL_GetCurrentAudioDriver() << (software ? ", software mixer" : ", SDL_mixer channels") << std::endl;
+	std::cout << frames << " frames, " << requestsPerSecond << " requests per second" << std::endl;
+	std::cout << "Game thread per frame: average " << (frames > 0 ? totalUs / frames : 0) << "us, max " << maxUs << "us" << std::endl;
+	audio->getStats().print(std::cout);
+	if (tracePath != NULL)
+	{
+		Tracer::stop();
+		if (Tracer::writeChromeTrace(tracePath))
+			std::cout << "Trace written to " << tracePath << std::endl;
+	}
+
+	AudioManager::release();
+	Mix_CloseAudio();
+	SDL_Quit();
+	return 0;
+}
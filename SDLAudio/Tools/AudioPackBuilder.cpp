@@ -0,0 +1,55 @@
+/*
+	Audio Pack Builder
+
+	Offline tool that converts every sound effect in AudioBank.h into one pre-converted PCM pack.
+	Run it from the game's root directory whenever a sound effect changes:
+
+		AudioPackBuilder [output path]
+
+	The mixer is opened on the dummy driver with the same format the game uses, so Mix_LoadWAV does
+	exactly the decoding and resampling the game would otherwise do at startup.
+*/
+
+#include "AudioBank.h"
+#include "AudioPack.h"
+#include <iostream>
+
+int main(int argc, char* argv[])
+{
+	std::string output = argc > 1 ? argv[1] : PATH_SFX_PACK;
+
+	SDL_setenv("SDL_AUDIODRIVER", "dummy", 1);
+	if (SDL_Init(SDL_INIT_AUDIO) < 0 || Mix_OpenAudio(AUDIO_FREQUENCY, AUDIO_FORMAT, AUDIO_CHANNELS, AUDIO_CHUNK_SIZE) < 0)
+	{
+		std::cout << "ERROR Opening Mix_OpenAudio: " << Mix_GetError() << std::endl;
+		return 1;
+	}
+
+	int frequency, channels;
+	Uint16 format;
+	Mix_QuerySpec(&frequency, &format, &channels);
+
+	std::map<int, Mix_Chunk*> chunks;
+	for (size_t i = 0; i < AUDIO_BANK_SIZE; ++i)
+	{
+		if (s_audioBank[i].music)
+			continue;
+		Mix_Chunk* chunk = Mix_LoadWAV(s_audioBank[i].path);
+		if (chunk == NULL)
+		{
+			std::cout << "ERROR Mix_LoadWAV " << s_audioBank[i].path << ": " << Mix_GetError() << std::endl;
+			return 1;
+		}
+		std::cout << s_audioBank[i].path << ": " << chunk->alen << " bytes" << std::endl;
+		chunks[s_audioBank[i].id] = chunk;
+	}
+
+	bool written = AudioPack::build(output, chunks, frequency, format, channels);
+	std::cout << (written ? "Wrote " : "ERROR Failed to write ") << output << std::endl;
+
+	for (std::map<int, Mix_Chunk*>::iterator it = chunks.begin(); it != chunks.end(); ++it)
+		Mix_FreeChunk(it->second);
+	Mix_CloseAudio();
+	SDL_Quit();
+	return written ? 0 : 1;
+}